@@ -0,0 +1,279 @@
+/**
+ *
+ * quicklens - a fast gravitational lensing visualization tool
+ *
+ * math_bench.cpp: Microbenchmarks of the primitives in math.cpp, independent of the GUI
+ *
+ **/
+
+#include <iostream>	// std::cout
+#include <fstream>	// std::ofstream
+#include <iomanip>	// std::setw
+#include <string>
+#include <vector>
+#include <map>
+#include <new>	// std::bad_alloc
+#include <chrono>	// std::chrono::steady_clock
+#include <cmath>	// fabs
+#include <cstdlib>	// std::strtol, std::strtod
+#include <algorithm>	// std::sort, std::min, std::max
+#include <opencv2/core/core.hpp>
+
+#include "math.h"
+#include "autotune.h"
+#include "cpu_dispatch.h"
+
+using cv::Mat;
+using std::vector;
+
+// Results of the kernels are accumulated here, so the compiler cannot drop the calls
+static volatile double sink = 0.;
+
+/**
+ * @brief Settings and output of the benchmark run
+ */
+struct benchT
+{
+	int runs = 15;			// Samples per case
+	double budget = 10.;		// Max. seconds per case (at least 3 samples are taken)
+	int max_size = 16384;		// Larger cases are skipped
+	std::string filter;		// Only run cases whose name contains this
+	std::ofstream csv;
+};
+
+/**
+ * Take timed samples of a kernel and report median, median absolute deviation and minimum. Each
+ * sample repeats the kernel until it takes at least 1 ms (calibrated in the warm-up), so that short
+ * kernels are not dominated by the clock resolution.
+ *
+ * @param bench Settings and output
+ * @param name Name of the primitive
+ * @param size Description of the input size (e.g. "4096x4096")
+ * @param elements Number of elements processed per call (for the time per element)
+ * @param kernel Kernel to measure
+ */
+template <class kernelT>
+static void run_case(benchT &bench, const std::string &name, const std::string &size, double elements, kernelT kernel)
+{
+	using clock = std::chrono::steady_clock;
+
+	// Warm-up, and calibration of the repetitions per sample
+	int reps = 1;
+	double warmup;
+	while (true)
+	{
+		clock::time_point start = clock::now();
+		for (int r = 0; r < reps; ++r)
+			kernel();
+		warmup = std::chrono::duration<double>(clock::now() - start).count();
+		if (warmup >= 1e-3 or reps >= (1 << 20))
+			break;
+		reps *= 2;
+	}
+	int runs = std::max(3, std::min(bench.runs, static_cast<int>(bench.budget / warmup)));
+
+	vector<double> samples;
+	for (int n = 0; n < runs; ++n)
+	{
+		clock::time_point start = clock::now();
+		for (int r = 0; r < reps; ++r)
+			kernel();
+		samples.push_back(std::chrono::duration<double, std::nano>(clock::now() - start).count() / reps);
+	}
+
+	// Median and median absolute deviation (robust against outliers, e.g. preemption)
+	std::sort(samples.begin(), samples.end());
+	double median = samples[runs/2];
+	vector<double> deviations;
+	for (double s : samples)
+		deviations.push_back(std::fabs(s - median));
+	std::sort(deviations.begin(), deviations.end());
+	double mad = deviations[runs/2];
+
+	std::cout << std::left << std::setw(36) << name << std::setw(12) << size << std::right << std::fixed;
+	std::cout << std::setprecision(0) << std::setw(14) << median << std::setw(12) << mad;
+	std::cout << std::setw(14) << samples.front() << std::setprecision(3) << std::setw(12) << median / elements;
+	std::cout << std::setw(6) << runs << std::endl;
+	if (bench.csv.is_open())
+	{
+		bench.csv << name << "," << size << "," << elements << "," << runs << "," << reps << "," << median << ",";
+		bench.csv << mad << "," << samples.front() << "," << median / elements << std::endl;
+	}
+}
+
+/**
+ * Check whether a case is selected by the filter and the size limit
+ * @param bench Settings
+ * @param name Name of the primitive
+ * @param size Largest side of the input
+ * @return Whether to run the case
+ */
+static bool selected(const benchT &bench, const std::string &name, int size)
+{
+	return name.find(bench.filter) != std::string::npos and size <= bench.max_size;
+}
+
+/**
+ * Split the command line into options "--key=value" (as in main.cpp)
+ */
+static void parse_cmdline(int argc, char** argv, std::map<std::string, std::string> &opts)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0)
+			opts["help"] = "";
+		else if (eq == std::string::npos)
+			opts[arg.substr(2)] = "";
+		else
+			opts[arg.substr(2, eq-2)] = arg.substr(eq+1);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	using std::cout;
+	using std::endl;
+
+	std::map<std::string, std::string> opts;
+	parse_cmdline(argc, argv, opts);
+	if (opts.count("help"))
+	{
+		cout << "Usage: math_bench [options]" << endl;
+		cout << "Options:" << endl;
+		cout << "  --filter=NAME    Only run the primitives whose name contains NAME" << endl;
+		cout << "  --max-size=N     Skip inputs larger than N px per side (default: 16384)" << endl;
+		cout << "  --runs=N         Samples per case (default: 15)" << endl;
+		cout << "  --budget=SECONDS Max. time per case, at least 3 samples are taken (default: 10)" << endl;
+		cout << "  --threads=N      Number of threads (default: all)" << endl;
+		cout << "  --csv=FILE       Also write the results as CSV" << endl;
+		return -1;
+	}
+
+	benchT bench;
+	if (opts.count("runs"))
+		bench.runs = std::max(3, static_cast<int>(std::strtol(opts["runs"].c_str(), nullptr, 0)));
+	if (opts.count("budget"))
+		bench.budget = std::strtod(opts["budget"].c_str(), nullptr);
+	if (opts.count("max-size"))
+		bench.max_size = static_cast<int>(std::strtol(opts["max-size"].c_str(), nullptr, 0));
+	if (opts.count("filter"))
+		bench.filter = opts["filter"];
+	if (opts.count("threads"))
+		cv::setNumThreads(static_cast<int>(std::strtol(opts["threads"].c_str(), nullptr, 0)));
+	if (opts.count("csv"))
+	{
+		bench.csv.open(opts["csv"]);
+		if (!bench.csv.is_open())
+		{
+			cout << "Error writing " << opts["csv"] << endl;
+			return -1;
+		}
+		bench.csv << "primitive,size,elements,runs,reps_per_run,median_ns,mad_ns,min_ns,median_ns_per_element" << endl;
+	}
+	select_isa();
+	cout << cv::getNumThreads() << " threads" << endl << endl;
+	cout << std::left << std::setw(36) << "primitive" << std::setw(12) << "size" << std::right << std::setw(14);
+	cout << "median [ns]" << std::setw(12) << "MAD [ns]" << std::setw(14) << "min [ns]" << std::setw(12) << "ns/element";
+	cout << std::setw(6) << "runs" << endl;
+
+	/**
+	 * Per-pixel helpers of the renderers: coordinates of a canvas twice the lens size around it
+	 * (half of them outside the lens, as for a lens placed on a larger canvas)
+	 */
+	const int len = 2048;
+	const int n_coords = 1 << 16;
+	vector<double> coords(n_coords);
+	vector<int> int_coords(n_coords);
+	cv::RNG rng(12345);
+	for (int k = 0; k < n_coords; ++k)
+	{
+		coords[k] = rng.uniform(-0.5 * len, 1.5 * len);
+		int_coords[k] = static_cast<int>(coords[k]);
+	}
+	std::string coord_size = std::to_string(n_coords) + "@" + std::to_string(len);
+	if (selected(bench, "relocate(double)", len))
+		run_case(bench, "relocate(double)", coord_size, n_coords, [&]
+		{
+			int sum = 0;
+			for (double c : coords)
+				sum += relocate(c, len);
+			sink = sink + sum;
+		});
+	if (selected(bench, "relocate(int)", len))
+		run_case(bench, "relocate(int)", coord_size, n_coords, [&]
+		{
+			int sum = 0;
+			for (int c : int_coords)
+				sum += relocate(c, len);
+			sink = sink + sum;
+		});
+	if (selected(bench, "exp_fall_off", len))
+		run_case(bench, "exp_fall_off", coord_size, n_coords, [&]
+		{
+			double sum = 0.;
+			for (int c : int_coords)
+				sum += exp_fall_off(c, len, 0.5 * len, len - 1.);
+			sink = sink + sum;
+		});
+	if (selected(bench, "relocate_and_compute_exp_falloff", len))
+		run_case(bench, "relocate_and_compute_exp_falloff", coord_size, n_coords, [&]
+		{
+			double sum = 0.;
+			for (int c : int_coords)
+			{
+				int safe;
+				sum += relocate_and_compute_exp_falloff(c, len, 0.5 * len, len - 1., safe) + safe;
+			}
+			sink = sink + sum;
+		});
+
+	// Green's function kernels of the padded DFT (twice the lens size; 16384^2 doubles take 2 GB)
+	const int green_sizes[] = {2048, 4096, 8192, 16384};
+	for (int n : green_sizes)
+	{
+		if (!selected(bench, "fill_green_fct", n))
+			continue;
+		try
+		{
+			Mat green = Mat::zeros(n, n, CV_64FC1);
+			run_case(bench, "fill_green_fct", std::to_string(n) + "x" + std::to_string(n),
+					static_cast<double>(n) * n, [&]{ fill_green_fct(green); });
+		}
+		catch (std::bad_alloc &)
+		{
+			cout << "fill_green_fct " << n << "x" << n << ": skipped (out of memory)" << endl;
+		}
+		catch (cv::Exception &e)
+		{
+			cout << "fill_green_fct " << n << "x" << n << ": skipped (" << e.what() << ")" << endl;
+		}
+	}
+
+	// Full-map finite differences and the median on a smooth field (the synthetic lens scene)
+	const int map_sizes[2][2] = {{1920, 1080}, {4096, 4096}};
+	for (const int *s : map_sizes)
+	{
+		std::string size = std::to_string(s[0]) + "x" + std::to_string(s[1]);
+		double pixels = static_cast<double>(s[0]) * s[1];
+		int side = std::max(s[0], s[1]);
+		bool run_deriv_x = selected(bench, "deriv_x", side);
+		bool run_deriv_y = selected(bench, "deriv_y", side);
+		bool run_median = selected(bench, "calculate_median", side);
+		if (!(run_deriv_x or run_deriv_y or run_median))
+			continue;
+		Mat field, image, result;
+		make_synthetic_scene(s[0], s[1], field, image);
+		image.release();
+
+		if (run_deriv_x)
+			run_case(bench, "deriv_x", size, pixels, [&]{ deriv_x(field, result); });
+		if (run_deriv_y)
+			run_case(bench, "deriv_y", size, pixels, [&]{ deriv_y(field, result); });
+		if (run_median)
+			run_case(bench, "calculate_median", size, pixels, [&]{ sink = sink + calculate_median(field); });
+	}
+
+	return 0;
+}
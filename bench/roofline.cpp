@@ -0,0 +1,307 @@
+/**
+ *
+ * quicklens - a fast gravitational lensing visualization tool
+ *
+ * roofline.cpp: Throughput and memory traffic of the render and critical curve kernels, compared
+ * to the memory bandwidth of the machine (STREAM triad)
+ *
+ **/
+
+#include <iostream>	// std::cout
+#include <fstream>	// std::ofstream
+#include <sstream>	// std::istringstream
+#include <iomanip>	// std::setw
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>	// std::chrono::steady_clock
+#include <cstdlib>	// std::strtol
+#include <algorithm>	// std::nth_element, std::max
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "lens.h"
+#include "renderer.h"
+#include "screen_io.h"
+#include "image_io.h"
+#include "autotune.h"
+#include "cpu_dispatch.h"
+
+using cv::Mat;
+using std::vector;
+
+/**
+ * @brief Class for OpenCV parallelization: STREAM triad a = b + s*c
+ */
+class Parallel_triad : public cv::ParallelLoopBody
+{
+	private:
+		double *a;
+		const double *b;
+		const double *c;
+		double s;
+	public:
+		Parallel_triad(double *a_, const double *b_, const double *c_, double s_) : a(a_), b(b_), c(c_), s(s_) {}
+
+		virtual void operator()(const cv::Range &range) const
+		{
+			for (int k = range.start; k < range.end; ++k)
+				a[k] = b[k] + s * c[k];
+		}
+};
+
+/**
+ * Measure the memory bandwidth with the STREAM triad on all threads (24 bytes per element, the
+ * best of several runs as in STREAM)
+ * @param n Number of elements per array (the arrays have to exceed the caches by far)
+ * @param runs Number of runs
+ * @return Bandwidth (GB/s)
+ */
+static double triad_bandwidth(int n, int runs)
+{
+	vector<double> a(n, 0.), b(n, 1.), c(n, 2.);
+	double best = 0.;
+	for (int r = 0; r <= runs; ++r)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		cv::parallel_for_(cv::Range(0, n), Parallel_triad(a.data(), b.data(), c.data(), 3.));
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		if (r > 0)
+			best = std::max(best, 24. * n / elapsed.count() * 1e-9);
+	}
+	return best;
+}
+
+/**
+ * Measure the median time of a kernel (after one warm-up run)
+ * @param kernel Kernel to run
+ * @param runs Number of runs
+ * @return Median time (s)
+ */
+template <class kernelT>
+static double time_kernel(kernelT kernel, int runs)
+{
+	kernel();
+	vector<double> times;
+	for (int r = 0; r < runs; ++r)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		kernel();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		times.push_back(elapsed.count());
+	}
+	std::nth_element(times.begin(), times.begin() + runs/2, times.end());
+	return times[runs/2];
+}
+
+/**
+ * @brief Measured throughput of a kernel and its modelled memory traffic per pixel
+ */
+struct reportT
+{
+	std::string kernel;
+	std::string variant;
+	double pixels = 0.;
+	double seconds = 0.;	// 0: traffic model only
+	double deflection = 0.;	// Bytes per pixel: deflection field reads
+	double source = 0.;	// Source taps
+	double overlay = 0.;	// Overlay reads
+	double frame = 0.;	// Frame writes
+	double fields = 0.;	// Other map traffic (critical curve pass)
+
+	double bytes() const { return deflection + source + overlay + frame + fields; }
+	double gpix_per_s() const { return seconds > 0. ? pixels / seconds * 1e-9 : 0.; }
+	double gb_per_s() const { return gpix_per_s() * bytes(); }
+};
+
+/**
+ * Split the command line into positional arguments and options "--key=value" (as in main.cpp)
+ */
+static void parse_cmdline(int argc, char** argv, vector<std::string> &args, std::map<std::string, std::string> &opts)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0)
+		{
+			args.push_back(arg);
+			continue;
+		}
+		size_t eq = arg.find('=');
+		if (eq == std::string::npos)
+			opts[arg.substr(2)] = "";
+		else
+			opts[arg.substr(2, eq-2)] = arg.substr(eq+1);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	using std::cout;
+	using std::endl;
+
+	vector<std::string> args;
+	std::map<std::string, std::string> opts;
+	parse_cmdline(argc, argv, args, opts);
+	if (opts.count("help") or args.size() == 1)
+	{
+		cout << "Usage: roofline [LENS SOURCE] [options]" << endl;
+		cout << "Options:" << endl;
+		cout << "  --canvas=WxH     Size of the synthetic scene (default: 1920x1080; with files: their overlap)" << endl;
+		cout << "  --threads=N      Number of threads (default: all)" << endl;
+		cout << "  --runs=N         Timed runs per kernel, the median is reported (default: 10)" << endl;
+		cout << "  --csv=FILE       Also write the results as CSV" << endl;
+		return -1;
+	}
+	int threads = opts.count("threads") ? static_cast<int>(std::strtol(opts["threads"].c_str(), nullptr, 0)) : 0;
+	int runs = opts.count("runs") ? std::max(1, static_cast<int>(std::strtol(opts["runs"].c_str(), nullptr, 0))) : 10;
+	if (threads > 0)
+		cv::setNumThreads(threads);
+	select_isa();
+
+	// Scene: lens and source files or the synthetic scene of the autotuner
+	Mat kappa, image;
+	int w = 1920, h = 1080;
+	if (args.size() >= 2)
+	{
+		if (!read_kappa(args[0], kappa) or !read_source(args[1], false, image))
+		{
+			cout << "Error opening " << args[0] << " or " << args[1] << endl;
+			return -1;
+		}
+		w = std::min(kappa.cols, image.cols);
+		h = std::min(kappa.rows, image.rows);
+	}
+	char sep;
+	if (opts.count("canvas") and !(std::istringstream(opts["canvas"]) >> w >> sep >> h and sep == 'x' and w > 0 and h > 0))
+	{
+		cout << "Canvas size has to be given as WxH" << endl;
+		return -1;
+	}
+	if (args.empty())
+		make_synthetic_scene(w, h, kappa, image);
+	cout << "Canvas " << w << "x" << h << ", " << cv::getNumThreads() << " threads, " << isa_names[active_isa()];
+	cout << " kernels, median of " << runs << " runs" << endl;
+
+	// Bandwidth peak: 3 arrays of 128 MB
+	double peak = triad_bandwidth(1 << 24, runs);
+	cout << "STREAM triad: " << peak << " GB/s" << endl << endl;
+
+	vector<reportT> reports;
+	sourceT src(image, w/2, h/2);
+	const char *format_names[] = {"f64", "f32", "f16", "i16"};
+	const double format_bytes[] = {8., 4., 2., 2.};
+	for (int f = DEFLECTION_F64; f <= DEFLECTION_I16; ++f)
+	{
+		cout << "Creating lens (" << format_names[f] << " deflection)..." << endl;
+		Mat kappa_copy = kappa.clone();
+		lensT lens(kappa_copy, w/2, h/2, false, static_cast<deflection_formatT>(f));
+		lens.weight = 1.;
+
+		/**
+		 * Interactive renderer (Parallel_renderer) on a headless screen showing the whole canvas at 
+		 * full resolution, without overlays. (The render call also prepares the source area and marks 
+		 * the source center for the overlay modes that show it)
+		 */
+		screenT screen(nullptr, w, h, w, h, lens, src, w, h);
+		screen.set_overlay_mode(0);
+		reportT render;
+		render.kernel = "Parallel_renderer";
+		render.variant = std::string(format_names[f]) + " deflection";
+		render.pixels = static_cast<double>(w) * h;
+		render.seconds = time_kernel([&]{ screen.render_lensed_image(false); }, runs);
+
+		/**
+		 * Traffic model per pixel: both deflection components, 2x2 bilinear taps on each of the 3
+		 * source planes for the pixels that receive source light, and the lensed and final image 
+		 * writes (without overlays, the final row is a copy of the lensed row). (The int16 tile scales 
+		 * are shared by 64x64 pixels and neglected)
+		 */
+		Mat frame(h, w, CV_8UC3), gray;
+		cv::parallel_for_(cv::Range(0, h), Parallel_band_renderer(&lens, &src, frame, 0), render_stripes(h));
+		cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+		double lit = cv::countNonZero(gray) / render.pixels;
+		render.deflection = 2. * format_bytes[f];
+		render.source = 12. * lit;
+		render.frame = 3. + 3. + 3.;
+		reports.push_back(render);
+
+		// Band renderer of the posters over the whole canvas (lensed image only)
+		reportT band = render;
+		band.kernel = "Parallel_band_renderer";
+		band.seconds = time_kernel([&]{ cv::parallel_for_(cv::Range(0, h),
+				Parallel_band_renderer(&lens, &src, frame, 0), render_stripes(h)); }, runs);
+		band.frame = 3.;
+		reports.push_back(band);
+
+		// The overlays and the critical curve pass do not depend on the deflection format
+		if (f != DEFLECTION_F64)
+			continue;
+
+		/**
+		 * Interactive renderer with kappa and critical curve overlays (mode 4): additionally reads 
+		 * the critical curve and caustic maps and the BGRA kappa layer
+		 */
+		screen.set_overlay_mode(4);
+		reportT overlays = render;
+		overlays.variant = "f64 deflection, overlays";
+		overlays.seconds = time_kernel([&]{ screen.render_lensed_image(false); }, runs);
+		overlays.overlay = 1. + 1. + 4.;
+		reports.push_back(overlays);
+
+		reportT cc;
+		cc.kernel = "critical curves";
+		cc.variant = "f64 kappa";
+		cc.pixels = render.pixels;
+		cc.seconds = time_kernel([&]{ lens.update_cc_and_caustics(false); }, runs);
+
+		/**
+		 * Traffic model per pixel (kappa element size ks): unit map (ks), kappa + shear (3 ks),
+		 * 1 - weight * sum (3 ks), separable Gaussian blur (4 ks), sign map (ks + 1), contour
+		 * tracing including its internal copy (3), contour and caustic maps (3)
+		 */
+		double ks = lens.get_kappa().elemSize();
+		cc.fields = 12. * ks + 7.;
+		reports.push_back(cc);
+	}
+
+	// Table: throughput, traffic per pixel and achieved bandwidth relative to the triad peak
+	cout << endl << std::left << std::setw(28) << "kernel" << std::setw(26) << "variant" << std::right;
+	cout << std::setw(9) << "ms" << std::setw(9) << "Gpix/s" << std::setw(8) << "B/px" << std::setw(9) << "GB/s";
+	cout << std::setw(8) << "peak" << "  bound" << endl;
+	cout << std::fixed;
+	for (const reportT &r : reports)
+	{
+		cout << std::left << std::setw(28) << r.kernel << std::setw(26) << r.variant << std::right;
+		if (r.seconds > 0.)
+		{
+			double fraction = r.gb_per_s() / peak;
+			cout << std::setprecision(2) << std::setw(9) << r.seconds * 1e3 << std::setprecision(3);
+			cout << std::setw(9) << r.gpix_per_s() << std::setprecision(1) << std::setw(8) << r.bytes();
+			cout << std::setw(9) << r.gb_per_s() << std::setw(7) << 100. * fraction << "%";
+			cout << ((fraction > 0.6) ? "  bandwidth" : "  compute/latency") << endl;
+		}
+		else
+			cout << std::setw(18) << "-" << std::setprecision(1) << std::setw(8) << r.bytes() << endl;
+	}
+
+	if (opts.count("csv"))
+	{
+		std::ofstream csv(opts["csv"]);
+		csv << "kernel,variant,width,height,threads,isa,ms,gpix_per_s,bytes_deflection,bytes_source,";
+		csv << "bytes_overlay,bytes_frame,bytes_fields,bytes_per_px,gb_per_s,triad_gb_per_s" << endl;
+		for (const reportT &r : reports)
+		{
+			csv << r.kernel << "," << r.variant << "," << w << "," << h << "," << cv::getNumThreads() << ",";
+			csv << isa_names[active_isa()] << "," << r.seconds * 1e3 << "," << r.gpix_per_s() << ",";
+			csv << r.deflection << "," << r.source << "," << r.overlay << "," << r.frame << "," << r.fields << ",";
+			csv << r.bytes() << "," << r.gb_per_s() << "," << peak << endl;
+		}
+		if (!csv.good())
+		{
+			cout << "Error writing " << opts["csv"] << endl;
+			return -1;
+		}
+	}
+	return 0;
+}
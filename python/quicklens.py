@@ -0,0 +1,234 @@
+"""
+ctypes binding of the C interface of libquicklens (src/quicklens_c.h).
+
+NumPy arrays are passed as strided buffers without copies: convergence maps and source images are
+read in place (in any memory order), deflection fields and the convergence map of a lens are
+returned as read-only views of its storage, and frames are rendered directly into the array.
+ctypes releases the GIL during every call, so other Python threads keep running while a lens is
+computed or a frame is rendered on the internal thread pool.
+
+The library is loaded from $QUICKLENS_LIB, or libquicklens.so next to this file or in the parent
+directory (build it with "make lib").
+
+Example:
+    import quicklens
+    lens = quicklens.Lens.load("examples/lens3_galaxy_cluster.fits")
+    source = quicklens.Source.load("examples/source4_heidelberg.jpg")
+    renderer = quicklens.Renderer(lens, source, 1024, 768)
+    renderer.set_weight(1.5)
+    frame = renderer.render()           # (768, 1024, 3) uint8, BGR
+    alpha1 = lens.deflection(1)         # view of the x deflection field
+"""
+
+import ctypes
+import os
+
+import numpy as np
+
+API_VERSION = 1
+
+# Element types (enum ql_dtype) and storage formats of the deflection field (enum ql_deflection_format)
+_DTYPES = [np.uint8, np.uint16, np.int16, np.float16, np.float32, np.float64]
+DEFLECTION_F64, DEFLECTION_F32, DEFLECTION_F16, DEFLECTION_I16 = range(4)
+
+
+class _Buffer(ctypes.Structure):
+    _fields_ = [("data", ctypes.c_void_p),
+                ("ndim", ctypes.c_int),
+                ("dtype", ctypes.c_int),
+                ("shape", ctypes.c_int64 * 3),
+                ("strides", ctypes.c_int64 * 3)]
+
+
+def _load_library():
+    here = os.path.dirname(os.path.abspath(__file__))
+    candidates = [os.environ.get("QUICKLENS_LIB"), os.path.join(here, "libquicklens.so"),
+                  os.path.join(here, os.pardir, "libquicklens.so")]
+    for path in candidates:
+        if path and os.path.exists(path):
+            return ctypes.CDLL(path)
+    raise OSError("libquicklens.so not found (set QUICKLENS_LIB or run 'make lib')")
+
+
+_lib = _load_library()
+
+_handle = ctypes.c_void_p
+_buffer_p = ctypes.POINTER(_Buffer)
+_int_p = ctypes.POINTER(ctypes.c_int)
+for name, restype, argtypes in [
+        ("ql_api_version", ctypes.c_int, []),
+        ("ql_last_error", ctypes.c_char_p, []),
+        ("ql_initialize", None, [ctypes.c_int]),
+        ("ql_lens_create", _handle, [_buffer_p, ctypes.c_int, ctypes.c_int]),
+        ("ql_lens_load", _handle, [ctypes.c_char_p, ctypes.c_int, ctypes.c_int]),
+        ("ql_lens_destroy", None, [_handle]),
+        ("ql_lens_size", ctypes.c_int, [_handle, _int_p, _int_p]),
+        ("ql_lens_kappa", ctypes.c_int, [_handle, _buffer_p]),
+        ("ql_lens_deflection", ctypes.c_int, [_handle, ctypes.c_int, _buffer_p]),
+        ("ql_lens_copy_deflection", ctypes.c_int, [_handle, ctypes.c_int, _buffer_p]),
+        ("ql_source_create", _handle, [_buffer_p]),
+        ("ql_source_load", _handle, [ctypes.c_char_p, ctypes.c_int]),
+        ("ql_source_destroy", None, [_handle]),
+        ("ql_source_size", ctypes.c_int, [_handle, _int_p, _int_p]),
+        ("ql_source_set_size", ctypes.c_int, [_handle, ctypes.c_double]),
+        ("ql_renderer_create", _handle, [_handle, _handle, ctypes.c_int, ctypes.c_int]),
+        ("ql_renderer_destroy", None, [_handle]),
+        ("ql_renderer_set_lens_position", None, [_handle, ctypes.c_int, ctypes.c_int]),
+        ("ql_renderer_set_source_position", None, [_handle, ctypes.c_int, ctypes.c_int]),
+        ("ql_renderer_set_weight", None, [_handle, ctypes.c_double]),
+        ("ql_render", ctypes.c_int, [_handle, _buffer_p, ctypes.c_int])]:
+    function = getattr(_lib, name)
+    function.restype = restype
+    function.argtypes = argtypes
+
+if _lib.ql_api_version() != API_VERSION:
+    raise ImportError("libquicklens has API version %d, expected %d" % (_lib.ql_api_version(), API_VERSION))
+
+
+class QuicklensError(RuntimeError):
+    pass
+
+
+def _check(result):
+    """Raise the last error of the library for a failed call (status -1 or NULL handle)"""
+    if result is None or result == -1:
+        raise QuicklensError(_lib.ql_last_error().decode())
+    return result
+
+
+def _describe(array, output=False):
+    """Describe a NumPy array as strided buffer (referring to its memory; outputs have to be writeable)"""
+    dtype = np.dtype(array.dtype)
+    matches = [n for n, t in enumerate(_DTYPES) if np.dtype(t) == dtype]
+    if not matches or array.ndim not in (2, 3):
+        raise TypeError("unsupported array: %s with %d dimensions" % (dtype, array.ndim))
+    if output and not array.flags.writeable:
+        raise ValueError("output array is read-only")
+    buf = _Buffer(array.ctypes.data, array.ndim, matches[0])
+    buf.shape[:array.ndim] = array.shape
+    buf.strides[:array.ndim] = array.strides
+    return buf
+
+
+def _view(buf, owner):
+    """Wrap a buffer exposed by the library as read-only NumPy array, keeping its owner alive"""
+    if not buf.data:
+        raise QuicklensError("the library exposed no data")
+    dtype = np.dtype(_DTYPES[buf.dtype])
+    shape = tuple(buf.shape[:buf.ndim])
+    strides = tuple(buf.strides[:buf.ndim])
+    extent = sum((n - 1) * s for n, s in zip(shape, strides)) + dtype.itemsize
+    memory = (ctypes.c_char * extent).from_address(buf.data)
+    memory._owner = owner
+    array = np.ndarray(shape, dtype, buffer=memory, strides=strides)
+    array.flags.writeable = False
+    return array
+
+
+def initialize(n_threads=0):
+    """Set the number of render threads (<= 0: all) and select the kernels for this CPU"""
+    _lib.ql_initialize(n_threads)
+
+
+class Lens:
+    """Gravitational lens defined by its convergence map, with the precomputed lensing products"""
+
+    def __init__(self, kappa, lean=False, deflection_format=DEFLECTION_F64):
+        """Create a lens from a 2D convergence map (float64, float32 or uint8; read in place)"""
+        self._handle = _check(_lib.ql_lens_create(ctypes.byref(_describe(kappa)), lean, deflection_format))
+
+    @classmethod
+    def load(cls, filename, lean=False, deflection_format=DEFLECTION_F64):
+        """Load the convergence map from a file (FITS or image)"""
+        lens = cls.__new__(cls)
+        lens._handle = _check(_lib.ql_lens_load(os.fsencode(filename), lean, deflection_format))
+        return lens
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.ql_lens_destroy(self._handle)
+
+    @property
+    def shape(self):
+        width, height = ctypes.c_int(), ctypes.c_int()
+        _check(_lib.ql_lens_size(self._handle, ctypes.byref(width), ctypes.byref(height)))
+        return height.value, width.value
+
+    def kappa(self):
+        """Convergence map of the lens (read-only view)"""
+        buf = _Buffer()
+        _check(_lib.ql_lens_kappa(self._handle, ctypes.byref(buf)))
+        return _view(buf, self)
+
+    def deflection(self, component):
+        """
+        Unweighted deflection field component (1: x, 2: y) in pixels: a read-only view of the
+        storage for the float formats, a decoded float64 copy for the int16 format
+        """
+        buf = _Buffer()
+        if _lib.ql_lens_deflection(self._handle, component, ctypes.byref(buf)) == 0:
+            return _view(buf, self)
+        out = np.empty(self.shape, np.float64)
+        _check(_lib.ql_lens_copy_deflection(self._handle, component, ctypes.byref(_describe(out, output=True))))
+        return out
+
+
+class Source:
+    """Source image to be lensed"""
+
+    def __init__(self, image):
+        """Create a source from a BGR image (uint8, or uint16/float32 linear light; read in place)"""
+        self._handle = _check(_lib.ql_source_create(ctypes.byref(_describe(image))))
+
+    @classmethod
+    def load(cls, filename, hdr=False):
+        """Load the source image from a file"""
+        source = cls.__new__(cls)
+        source._handle = _check(_lib.ql_source_load(os.fsencode(filename), hdr))
+        return source
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.ql_source_destroy(self._handle)
+
+    @property
+    def shape(self):
+        width, height = ctypes.c_int(), ctypes.c_int()
+        _check(_lib.ql_source_size(self._handle, ctypes.byref(width), ctypes.byref(height)))
+        return height.value, width.value
+
+    def set_size(self, factor):
+        """Resize the angular extent of the source relative to the original image"""
+        _check(_lib.ql_source_set_size(self._handle, factor))
+
+
+class Renderer:
+    """Headless renderer of a lens and a source placed on a canvas (both centered initially)"""
+
+    def __init__(self, lens, source, width, height):
+        self._handle = _check(_lib.ql_renderer_create(lens._handle, source._handle, width, height))
+        self._lens, self._source = lens, source
+        self.width, self.height = width, height
+
+    def __del__(self):
+        if getattr(self, "_handle", None):
+            _lib.ql_renderer_destroy(self._handle)
+
+    def set_lens_position(self, x, y):
+        _lib.ql_renderer_set_lens_position(self._handle, x, y)
+
+    def set_source_position(self, x, y):
+        _lib.ql_renderer_set_source_position(self._handle, x, y)
+
+    def set_weight(self, weight):
+        _lib.ql_renderer_set_weight(self._handle, weight)
+
+    def render(self, out=None, first_row=0):
+        """
+        Render the lensed image (or the band of rows starting at first_row that fits into out)
+        into out, a uint8 array of shape (rows, width, 3) with contiguous pixels (allocated if None)
+        """
+        if out is None:
+            out = np.empty((self.height - first_row, self.width, 3), np.uint8)
+        _check(_lib.ql_render(self._handle, ctypes.byref(_describe(out, output=True)), first_row))
+        return out
@@ -0,0 +1,154 @@
+"""
+Round-trip tests of the ctypes binding (python/quicklens.py) against libquicklens.so: strided and
+non-contiguous inputs have to give the same lens and frames as contiguous copies, and invalid
+arguments have to raise instead of crashing.
+
+Run with "python3 python/test_quicklens.py" after "make lib" (skipped if the library is not found).
+"""
+
+import os
+import sys
+import unittest
+
+import numpy as np
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+try:
+    import quicklens
+    missing_library = None
+except OSError as e:
+    missing_library = str(e)
+
+
+def _kappa(height, width):
+    """Smooth convergence map of a single halo, strong enough to form critical curves"""
+    y, x = np.mgrid[0:height, 0:width]
+    r2 = (x - width / 2.) ** 2 + (y - height / 2.) ** 2
+    return 1.5 * np.exp(-r2 / (2. * (width / 8.) ** 2))
+
+
+def _image(height, width):
+    """BGR test pattern with distinct values per channel"""
+    y, x = np.mgrid[0:height, 0:width]
+    return np.stack([(x * 7) % 256, (y * 5) % 256, (x + y) % 256], axis=2).astype(np.uint8)
+
+
+@unittest.skipIf(missing_library, missing_library)
+class RoundTripTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        quicklens.initialize(2)
+        cls.kappa = _kappa(64, 96)
+        cls.image = _image(48, 80)
+
+    def render(self, kappa, image, width=120, height=90):
+        lens = quicklens.Lens(kappa)
+        source = quicklens.Source(image)
+        renderer = quicklens.Renderer(lens, source, width, height)
+        renderer.set_weight(1.2)
+        return renderer.render()
+
+    def test_strided_kappa(self):
+        # Every second element of a larger map, and the map in column-major order
+        padded = np.zeros((2 * 64, 2 * 96))
+        padded[::2, ::2] = self.kappa
+        strided = padded[::2, ::2]
+        fortran = np.asfortranarray(self.kappa)
+        self.assertFalse(strided.flags.c_contiguous)
+        self.assertFalse(fortran.flags.c_contiguous)
+
+        reference = quicklens.Lens(self.kappa)
+        for kappa, rtol in ((strided, 1e-12), (fortran, 1e-12), (self.kappa.astype(np.float32), 1e-5)):
+            lens = quicklens.Lens(kappa)
+            self.assertEqual(lens.shape, self.kappa.shape)
+            for component in (1, 2):
+                alpha = reference.deflection(component)
+                np.testing.assert_allclose(lens.deflection(component), alpha, rtol=rtol,
+                                           atol=rtol * np.abs(alpha).max())
+
+    def test_views_are_read_only(self):
+        lens = quicklens.Lens(self.kappa)
+        kappa = lens.kappa()
+        self.assertEqual(kappa.shape, self.kappa.shape)
+        self.assertFalse(kappa.flags.writeable)
+        with self.assertRaises(ValueError):
+            kappa[0, 0] = 1.
+        self.assertFalse(lens.deflection(1).flags.writeable)
+
+    def test_int16_deflection_is_copied(self):
+        reference = quicklens.Lens(self.kappa).deflection(1)
+        copy = quicklens.Lens(self.kappa, deflection_format=quicklens.DEFLECTION_I16).deflection(1)
+        self.assertTrue(copy.flags.writeable)
+        np.testing.assert_allclose(copy, reference, atol=1e-2 * np.abs(reference).max())
+
+    def test_strided_source(self):
+        # Channels in reverse memory order (negative stride) and every third column of a wider image
+        reversed_channels = np.ascontiguousarray(self.image[:, :, ::-1])[:, :, ::-1]
+        wide = np.zeros((48, 3 * 80, 3), np.uint8)
+        wide[:, ::3] = self.image
+        sparse = wide[:, ::3]
+        self.assertLess(reversed_channels.strides[2], 0)
+        self.assertFalse(sparse.flags.c_contiguous)
+
+        reference = self.render(self.kappa, self.image)
+        self.assertGreater(reference.max(), 0)
+        for image in (reversed_channels, sparse):
+            np.testing.assert_array_equal(self.render(self.kappa, image), reference)
+
+    def test_render_into_padded_rows_and_bands(self):
+        lens = quicklens.Lens(self.kappa)
+        source = quicklens.Source(self.image)
+        renderer = quicklens.Renderer(lens, source, 120, 90)
+        reference = renderer.render()
+
+        # Rows with padding at their end
+        padded = np.zeros((90, 130, 3), np.uint8)
+        out = padded[:, :120]
+        self.assertIs(renderer.render(out), out)
+        np.testing.assert_array_equal(out, reference)
+        self.assertEqual(padded[:, 120:].max(), 0)
+
+        # Band of rows
+        band = renderer.render(np.empty((30, 120, 3), np.uint8), first_row=40)
+        np.testing.assert_array_equal(band, reference[40:70])
+
+    def test_errors(self):
+        lens = quicklens.Lens(self.kappa)
+        source = quicklens.Source(self.image)
+        renderer = quicklens.Renderer(lens, source, 120, 90)
+
+        # Unsupported element types and shapes are rejected by the binding or the library
+        with self.assertRaises(TypeError):
+            quicklens.Lens(self.kappa.astype(np.int32))
+        with self.assertRaises(TypeError):
+            quicklens.Lens(np.zeros(16))
+        with self.assertRaisesRegex(quicklens.QuicklensError, "channel"):
+            quicklens.Source(self.image[:, :, 0])
+        with self.assertRaisesRegex(quicklens.QuicklensError, "deflection format"):
+            quicklens.Lens(self.kappa, deflection_format=7)
+        with self.assertRaises(quicklens.QuicklensError):
+            quicklens.Lens.load("/nonexistent/kappa.fits")
+        with self.assertRaises(quicklens.QuicklensError):
+            quicklens.Source.load("/nonexistent/source.png")
+
+        # Output buffers: read-only, non-contiguous pixels, wrong width, rows beyond the canvas
+        read_only = np.empty((90, 120, 3), np.uint8)
+        read_only.flags.writeable = False
+        with self.assertRaises(ValueError):
+            renderer.render(read_only)
+        with self.assertRaisesRegex(quicklens.QuicklensError, "contiguous"):
+            renderer.render(np.empty((90, 240, 3), np.uint8)[:, ::2])
+        with self.assertRaisesRegex(quicklens.QuicklensError, "width"):
+            renderer.render(np.empty((90, 100, 3), np.uint8))
+        with self.assertRaisesRegex(quicklens.QuicklensError, "rows"):
+            renderer.render(np.empty((30, 120, 3), np.uint8), first_row=80)
+        with self.assertRaises(quicklens.QuicklensError):
+            lens.deflection(3)
+
+        # The renderer is still usable after the errors
+        self.assertEqual(renderer.render().shape, (90, 120, 3))
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,246 @@
+#include <cmath> // floor, sqrt, atan2
+#include <cstdlib> // std::abs
+#include <algorithm> // std::min, std::max
+#include <opencv2/core/core.hpp>
+
+#include "lens.h"
+#include "analysis.h"
+
+using cv::Mat;
+using std::vector;
+
+
+/**
+ * Parallel_cross_section Constructor
+ * @param[in] lens_ Lens whose deflection field is used
+ * @param[in] kps Smoothed kappa + shear (CV_64FC1, unweighted)
+ * @param[in] kms Smoothed kappa - shear (CV_64FC1, unweighted)
+ * @param[in] weights_ Weight factors to evaluate
+ * @param[out] stats_ Strong lensing properties per weight (needs to have the size of weights_)
+ */
+Parallel_cross_section::Parallel_cross_section(lensT *lens_, const Mat &kps, const Mat &kms, 
+		const vector<double> &weights_, vector<lens_statsT> &stats_) 
+	: lens(lens_), kappa_plus_shear(kps), kappa_minus_shear(kms), weights(weights_), stats(stats_) {}
+
+void Parallel_cross_section::operator()(const cv::Range &range) const
+{
+	int width = kappa_plus_shear.cols;
+	int height = kappa_plus_shear.rows;
+
+	for (int k = range.start; k < range.end; ++k)
+	{
+		double weight = weights[k];
+		size_t n_tangential = 0;
+		size_t n_covered = 0;
+		Mat covered = Mat::zeros(height, width, CV_8UC1);
+
+		for (int i = 0; i < height; ++i)
+			for (int j = 0; j < width; ++j)
+			{
+				// Eigenvalues of the Jacobian (same smoothing as for the critical curves)
+				double tan_eigenval = 1. - weight * kappa_plus_shear.at<double>(i, j);
+				double rad_eigenval = 1. - weight * kappa_minus_shear.at<double>(i, j);
+
+				// Area enclosed by the tangential critical curves
+				if (tan_eigenval < 0)
+					++n_tangential;
+
+				/**
+				 * Images of negative parity only exist for multiply imaged sources. Hence, 
+				 * mapping them to the source plane yields the area enclosed by the caustics
+				 * (estimated here by the number of distinct source pixels hit).
+				 */
+				if (tan_eigenval * rad_eigenval >= 0)
+					continue;
+
+				double a1, a2;
+				lens->get_deflection(j, i, a1, a2);
+				int b1 = static_cast<int>(floor(j - weight * a1 + 0.5));
+				int b2 = static_cast<int>(floor(i - weight * a2 + 0.5));
+				if (0 <= b1 and b1 < width and 0 <= b2 and b2 < height and covered.at<uchar>(b2, b1) == 0)
+				{
+					covered.at<uchar>(b2, b1) = 1;
+					++n_covered;
+				}
+			}
+
+		stats[k].weight = weight;
+		stats[k].cc_area = static_cast<double>(n_tangential);
+		stats[k].einstein_radius = sqrt(stats[k].cc_area / M_PI);
+		stats[k].caustic_area = static_cast<double>(n_covered);
+	}
+}
+
+
+// Find root of a pixel in the union-find forest (path halving)
+static int find_root(std::vector<int> &parent, int p)
+{
+	while (parent[p] != p)
+	{
+		parent[p] = parent[parent[p]];
+		p = parent[p];
+	}
+	return p;
+}
+
+// Merge the trees of two pixels in the union-find forest (the smaller index becomes the root)
+static void unite(std::vector<int> &parent, int p, int q)
+{
+	int rp = find_root(parent, p);
+	int rq = find_root(parent, q);
+	if (rp < rq)
+		parent[rq] = rp;
+	else if (rq < rp)
+		parent[rp] = rq;
+}
+
+
+/**
+ * Parallel_arc_labeling Constructor
+ * @param[in] lensed_ Lensed image (CV_8UC3)
+ * @param[in] background_ Unlensed image of the source on the same screen (CV_8UC3)
+ * @param[in] settings_ Arc detection settings
+ * @param[out] parent_ Union-find forest over all pixels (-1 for background pixels)
+ * @param[in] n_bands_ Number of horizontal bands the image is divided into
+ */
+Parallel_arc_labeling::Parallel_arc_labeling(const Mat &lensed_, const Mat &background_, 
+		const arc_paramsT &settings_, vector<int> &parent_, int n_bands_) 
+	: lensed(lensed_), background(background_), settings(settings_), parent(parent_), n_bands(n_bands_) {}
+
+void Parallel_arc_labeling::operator()(const cv::Range &range) const
+{
+	int width = lensed.cols;
+	int height = lensed.rows;
+
+	// Each band only links pixels within its own rows, so the bands can be processed independently
+	for (int b = range.start; b < range.end; ++b)
+	{
+		int first_row = b * height / n_bands;
+		int last_row = (b+1) * height / n_bands;
+
+		for (int i = first_row; i < last_row; ++i)
+			for (int j = 0; j < width; ++j)
+			{
+				int p = i*width + j;
+				cv::Vec3b val = lensed.at<cv::Vec3b>(i, j);
+				cv::Vec3b bg = background.at<cv::Vec3b>(i, j);
+				int lum = val[0] + val[1] + val[2];
+				int diff = std::abs(val[0]-bg[0]) + std::abs(val[1]-bg[1]) + std::abs(val[2]-bg[2]);
+
+				// Keep pixels showing source light that was displaced by the lens
+				if (lum <= settings.threshold or diff <= settings.threshold)
+				{
+					parent[p] = -1;
+					continue;
+				}
+
+				// Link to the already visited neighbors (left, upper left, upper, upper right)
+				parent[p] = p;
+				if (j > 0 and parent[p-1] >= 0)
+					unite(parent, p, p-1);
+				if (i == first_row)
+					continue;
+				for (int dj = -1; dj <= 1; ++dj)
+					if (0 <= j+dj and j+dj < width and parent[p-width+dj] >= 0)
+						unite(parent, p, p-width+dj);
+			}
+	}
+}
+
+// Detect arcs in a rendered frame and compute their second moments
+void detect_arcs(const Mat &lensed, const Mat &background, const arc_paramsT &settings, vector<arcT> &arcs)
+{
+	int width = lensed.cols;
+	int height = lensed.rows;
+	int n_bands = std::max(1, std::min(height, 4*cv::getNumThreads()));
+	vector<int> parent(width * height);
+
+	// Label the bands in parallel, then stitch them together along the band boundaries
+	cv::parallel_for_(cv::Range(0, n_bands), Parallel_arc_labeling(lensed, background, settings, parent, n_bands));
+	for (int b = 1; b < n_bands; ++b)
+	{
+		int i = b * height / n_bands;
+		for (int j = 0; j < width; ++j)
+		{
+			int p = i*width + j;
+			if (parent[p] < 0)
+				continue;
+			for (int dj = -1; dj <= 1; ++dj)
+				if (0 <= j+dj and j+dj < width and parent[p-width+dj] >= 0)
+					unite(parent, p, p-width+dj);
+		}
+	}
+
+	/**
+	 * Flatten the forest in a single pass: roots are always the smallest pixel index of their 
+	 * tree and parents never have larger indices, so parent[parent[p]] is already a root. 
+	 * Then accumulate the raw moments per region.
+	 */
+	struct momentsT { double m00 = 0., m10 = 0., m01 = 0., m20 = 0., m11 = 0., m02 = 0.; };
+	vector<momentsT> regions;
+	vector<int> region_id(width * height, -1);
+	for (int i = 0; i < height; ++i)
+		for (int j = 0; j < width; ++j)
+		{
+			int p = i*width + j;
+			if (parent[p] < 0)
+				continue;
+			parent[p] = parent[parent[p]];
+			if (parent[p] == p)
+			{
+				region_id[p] = regions.size();
+				regions.push_back(momentsT());
+			}
+
+			momentsT &m = regions[region_id[parent[p]]];
+			m.m00 += 1.;
+			m.m10 += j;
+			m.m01 += i;
+			m.m20 += static_cast<double>(j)*j;
+			m.m11 += static_cast<double>(j)*i;
+			m.m02 += static_cast<double>(i)*i;
+		}
+
+	/**
+	 * Derive centroid, orientation and extent from the central second moments. For a uniform 
+	 * ellipse with semi-axes a, b, the eigenvalues of the covariance matrix are a^2/4 and b^2/4.
+	 */
+	arcs.clear();
+	for (const momentsT &m : regions)
+	{
+		if (m.m00 < settings.min_area)
+			continue;
+
+		arcT arc;
+		arc.area = static_cast<int>(m.m00);
+		arc.x = m.m10 / m.m00;
+		arc.y = m.m01 / m.m00;
+		double mu20 = m.m20 / m.m00 - arc.x*arc.x;
+		double mu11 = m.m11 / m.m00 - arc.x*arc.y;
+		double mu02 = m.m02 / m.m00 - arc.y*arc.y;
+		double root = sqrt(0.25*(mu20-mu02)*(mu20-mu02) + mu11*mu11);
+		double lambda1 = 0.5*(mu20+mu02) + root;
+		double lambda2 = std::max(0.5*(mu20+mu02) - root, 1./12.); // At least the variance of one pixel
+		arc.length = 4.*sqrt(lambda1);
+		arc.width = 4.*sqrt(lambda2);
+		arc.angle = 0.5*atan2(2.*mu11, mu20-mu02);
+		arc.giant = arc.length >= settings.min_ratio * arc.width;
+		arcs.push_back(arc);
+	}
+}
+
+// Map critical curve contours into the source plane via the lens equation
+void map_cc_to_caustics(lensT &lens, const vector<vector<cv::Point>> &cc, vector<vector<cv::Point2d>> &caustics)
+{
+	caustics.assign(cc.size(), vector<cv::Point2d>());
+	for (size_t n = 0; n < cc.size(); ++n)
+	{
+		caustics[n].reserve(cc[n].size());
+		for (const cv::Point &p : cc[n])
+		{
+			double beta1, beta2;
+			lens.raytrace_pixel(p.x, p.y, p.x, p.y, 1., beta1, beta2);
+			caustics[n].push_back(cv::Point2d(beta1, beta2));
+		}
+	}
+}
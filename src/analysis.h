@@ -0,0 +1,109 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "lens.h"
+
+using cv::Mat;
+
+/**
+ * @brief Settings for the arc detection in rendered frames
+ */
+struct arc_paramsT
+{
+	int threshold = 30;		// Min. summed RGB difference between lensed and unlensed pixel
+	int min_area = 20;		// Min. number of pixels of a connected region to be listed
+	double min_ratio = 7.5;		// Min. length-to-width ratio of a giant arc
+};
+
+/**
+ * @brief Catalog entry of an arc (connected region of lensed source light)
+ */
+struct arcT
+{
+	int area = 0;			// Number of pixels
+	double x = 0., y = 0.;		// Centroid on the screen
+	double length = 0.;		// Length along the major axis (from second moments)
+	double width = 0.;		// Width along the minor axis (from second moments)
+	double angle = 0.;		// Orientation of the major axis w.r.t. the x-axis (rad)
+	bool giant = false;		// Length-to-width ratio exceeds arc_paramsT::min_ratio
+};
+
+/**
+ * @brief Class for OpenCV parallelization: Evaluate the strong lensing properties (Einstein radius, 
+ * caustic cross-section) of a lens for a list of weights, one weight per loop index
+ */
+class Parallel_cross_section : public cv::ParallelLoopBody
+{
+	private:
+		lensT *lens;
+		const Mat &kappa_plus_shear;
+		const Mat &kappa_minus_shear;
+		const std::vector<double> &weights;
+		std::vector<lens_statsT> &stats;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] lens_ Lens whose deflection field is used
+		 * @param[in] kps Smoothed kappa + shear (CV_64FC1, unweighted)
+		 * @param[in] kms Smoothed kappa - shear (CV_64FC1, unweighted)
+		 * @param[in] weights_ Weight factors to evaluate
+		 * @param[out] stats_ Strong lensing properties per weight (needs to have the size of weights_)
+		 */
+		Parallel_cross_section(lensT *lens_, const Mat &kps, const Mat &kms, 
+				const std::vector<double> &weights_, std::vector<lens_statsT> &stats_);
+
+		virtual void operator()(const cv::Range &range) const;
+};
+
+/**
+ * @brief Class for OpenCV parallelization: Segment lensed source light and label connected pixels 
+ * (8-connectivity) within horizontal bands of the image using a union-find forest
+ */
+class Parallel_arc_labeling : public cv::ParallelLoopBody
+{
+	private:
+		const Mat &lensed;
+		const Mat &background;
+		const arc_paramsT &settings;
+		std::vector<int> &parent;
+		int n_bands;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] lensed_ Lensed image (CV_8UC3)
+		 * @param[in] background_ Unlensed image of the source on the same screen (CV_8UC3)
+		 * @param[in] settings_ Arc detection settings
+		 * @param[out] parent_ Union-find forest over all pixels (-1 for background pixels)
+		 * @param[in] n_bands_ Number of horizontal bands the image is divided into
+		 */
+		Parallel_arc_labeling(const Mat &lensed_, const Mat &background_, const arc_paramsT &settings_, 
+				std::vector<int> &parent_, int n_bands_);
+
+		virtual void operator()(const cv::Range &range) const;
+};
+
+/**
+ * Detect arcs in a rendered frame: Segment the pixels in which the lensed image shows source light 
+ * differing from the unlensed background, label connected regions (parallel union-find) and compute 
+ * their second moments.
+ *
+ * @param[in] lensed Lensed image (CV_8UC3)
+ * @param[in] background Unlensed image of the source on the same screen (CV_8UC3)
+ * @param[in] settings Arc detection settings
+ * @param[out] arcs Catalog of all regions with at least settings.min_area pixels
+ */
+void detect_arcs(const Mat &lensed, const Mat &background, const arc_paramsT &settings, std::vector<arcT> &arcs);
+
+/**
+ * Map critical curve contours into the source plane via the lens equation at the current weight
+ *
+ * @param[in] lens Lens whose deflection field is used
+ * @param[in] cc Critical curve contours in lens pixel coordinates (see lensT::get_cc_contours)
+ * @param[out] caustics Caustic polylines in lens pixel coordinates (one per contour)
+ */
+void map_cc_to_caustics(lensT &lens, const std::vector<std::vector<cv::Point>> &cc, 
+		std::vector<std::vector<cv::Point2d>> &caustics);
+
+#endif
@@ -0,0 +1,278 @@
+#include <iostream> // std::cout
+#include <fstream> // std::ifstream, std::ofstream
+#include <sstream> // std::ostringstream
+#include <vector>
+#include <chrono> // std::chrono::steady_clock
+#include <cmath> // exp, sqrt
+#include <cstdlib> // std::getenv
+#include <algorithm> // std::min, std::max, std::nth_element
+#include <opencv2/core/core.hpp>
+
+#include "autotune.h"
+#include "lens.h"
+#include "renderer.h"
+
+using cv::Mat;
+using std::vector;
+
+// Applied chunk sizes (rows, 0: OpenCV default)
+static int render_chunk_rows = 0;
+static int cc_chunk_rows = 0;
+
+// Apply parallelization settings
+void apply_tuning(const tuningT &tuning)
+{
+	if (tuning.threads > 0)
+		cv::setNumThreads(tuning.threads);
+	if (tuning.isa != N_ISAS)
+		set_isa(tuning.isa);
+	render_chunk_rows = tuning.render_rows;
+	cc_chunk_rows = tuning.cc_rows;
+}
+
+// Number of stripes for a given chunk size
+static double stripes(int rows, int chunk_rows)
+{
+	return (chunk_rows > 0) ? std::max(1, rows / chunk_rows) : -1.;
+}
+
+double render_stripes(int rows)
+{
+	return stripes(rows, render_chunk_rows);
+}
+
+double cc_stripes(int rows)
+{
+	return stripes(rows, cc_chunk_rows);
+}
+
+// Describe parallelization settings
+std::string describe_tuning(const tuningT &tuning)
+{
+	std::ostringstream text;
+	text << tuning.threads << " threads, render chunks of ";
+	if (tuning.render_rows > 0)
+		text << tuning.render_rows << " rows";
+	else
+		text << "default size";
+	text << ", critical curve chunks of ";
+	if (tuning.cc_rows > 0)
+		text << tuning.cc_rows << " rows";
+	else
+		text << "default size";
+	if (tuning.isa != N_ISAS)
+		text << ", " << isa_names[tuning.isa] << " kernels";
+	return text.str();
+}
+
+// Key of the tuning cache for this machine and a canvas size
+std::string tuning_key(int w, int h)
+{
+	// CPU model as reported by the kernel (without spaces)
+	std::ifstream cpuinfo("/proc/cpuinfo");
+	std::string line, model = "unknown";
+	while (std::getline(cpuinfo, line))
+		if (line.compare(0, 10, "model name") == 0 and line.find(':') != std::string::npos)
+		{
+			model = line.substr(line.find(':') + 1);
+			break;
+		}
+	std::string id;
+	for (char c : model)
+		if (c != ' ' and c != '\t')
+			id += c;
+
+	int bucket = 0;
+	while ((2LL << bucket) <= static_cast<long long>(w) * h)
+		++bucket;
+	return id + "/" + std::to_string(cv::getNumberOfCPUs()) + "cpus/2^" + std::to_string(bucket) + "px";
+}
+
+std::string default_tuning_cache()
+{
+	const char *home = std::getenv("HOME");
+	return std::string(home ? home : ".") + "/.quicklens_tuning";
+}
+
+// Look up settings in the tuning cache file
+bool load_tuning(const std::string &filename, const std::string &key, tuningT &tuning)
+{
+	std::ifstream infile(filename);
+	std::string line;
+	while (std::getline(infile, line))
+	{
+		std::istringstream tokens(line);
+		std::string entry_key, isa;
+		tuningT entry;
+		if (!(tokens >> entry_key >> entry.threads >> entry.render_rows >> entry.cc_rows >> isa) or entry_key != key)
+			continue;
+		int n = 0;
+		while (n < N_ISAS and isa != isa_names[n])
+			++n;
+		entry.isa = static_cast<isaT>(n);
+		tuning = entry;
+		return true;
+	}
+	return false;
+}
+
+// Store settings in the tuning cache file
+bool save_tuning(const std::string &filename, const std::string &key, const tuningT &tuning)
+{
+	// Keep the entries of other machines and canvas sizes
+	vector<std::string> lines;
+	std::ifstream infile(filename);
+	std::string line;
+	while (std::getline(infile, line))
+		if (line.compare(0, key.size() + 1, key + " ") != 0)
+			lines.push_back(line);
+	infile.close();
+
+	std::ostringstream entry;
+	entry << key << " " << tuning.threads << " " << tuning.render_rows << " " << tuning.cc_rows << " ";
+	entry << ((tuning.isa != N_ISAS) ? isa_names[tuning.isa] : "-");
+	lines.push_back(entry.str());
+
+	std::ofstream outfile(filename);
+	for (const std::string &l : lines)
+		outfile << l << std::endl;
+	outfile.close();
+	return !outfile.fail();
+}
+
+// Create the synthetic benchmark scene
+void make_synthetic_scene(int w, int h, Mat &kappa, Mat &image)
+{
+	// Clumps: position and width relative to the smaller side, peak convergence
+	const double clumps[3][4] = {{0.5, 0.5, 0.12, 1.5}, {0.3, 0.6, 0.05, 1.}, {0.7, 0.35, 0.07, 1.2}};
+	double size = std::min(w, h);
+	kappa = Mat::zeros(h, w, CV_64FC1);
+	image = Mat(h, w, CV_8UC3);
+	for (int i = 0; i < h; ++i)
+		for (int j = 0; j < w; ++j)
+		{
+			for (const double *c : clumps)
+			{
+				double dx = (j - c[0] * w) / (c[2] * size);
+				double dy = (i - c[1] * h) / (c[2] * size);
+				kappa.at<double>(i, j) += c[3] * exp(-0.5 * (dx*dx + dy*dy));
+			}
+			bool dark = ((i / 16) + (j / 16)) % 2;
+			image.at<cv::Vec3b>(i, j) = cv::Vec3b(255 * j / w, 255 * i / h, dark ? 40 : 220);
+		}
+}
+
+/**
+ * Measure the median time of a kernel over a few runs (after one warm-up run)
+ * @param kernel Kernel to run
+ * @return Median time (ms)
+ */
+template <class kernelT>
+static double time_kernel(kernelT kernel)
+{
+	const int runs = 5;
+	kernel();
+	vector<double> times;
+	for (int r = 0; r < runs; ++r)
+	{
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		kernel();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		times.push_back(elapsed.count());
+	}
+	std::nth_element(times.begin(), times.begin() + runs/2, times.end());
+	return times[runs/2];
+}
+
+// Benchmark the render and critical curve kernels and apply the best settings
+tuningT autotune(int w, int h)
+{
+	using std::cout;
+	using std::endl;
+
+	// Synthetic scene of the canvas shape (at most 2048x2048 px)
+	double shrink = std::min(1., std::sqrt(2048. * 2048. / (static_cast<double>(w) * h)));
+	int scene_w = std::max(64, static_cast<int>(w * shrink));
+	int scene_h = std::max(64, static_cast<int>(h * shrink));
+	cout << "Autotuning on a synthetic " << scene_w << "x" << scene_h << " scene..." << endl;
+	Mat kappa, image;
+	make_synthetic_scene(scene_w, scene_h, kappa, image);
+	lensT lens(kappa, scene_w/2, scene_h/2);
+	sourceT src(image, scene_w/2, scene_h/2);
+	lens.weight = 1.;
+	Mat frame(scene_h, scene_w, CV_8UC3);
+
+	tuningT best;
+	best.threads = cv::getNumThreads();
+	best.isa = active_isa();
+	apply_tuning(best);
+	double times[2];
+	auto measure = [&](const tuningT &candidate)
+	{
+		apply_tuning(candidate);
+		times[0] = time_kernel([&]{ cv::parallel_for_(cv::Range(0, scene_h),
+				Parallel_band_renderer(&lens, &src, frame, 0), render_stripes(scene_h)); });
+		times[1] = time_kernel([&]{ lens.update_cc_and_caustics(false); });
+		cout << "-> " << describe_tuning(candidate) << ": render " << times[0] << " ms, critical curves ";
+		cout << times[1] << " ms" << endl;
+	};
+
+	// Instruction set and thread count are chosen for the sum of both kernels
+	double best_time = -1.;
+	isaT best_isa = best.isa;
+	for (int isa = ISA_GENERIC; isa <= detect_isa(); ++isa)
+	{
+		tuningT candidate = best;
+		candidate.isa = static_cast<isaT>(isa);
+		measure(candidate);
+		if (best_time < 0. or times[0] + times[1] < best_time)
+		{
+			best_time = times[0] + times[1];
+			best_isa = candidate.isa;
+		}
+	}
+	best.isa = best_isa;
+
+	best_time = -1.;
+	int best_threads = best.threads;
+	int n_cpus = cv::getNumberOfCPUs();
+	for (int threads = n_cpus; threads >= std::max(1, n_cpus / 8); threads /= 2)
+	{
+		tuningT candidate = best;
+		candidate.threads = threads;
+		measure(candidate);
+		if (best_time < 0. or times[0] + times[1] < best_time)
+		{
+			best_time = times[0] + times[1];
+			best_threads = threads;
+		}
+	}
+	best.threads = best_threads;
+
+	// Chunk sizes of the two kernels are independent
+	double best_render = -1., best_cc = -1.;
+	int best_rows[2] = {0, 0};
+	const int chunk_rows[] = {0, 1, 2, 4, 8, 16, 32, 64};
+	for (int rows : chunk_rows)
+	{
+		tuningT candidate = best;
+		candidate.render_rows = candidate.cc_rows = rows;
+		measure(candidate);
+		if (best_render < 0. or times[0] < best_render)
+		{
+			best_render = times[0];
+			best_rows[0] = rows;
+		}
+		if (best_cc < 0. or times[1] < best_cc)
+		{
+			best_cc = times[1];
+			best_rows[1] = rows;
+		}
+	}
+	best.render_rows = best_rows[0];
+	best.cc_rows = best_rows[1];
+
+	apply_tuning(best);
+	cout << "-> Best: " << describe_tuning(best) << endl;
+	return best;
+}
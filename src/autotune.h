@@ -0,0 +1,95 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <string>
+#include <opencv2/core/core.hpp>
+#include "cpu_dispatch.h"
+
+/**
+ * @brief Parallelization settings of the hot kernels (the renderers and the critical curve pass)
+ *
+ * @details The rows per chunk set the granularity of cv::parallel_for_: small chunks balance the
+ * load between the threads, large chunks keep neighboring rows (and their deflection and source
+ * pixels) on one core.
+ */
+struct tuningT
+{
+	int threads = 0;	// Number of threads (0: keep)
+	int render_rows = 0;	// Rows per chunk of the renderers (0: OpenCV default)
+	int cc_rows = 0;	// Rows per chunk of the critical curve pass (0: OpenCV default)
+	isaT isa = N_ISAS;	// Instruction set of the kernels (N_ISAS: keep)
+};
+
+/**
+ * Apply parallelization settings
+ * @param tuning Settings
+ */
+void apply_tuning(const tuningT &tuning);
+
+/**
+ * Get the number of stripes for cv::parallel_for_ over the rows of a renderer (or the critical
+ * curve pass) according to the applied settings
+ * @param rows Number of rows of the loop
+ * @return Number of stripes (-1: OpenCV default)
+ */
+double render_stripes(int rows);
+double cc_stripes(int rows);
+
+/**
+ * Describe parallelization settings (e.g. "8 threads, render chunks of 4 rows, ...")
+ * @param tuning Settings
+ * @return Description
+ */
+std::string describe_tuning(const tuningT &tuning);
+
+/**
+ * Get the key of the tuning cache for this machine (CPU model and number of logical cores) and a
+ * canvas size (rounded down to a power of two of the number of pixels)
+ * @param w, h Canvas size (px)
+ * @return Key
+ */
+std::string tuning_key(int w, int h);
+
+/**
+ * Get the default tuning cache file ("~/.quicklens_tuning")
+ * @return Filename
+ */
+std::string default_tuning_cache();
+
+/**
+ * Look up settings in the tuning cache file (one line "key threads render_rows cc_rows isa" per entry)
+ * @param[in] filename Name of the cache file
+ * @param[in] key Key (see tuning_key)
+ * @param[out] tuning Settings found
+ * @return Whether an entry was found
+ */
+bool load_tuning(const std::string &filename, const std::string &key, tuningT &tuning);
+
+/**
+ * Store settings in the tuning cache file (replacing an entry with the same key)
+ * @param filename Name of the cache file
+ * @param key Key (see tuning_key)
+ * @param tuning Settings
+ * @return Whether the file could be written
+ */
+bool save_tuning(const std::string &filename, const std::string &key, const tuningT &tuning);
+
+/**
+ * Create the synthetic scene of the benchmarks: a lens of three Gaussian mass clumps (strong enough
+ * for extended critical curves at unit weight) and a colored checkerboard as source
+ * @param[in] w, h Size (px)
+ * @param[out] kappa Convergence map (CV_64FC1)
+ * @param[out] image Source image (CV_8UC3)
+ */
+void make_synthetic_scene(int w, int h, cv::Mat &kappa, cv::Mat &image);
+
+/**
+ * Benchmark the band renderer and the critical curve pass on a synthetic scene of the given canvas
+ * size (at most 2048x2048 px) for the supported instruction sets, several thread counts and chunk
+ * sizes, one parameter after the other. The best settings are applied and returned.
+ * @param w, h Canvas size (px)
+ * @return Best settings
+ */
+tuningT autotune(int w, int h);
+
+#endif
@@ -0,0 +1,584 @@
+#include <iostream> // std::cout
+#include <fstream> // std::ifstream
+#include <sstream> // std::istringstream
+#include <iomanip> // std::setw
+#include <map>
+#include <set>
+#include <functional> // std::hash
+#include <chrono>
+#include <cstdlib> // std::strtod
+#include <cmath> // floor, fabs, log2
+#include <algorithm> // std::min, std::max
+#include <thread>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+#include "lens.h"
+#include "renderer.h"
+#include "analysis.h"
+#include "batch.h"
+#include "work_queue.h"
+#include "autotune.h"
+
+using cv::Mat;
+using std::vector;
+
+// Read sweep parameters ("x y weight source_size" per line) from a text file
+bool read_sweep_file(const std::string &filename, vector<sweep_paramT> &params)
+{
+	std::ifstream infile(filename);
+	if (!infile.is_open())
+		return false;
+
+	std::string line;
+	int line_nr = 0;
+	while (std::getline(infile, line))
+	{
+		++line_nr;
+		std::istringstream tokens(line);
+		std::string first;
+		if (!(tokens >> first) or first[0] == '#')
+			continue;
+
+		// Re-read the line as a parameter set
+		sweep_paramT p;
+		tokens.str(line);
+		tokens.clear();
+		if (!(tokens >> p.x >> p.y >> p.weight >> p.source_size))
+		{
+			std::cout << "Error in " << filename << ", line " << line_nr << ": expected \"x y weight source_size\"" << std::endl;
+			return false;
+		}
+		params.push_back(p);
+	}
+
+	return true;
+}
+
+// Render a batch of parameter sets in a single pass over the deflection field of the lens
+void render_sweep(lensT &lens, vector<sourceT*> &sources, const vector<sweep_paramT> &params, 
+		int w, int h, vector<Mat> &frames, double scale)
+{
+	// Allocate one output frame per parameter set
+	int out_w = static_cast<int>(w * scale + 0.5);
+	int out_h = static_cast<int>(h * scale + 0.5);
+	frames.resize(params.size());
+	for (size_t k = 0; k < params.size(); ++k)
+		frames[k] = Mat::zeros(out_h, out_w, CV_8UC3);
+	if (params.empty())
+		return;
+
+	/**
+	 * Determine the lens origins in output pixels (snapped to the output grid) and the range of 
+	 * lens-relative rows covered by the union of all screens. (For a lens with origin o, output 
+	 * pixel j corresponds to the lens-relative coordinate r_j = j - o)
+	 */
+	vector<cv::Point> origins(params.size());
+	int rel_min_i = 0, rel_max_i = 0;
+	for (size_t k = 0; k < params.size(); ++k)
+	{
+		int origin[2] = {params[k].x - lens.get_width()/2, params[k].y - lens.get_height()/2};
+		origins[k] = cv::Point(static_cast<int>(floor(origin[0] * scale + 0.5)), 
+				static_cast<int>(floor(origin[1] * scale + 0.5)));
+		rel_min_i = (k == 0) ? -origins[k].y : std::min(rel_min_i, -origins[k].y);
+		rel_max_i = (k == 0) ? out_h - origins[k].y : std::max(rel_max_i, out_h - origins[k].y);
+	}
+
+	// Use the level of detail matching the output pixel footprint (1/scale lens pixels)
+	lens.build_pyramid(1 + static_cast<int>(floor(log2(1. / scale))));
+	int level = lens.lod_for_footprint(1. / scale);
+
+	// Tiled sources: decode the source area the frames can sample (the screen grown by the largest deflection)
+	double max_weight = 0.;
+	for (const sweep_paramT &p : params)
+		max_weight = std::max(max_weight, std::fabs(p.weight));
+	double reach[2] = {lens.get_max_deflection(1) * max_weight + 1., lens.get_max_deflection(2) * max_weight + 1.};
+	for (size_t k = 0; k < sources.size(); ++k)
+		if (k == 0 or sources[k] != sources[k-1])
+			sources[k]->prepare_area(-reach[0], -reach[1], w + reach[0], h + reach[1]);
+
+	cv::parallel_for_(cv::Range(rel_min_i, rel_max_i), Parallel_sweep_renderer(&lens, sources, params, 
+				frames, origins, scale, level), render_stripes(rel_max_i - rel_min_i));
+	for (sourceT *source : sources)
+		source->release_area();
+}
+
+/**
+ * Prepare the sources of a sweep: one resized copy of the source per distinct source size (keyed in 
+ * units of 1/1000) and, for the arc detection, the unlensed image of each copy (rendered with zero 
+ * weight) as background
+ *
+ * @param[in] lens, src, params, w, h, scale, arc_settings See run_sweep
+ * @param[out] resized Resized copies of the source
+ * @param[out] backgrounds Unlensed images of the copies (only with arc detection)
+ */
+static void prepare_sweep_sources(lensT &lens, sourceT &src, const vector<sweep_paramT> &params, int w, int h, 
+		double scale, const arc_paramsT *arc_settings, std::map<long, sourceT> &resized, std::map<long, Mat> &backgrounds)
+{
+	for (const sweep_paramT &p : params)
+	{
+		long key = static_cast<long>(p.source_size * 1000. + 0.5);
+		if (resized.count(key) == 0)
+		{
+			sourceT copy = src;
+			copy.resize_area(p.source_size);
+			resized.insert(std::make_pair(key, copy));
+		}
+	}
+
+	if (arc_settings)
+		for (auto &entry : resized)
+		{
+			sweep_paramT p;
+			p.weight = 0.;
+			vector<sweep_paramT> unlensed(1, p);
+			vector<sourceT*> unlensed_src(1, &entry.second);
+			vector<Mat> frame;
+			render_sweep(lens, unlensed_src, unlensed, w, h, frame, scale);
+			backgrounds[entry.first] = frame[0];
+		}
+}
+
+/**
+ * Render the frames [first, last) of a sweep in batches and write them to disk (frame numbers refer 
+ * to the whole sweep)
+ *
+ * @param lens, params, w, h, out_prefix, batch_size, scale, arc_settings See run_sweep
+ * @param resized, backgrounds Sources prepared with prepare_sweep_sources
+ * @param first, last Range of frames to render
+ * @return Number of frames that could not be written
+ */
+static int render_sweep_frames(lensT &lens, std::map<long, sourceT> &resized, const std::map<long, Mat> &backgrounds, 
+		const vector<sweep_paramT> &params, size_t first, size_t last, int w, int h, const std::string &out_prefix, 
+		size_t batch_size, double scale, const arc_paramsT *arc_settings)
+{
+	using std::cout;
+	using std::endl;
+
+	if (batch_size == 0)
+		batch_size = 1;
+
+	int n_failed = 0;
+	for (size_t batch_first = first; batch_first < last; batch_first += batch_size)
+	{
+		// Collect the parameter sets of the current batch and their sources
+		size_t batch_last = std::min(batch_first + batch_size, last);
+		vector<sweep_paramT> batch(params.begin() + batch_first, params.begin() + batch_last);
+		vector<sourceT*> sources;
+		for (const sweep_paramT &p : batch)
+			sources.push_back(&resized.at(static_cast<long>(p.source_size * 1000. + 0.5)));
+
+		// Render the whole batch in one pass, then write the frames
+		vector<Mat> frames;
+		render_sweep(lens, sources, batch, w, h, frames, scale);
+		for (size_t k = 0; k < frames.size(); ++k)
+		{
+			std::ostringstream fn;
+			fn << out_prefix << "_" << std::setw(5) << std::setfill('0') << batch_first + k;
+			if (!cv::imwrite(fn.str() + ".png", frames[k]))
+			{
+				cout << "Error writing " << fn.str() << ".png" << endl;
+				++n_failed;
+			}
+
+			// Stream out the arc catalog of the frame
+			if (!arc_settings)
+				continue;
+			vector<arcT> arcs;
+			long key = static_cast<long>(batch[k].source_size * 1000. + 0.5);
+			detect_arcs(frames[k], backgrounds.at(key), *arc_settings, arcs);
+			if (!write_arc_catalog(fn.str() + "_arcs.csv", arcs))
+				++n_failed;
+		}
+		cout << "-> Rendered frames " << batch_first << "-" << batch_last-1 << " of " << params.size() << endl;
+	}
+
+	return n_failed;
+}
+
+// Run a full batch sweep: render all parameter sets in batches and write each frame to disk
+int run_sweep(lensT &lens, sourceT &src, const vector<sweep_paramT> &params, int w, int h,
+		const std::string &out_prefix, size_t batch_size, double scale, const arc_paramsT *arc_settings)
+{
+	std::map<long, sourceT> resized;
+	std::map<long, Mat> backgrounds;
+	prepare_sweep_sources(lens, src, params, w, h, scale, arc_settings, resized, backgrounds);
+	return render_sweep_frames(lens, resized, backgrounds, params, 0, params.size(), w, h, out_prefix, 
+			batch_size, scale, arc_settings);
+}
+
+// Run a batch sweep as one of any number of workers sharing a work queue
+int run_sweep_worker(work_queueT &queue, size_t shard_size, lensT &lens, sourceT &src, 
+		const vector<sweep_paramT> &params, int w, int h, const std::string &out_prefix, size_t batch_size, 
+		double scale, const arc_paramsT *arc_settings, const curve_formatT *curve_format)
+{
+	using std::cout;
+	using std::endl;
+
+	if (params.empty())
+		return 0;
+	shard_size = std::max(shard_size, static_cast<size_t>(1));
+	size_t n_shards = (params.size() + shard_size - 1) / shard_size;
+
+	// The sources are prepared once for all shards (when the first shard is claimed)
+	std::map<long, sourceT> resized;
+	std::map<long, Mat> backgrounds;
+	bool prepared = false;
+
+	// Workers start at different shards, so they rarely compete for the same lock
+	size_t start = std::hash<std::string>()(queue.get_owner()) % n_shards;
+	std::set<size_t> failed_shards;
+	bool curves_failed = false;
+	int n_failed = 0;
+	size_t n_shards_done = 0, n_waiting = 0;
+	while (true)
+	{
+		// The curve export is one more task, claimed (or taken over) like the shards
+		size_t n_open = 0;
+		bool claimed = false;
+		if (curve_format and !curves_failed and !queue.is_done("curves"))
+		{
+			++n_open;
+			if (queue.claim("curves"))
+			{
+				claimed = true;
+				cout << "-> Claimed curves" << endl;
+				int n_curves_failed = run_curve_export(lens, params, out_prefix, *curve_format);
+				n_failed += n_curves_failed;
+				if (n_curves_failed != 0 or !queue.complete("curves"))
+				{
+					queue.release();
+					curves_failed = true;
+				}
+				--n_open;
+			}
+		}
+
+		// Pass over all shards not done yet (except the ones that failed here) and render the claimable ones
+		for (size_t n = 0; n < n_shards; ++n)
+		{
+			size_t shard = (start + n) % n_shards;
+			std::ostringstream task;
+			task << "shard_" << std::setw(5) << std::setfill('0') << shard;
+			if (failed_shards.count(shard) or queue.is_done(task.str()))
+				continue;
+			++n_open;
+			if (!queue.claim(task.str()))
+				continue;
+
+			claimed = true;
+			size_t first = shard * shard_size;
+			size_t last = std::min(first + shard_size, params.size());
+			cout << "-> Claimed " << task.str() << " (frames " << first << "-" << last-1 << ")" << endl;
+			if (!prepared)
+			{
+				prepare_sweep_sources(lens, src, params, w, h, scale, arc_settings, resized, backgrounds);
+				prepared = true;
+			}
+			int n_shard_failed = render_sweep_frames(lens, resized, backgrounds, params, first, last, w, h, 
+					out_prefix, batch_size, scale, arc_settings);
+
+			// Failed shards are left to the other workers
+			n_failed += n_shard_failed;
+			if (n_shard_failed == 0 and queue.complete(std::to_string(last - first) + " frames"))
+				++n_shards_done;
+			else
+			{
+				queue.release();
+				failed_shards.insert(shard);
+			}
+			--n_open;
+		}
+		if (n_open == 0)
+			break;
+
+		// The remaining tasks are held by other workers: wait for them (or until their locks are stale)
+		if (!claimed)
+		{
+			if (n_open != n_waiting)
+				cout << "-> Waiting for " << n_open << " task(s) held by other workers" << endl;
+			n_waiting = n_open;
+			std::this_thread::sleep_for(std::chrono::seconds(5));
+		}
+	}
+
+	cout << "-> Worker " << queue.get_owner() << " rendered " << n_shards_done << " of " << n_shards << " shards";
+	if (!failed_shards.empty())
+		cout << " (" << failed_shards.size() << " failed)";
+	cout << endl;
+	return n_failed;
+}
+
+// ---- band_queueT class members: ----
+
+band_queueT::band_queueT(size_t capacity_) : capacity(std::max(capacity_, static_cast<size_t>(1))) {}
+
+// Append a band, waiting while the queue is full
+void band_queueT::push(bandT &band)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	not_full.wait(lock, [this]{ return bands.size() < capacity; });
+	bands.push_back(band);
+	band.image.release();
+	not_empty.notify_one();
+}
+
+// Take the oldest band, waiting while the queue is empty
+bool band_queueT::pop(bandT &band)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	not_empty.wait(lock, [this]{ return !bands.empty() or closed; });
+	if (bands.empty())
+		return false;
+	band = bands.front();
+	bands.pop_front();
+	not_full.notify_one();
+	return true;
+}
+
+// Signal that no more bands will be pushed
+void band_queueT::close()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	closed = true;
+	not_empty.notify_all();
+}
+
+// Render the whole canvas in bands and stream them to a binary PPM file
+bool run_poster(lensT &lens, sourceT &src, int w, int h, const std::string &filename, int band_height, 
+		size_t max_in_flight)
+{
+	std::ofstream outfile(filename, std::ios::binary);
+	outfile << "P6\n" << w << " " << h << "\n255\n";
+	if (!outfile.good())
+	{
+		std::cout << "Error writing " << filename << std::endl;
+		return false;
+	}
+
+	// The writer thread converts the bands to RGB and appends them to the file
+	band_queueT queue(max_in_flight);
+	bool write_ok = true;
+	std::thread writer([&]
+	{
+		bandT band;
+		Mat rgb;
+		while (queue.pop(band))
+		{
+			cv::cvtColor(band.image, rgb, cv::COLOR_BGR2RGB);
+			for (int i = 0; i < rgb.rows; ++i)
+				outfile.write(rgb.ptr<char>(i), 3 * static_cast<std::streamsize>(rgb.cols));
+			write_ok = write_ok and outfile.good();
+		}
+	});
+
+	/**
+	 * Render band by band; pushing blocks while the writer is behind. (Tiled sources decode the 
+	 * source rows each band can sample and prefetch the ones of the next band)
+	 */
+	double reach[2] = {lens.get_max_deflection(1) * std::fabs(lens.weight) + 1., 
+		lens.get_max_deflection(2) * std::fabs(lens.weight) + 1.};
+	band_height = std::max(1, band_height);
+	int n_bands = (h + band_height - 1) / band_height;
+	for (int n = 0; n < n_bands; ++n)
+	{
+		bandT band;
+		band.first_row = n * band_height;
+		int rows = std::min(band_height, h - band.first_row);
+		band.image = Mat(rows, w, CV_8UC3);
+		src.prepare_area(-reach[0], band.first_row - reach[1], w + reach[0], band.first_row + rows + reach[1]);
+		src.prepare_area(-reach[0], band.first_row + rows - reach[1], w + reach[0], 
+				band.first_row + 2 * rows + reach[1], true);
+		cv::parallel_for_(cv::Range(0, rows), Parallel_band_renderer(&lens, &src, band.image, band.first_row), 
+				render_stripes(rows));
+		queue.push(band);
+		if ((n+1) % 16 == 0 or n+1 == n_bands)
+			std::cout << "-> Rendered " << std::min(h, (n+1) * band_height) << " of " << h << " rows" << std::endl;
+	}
+	queue.close();
+	writer.join();
+
+	if (!write_ok)
+		std::cout << "Error writing " << filename << std::endl;
+	return write_ok;
+}
+
+// Parse a list of weights ("1,2.5,4" or "start:stop:step")
+bool parse_weight_list(const std::string &list, vector<double> &weights)
+{
+	double start, stop, step;
+	char sep1, sep2;
+	std::istringstream range(list);
+	if (list.find(':') != std::string::npos)
+	{
+		if (!(range >> start >> sep1 >> stop >> sep2 >> step) or sep1 != ':' or sep2 != ':' or step <= 0)
+			return false;
+		
+		// Count the steps in integers to avoid accumulating rounding errors
+		for (int n = 0; start + n*step <= stop + 1e-9*step; ++n)
+			weights.push_back(start + n*step);
+		return !weights.empty();
+	}
+
+	std::istringstream values(list);
+	std::string token;
+	while (std::getline(values, token, ','))
+	{
+		char *eptr;
+		double val = std::strtod(token.c_str(), &eptr);
+		if (eptr == token.c_str())
+			return false;
+		weights.push_back(val);
+	}
+	return !weights.empty();
+}
+
+// Compute Einstein radius and caustic cross-section for a list of weights and write them as a table
+bool run_cross_section(lensT &lens, const vector<double> &weights, const std::string &out_prefix)
+{
+	vector<lens_statsT> stats;
+	lens.compute_cross_sections(weights, stats);
+
+	std::ostringstream table;
+	table << "# weight, cc_area_px2, einstein_radius_px, caustic_area_px2" << std::endl;
+	for (const lens_statsT &st : stats)
+		table << st.weight << ", " << st.cc_area << ", " << st.einstein_radius << ", " << st.caustic_area << std::endl;
+	std::cout << table.str();
+
+	if (out_prefix.empty())
+		return true;
+
+	std::string fn = out_prefix + "_cross_section.csv";
+	std::ofstream outfile(fn);
+	outfile << table.str();
+	if (!outfile.good())
+	{
+		std::cout << "Error writing " << fn << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Write an arc catalog as CSV file
+bool write_arc_catalog(const std::string &filename, const vector<arcT> &arcs)
+{
+	std::ofstream outfile(filename);
+	outfile << "# area_px, x, y, length_px, width_px, angle_rad, giant" << std::endl;
+	for (const arcT &arc : arcs)
+		outfile << arc.area << ", " << arc.x << ", " << arc.y << ", " << arc.length << ", " 
+			<< arc.width << ", " << arc.angle << ", " << arc.giant << std::endl;
+
+	if (!outfile.good())
+	{
+		std::cout << "Error writing " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+const char *curve_format_names[N_CURVE_FORMATS] = {"csv", "geojson", "svg"};
+
+// Write the critical curves and caustics of the lens as polylines
+bool write_curves(const std::string &filename, curve_formatT format, lensT &lens)
+{
+	const vector<vector<cv::Point>> &cc = lens.get_cc_contours();
+	vector<vector<cv::Point2d>> caustics;
+	map_cc_to_caustics(lens, cc, caustics);
+	double center[2] = {0.5 * lens.get_width(), 0.5 * lens.get_height()};
+
+	std::ofstream outfile(filename);
+	outfile.precision(8);
+	switch (format)
+	{
+		case CURVES_CSV :
+			outfile << "# weight = " << lens.weight << ", lens center = (" << center[0] << ", " << center[1] << ")" << std::endl;
+			outfile << "# curve, type, x_px, y_px, x_rel, y_rel" << std::endl;
+			for (size_t n = 0; n < cc.size(); ++n)
+			{
+				for (const cv::Point &p : cc[n])
+					outfile << n << ", cc, " << p.x << ", " << p.y << ", " 
+						<< p.x - center[0] << ", " << p.y - center[1] << std::endl;
+				for (const cv::Point2d &p : caustics[n])
+					outfile << n << ", caustic, " << p.x << ", " << p.y << ", " 
+						<< p.x - center[0] << ", " << p.y - center[1] << std::endl;
+			}
+			break;
+
+		case CURVES_GEOJSON :
+			outfile << "{\"type\": \"FeatureCollection\", \"features\": [" << std::endl;
+			for (size_t n = 0; n < cc.size(); ++n)
+				for (int type = 0; type < 2; ++type)
+				{
+					// Closed polylines as LineStrings ending at their first point
+					outfile << ((n > 0 or type > 0) ? "," : "") << "{\"type\": \"Feature\", \"properties\": {\"curve\": " << n 
+						<< ", \"type\": \"" << (type == 0 ? "critical_curve" : "caustic") << "\", \"weight\": " << lens.weight 
+						<< ", \"lens_center\": [" << center[0] << ", " << center[1] << "]}, "
+						<< "\"geometry\": {\"type\": \"LineString\", \"coordinates\": [";
+					size_t n_points = cc[n].size();
+					for (size_t k = 0; k <= n_points; ++k)
+					{
+						cv::Point2d p = (type == 0) ? cv::Point2d(cc[n][k % n_points]) : caustics[n][k % n_points];
+						outfile << (k > 0 ? ", " : "") << "[" << p.x << ", " << p.y << "]";
+					}
+					outfile << "]}}" << std::endl;
+				}
+			outfile << "]}" << std::endl;
+			break;
+
+		case CURVES_SVG :
+			outfile << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << lens.get_width() << "\" height=\"" 
+				<< lens.get_height() << "\" viewBox=\"0 0 " << lens.get_width() << " " << lens.get_height() << "\">" << std::endl;
+			for (int type = 0; type < 2; ++type)
+			{
+				outfile << "<g id=\"" << (type == 0 ? "critical_curves" : "caustics") << "\" fill=\"none\" stroke=\"" 
+					<< (type == 0 ? "white" : "red") << "\" stroke-width=\"1\" vector-effect=\"non-scaling-stroke\">" << std::endl;
+				for (size_t n = 0; n < cc.size(); ++n)
+				{
+					outfile << "<polygon points=\"";
+					for (size_t k = 0; k < cc[n].size(); ++k)
+					{
+						cv::Point2d p = (type == 0) ? cv::Point2d(cc[n][k]) : caustics[n][k];
+						outfile << (k > 0 ? " " : "") << p.x << "," << p.y;
+					}
+					outfile << "\"/>" << std::endl;
+				}
+				outfile << "</g>" << std::endl;
+			}
+			outfile << "</svg>" << std::endl;
+			break;
+
+		default :
+			return false;
+	}
+
+	if (!outfile.good())
+	{
+		std::cout << "Error writing " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Export the critical curves and caustics once per distinct weight of a sweep
+int run_curve_export(lensT &lens, const vector<sweep_paramT> &params, const std::string &out_prefix, 
+		curve_formatT format)
+{
+	std::map<long, double> weights; // Keyed in units of 1/1000 like the source sizes in run_sweep
+	for (const sweep_paramT &p : params)
+		weights[static_cast<long>(floor(p.weight * 1000. + 0.5))] = p.weight;
+
+	int n_failed = 0;
+	for (const auto &entry : weights)
+	{
+		lens.weight = entry.second;
+		lens.update_cc_and_caustics(true);
+		std::ostringstream fn;
+		fn << out_prefix << "_curves_w" << std::fixed << std::setprecision(3) << entry.second 
+			<< "." << curve_format_names[format];
+		if (!write_curves(fn.str(), format, lens))
+			++n_failed;
+	}
+	std::cout << "-> Exported the curves of " << weights.size() << " weights" << std::endl;
+	return n_failed;
+}
@@ -0,0 +1,220 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <opencv2/core/core.hpp>
+#include "lens.h"
+#include "analysis.h"
+
+class work_queueT;
+
+using cv::Mat;
+
+/**
+ * @brief Parameter set of a single frame within a batch parameter sweep
+ */
+struct sweep_paramT
+{
+	int x = 0;			// Lens center x-position on the screen
+	int y = 0;			// Lens center y-position on the screen
+	double weight = 1.;		// Weight factor re-scaling the convergence
+	double source_size = 1.;	// Angular size factor of the source (1 = original size)
+};
+
+/**
+ * @brief File formats of the vector export of critical curves and caustics
+ */
+enum curve_formatT { CURVES_CSV, CURVES_GEOJSON, CURVES_SVG, N_CURVE_FORMATS };
+
+/**
+ * File extensions of the curve formats (in the order of curve_formatT, also used on the command line)
+ */
+extern const char *curve_format_names[N_CURVE_FORMATS];
+
+/**
+ * Read sweep parameters from a text file. Each line holds one frame as "x y weight source_size";
+ * empty lines and lines starting with "#" are ignored.
+ *
+ * @param[in] filename Name of the parameter file
+ * @param[out] params Parameter sets read from the file (in file order)
+ * @return Whether the file could be read without errors
+ */
+bool read_sweep_file(const std::string &filename, std::vector<sweep_paramT> &params);
+
+/**
+ * Render a batch of parameter sets in a single pass over the deflection field of the lens
+ *
+ * @param[in] lens Lens object to use for rendering
+ * @param[in] sources Source object for each parameter set (already resized, placed on the screen)
+ * @param[in] params Parameter sets to render
+ * @param[in] w Screen width
+ * @param[in] h Screen height
+ * @param[out] frames Rendered image per parameter set (CV_8UC3, scaled screen size)
+ * @param[in] scale Output resolution relative to the screen (< 1: lens positions are snapped to the 
+ *                  output pixel grid and a coarser level of detail of the lens is used)
+ */
+void render_sweep(lensT &lens, std::vector<sourceT*> &sources, const std::vector<sweep_paramT> &params, 
+		int w, int h, std::vector<Mat> &frames, double scale = 1.);
+
+/**
+ * Run a full batch sweep: render all parameter sets in batches and write each frame to
+ * "<out_prefix>_<index>.png". If arc detection is enabled, an arc catalog is written for each 
+ * frame to "<out_prefix>_<index>_arcs.csv".
+ *
+ * @param lens Lens object to use for rendering
+ * @param src Source object (at original size, placed on the screen)
+ * @param params Parameter sets to render
+ * @param w Screen width
+ * @param h Screen height
+ * @param out_prefix Prefix of the output files (may contain a directory)
+ * @param batch_size Maximum number of frames rendered (and held in memory) at once
+ * @param scale Output resolution relative to the screen
+ * @param arc_settings Arc detection settings (nullptr: no arc detection)
+ * @return Number of frames that could not be written
+ */
+int run_sweep(lensT &lens, sourceT &src, const std::vector<sweep_paramT> &params, int w, int h,
+		const std::string &out_prefix, size_t batch_size, double scale = 1., 
+		const arc_paramsT *arc_settings = nullptr);
+
+/**
+ * Run a batch sweep as one of any number of workers (processes on any nodes) sharing a work queue 
+ * on a shared filesystem. The parameter sets are split into shards of consecutive frames, which are 
+ * claimed from the queue and rendered like in run_sweep (frame numbers refer to the whole sweep). The 
+ * lens products and the resized sources are prepared once per worker. The optional curve export is 
+ * one more task of the queue. Returns when all tasks are done, after waiting for the tasks held by 
+ * other workers (which are taken over once their locks are stale).
+ *
+ * @param queue Work queue (tasks "shard_<index>" and "curves")
+ * @param shard_size Number of frames per shard (the same for all workers)
+ * @param lens, src, params, w, h, out_prefix, batch_size, scale, arc_settings See run_sweep
+ * @param curve_format Format of the curve export (nullptr: no export; see run_curve_export)
+ * @return Number of frames and curve files that could not be written by this worker
+ */
+int run_sweep_worker(work_queueT &queue, size_t shard_size, lensT &lens, sourceT &src, 
+		const std::vector<sweep_paramT> &params, int w, int h, const std::string &out_prefix, 
+		size_t batch_size, double scale = 1., const arc_paramsT *arc_settings = nullptr, 
+		const curve_formatT *curve_format = nullptr);
+
+/**
+ * Write an arc catalog as CSV file
+ *
+ * @param filename Name of the output file
+ * @param arcs Arc catalog
+ * @return Whether the file could be written
+ */
+bool write_arc_catalog(const std::string &filename, const std::vector<arcT> &arcs);
+
+/**
+ * Write the critical curves of the lens (as traced by the last update_cc_and_caustics) and the 
+ * caustics they map to as polylines. Coordinates are lens pixels (x right, y down); CSV additionally 
+ * lists coordinates relative to the lens center, GeoJSON stores the center as property.
+ *
+ * @param filename Name of the output file
+ * @param format File format
+ * @param lens Lens whose curves to export (at its current weight)
+ * @return Whether the file could be written
+ */
+bool write_curves(const std::string &filename, curve_formatT format, lensT &lens);
+
+/**
+ * Export the critical curves and caustics once per distinct weight of a sweep to 
+ * "<out_prefix>_curves_w<weight>.<ext>" (both tangential and radial critical curves)
+ *
+ * @param lens Lens object to analyze (its weight and critical curves are changed)
+ * @param params Parameter sets of the sweep
+ * @param out_prefix Prefix of the output files (may contain a directory)
+ * @param format File format
+ * @return Number of files that could not be written
+ */
+int run_curve_export(lensT &lens, const std::vector<sweep_paramT> &params, const std::string &out_prefix, 
+		curve_formatT format);
+
+/**
+ * @brief Rendered band of a poster, waiting to be written
+ */
+struct bandT
+{
+	int first_row = 0;		// Canvas row of the first band row
+	Mat image;			// Band image (CV_8UC3)
+};
+
+/**
+ * @brief Bounded FIFO queue handing rendered bands from the renderer to the writer thread
+ */
+class band_queueT
+{
+	private:
+		std::deque<bandT> bands;
+		size_t capacity;
+		bool closed = false;
+		std::mutex mutex;
+		std::condition_variable not_full, not_empty;
+	public:
+		/**
+		 * Constructor
+		 * @param capacity_ Max. number of bands waiting in the queue
+		 */
+		band_queueT(size_t capacity_);
+
+		/**
+		 * Append a band, waiting while the queue is full
+		 * @param band Band to append (its image is moved into the queue)
+		 */
+		void push(bandT &band);
+
+		/**
+		 * Take the oldest band, waiting while the queue is empty
+		 * @param[out] band Band taken from the queue
+		 * @return False if the queue is closed and all bands have been taken
+		 */
+		bool pop(bandT &band);
+
+		/**
+		 * Signal that no more bands will be pushed
+		 */
+		void close();
+};
+
+/**
+ * Render the lensed image of the whole canvas in horizontal bands and stream them to a binary PPM 
+ * file (P6) while the next bands are rendered. At most max_in_flight bands (plus the one being 
+ * rendered and the one being written) are held in memory, independent of the canvas size.
+ *
+ * @param lens Lens object to use for rendering (at its current position and weight)
+ * @param src Source object (placed on the canvas)
+ * @param w Canvas width
+ * @param h Canvas height
+ * @param filename Name of the output file
+ * @param band_height Number of rows per band
+ * @param max_in_flight Max. number of rendered bands waiting to be written
+ * @return Whether the file could be written
+ */
+bool run_poster(lensT &lens, sourceT &src, int w, int h, const std::string &filename, int band_height, 
+		size_t max_in_flight = 2);
+
+/**
+ * Parse a list of weights, given either as comma-separated values ("1,2.5,4") or as a range 
+ * "start:stop:step" (including stop)
+ *
+ * @param[in] list String to parse
+ * @param[out] weights Parsed weights
+ * @return Whether the string could be parsed
+ */
+bool parse_weight_list(const std::string &list, std::vector<double> &weights);
+
+/**
+ * Compute the Einstein radius and caustic cross-section of the lens for a list of weights and
+ * write the results as a table to stdout and (if a prefix is given) to "<out_prefix>_cross_section.csv"
+ *
+ * @param lens Lens object to analyze
+ * @param weights Weight factors to evaluate
+ * @param out_prefix Prefix of the output file (empty: write to stdout only)
+ * @return Whether the table could be written
+ */
+bool run_cross_section(lensT &lens, const std::vector<double> &weights, const std::string &out_prefix);
+
+#endif
@@ -0,0 +1,84 @@
+#include <cmath> // log10, fabs, pow
+#include <algorithm> // std::min, std::max
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "colormap.h"
+
+const char *colormap_names[N_CMAPS] = {"gray", "viridis", "magma", "inferno", "plasma"};
+
+// Fill a premultiplied BGRA table for blending a grayscale layer
+void build_colormap_lut(colormapT cmap, double opacity, cv::Vec4b (&lut)[256])
+{
+	// Let OpenCV evaluate the colormap on a ramp of all 256 values
+	cv::Mat ramp(1, 256, CV_8UC1), colors;
+	for (int v = 0; v < 256; ++v)
+		ramp.at<uchar>(0,v) = static_cast<uchar>(v);
+	const int cv_cmaps[N_CMAPS] = {-1, cv::COLORMAP_VIRIDIS, cv::COLORMAP_MAGMA, cv::COLORMAP_INFERNO, cv::COLORMAP_PLASMA};
+	if (cmap == CMAP_GRAY)
+		cv::cvtColor(ramp, colors, cv::COLOR_GRAY2BGR);
+	else
+		cv::applyColorMap(ramp, colors, cv_cmaps[cmap]);
+
+	opacity = std::min(std::max(opacity, 0.), 1.);
+	for (int v = 0; v < 256; ++v)
+	{
+		double alpha = opacity * v / 255.;
+		for (int c = 0; c < 3; ++c)
+			lut[v][c] = static_cast<uchar>(alpha * colors.at<cv::Vec3b>(0,v)[c] + 0.5);
+		lut[v][3] = static_cast<uchar>(alpha * 255. + 0.5);
+	}
+}
+
+// Encode a magnification as 8-bit colormap index (log-scaled, with parity sign)
+unsigned char magnification_index(double detJ)
+{
+	// log10|mu| = -log10|detJ|, mapped onto [0,1]
+	double log_mu = (detJ == 0.) ? mag_log_max : -log10(fabs(detJ));
+	double t = (std::min(std::max(log_mu, mag_log_min), mag_log_max) - mag_log_min) / (mag_log_max - mag_log_min);
+	int step = static_cast<int>(t * 127. + 0.5);
+	return (detJ < 0.) ? 127 - step : 128 + step;
+}
+
+// Fill the diverging colormap for the magnification map
+void build_parity_lut(cv::Vec3b (&lut)[256])
+{
+	// Colors (BGR) at low and high |mu| for either parity
+	const double dark[3] = {40., 40., 40.};
+	const double neg_high[3] = {255., 230., 60.};
+	const double pos_high[3] = {40., 220., 255.};
+
+	for (int idx = 0; idx < 256; ++idx)
+	{
+		bool negative = idx < 128;
+		double t = negative ? (127 - idx) / 127. : (idx - 128) / 127.;
+		const double *high = negative ? neg_high : pos_high;
+		for (int c = 0; c < 3; ++c)
+			lut[idx][c] = static_cast<unsigned char>(dark[c] + t * (high[c] - dark[c]) + 0.5);
+	}
+}
+
+const char *tone_map_names[N_TONE_MAPS] = {"clip", "reinhard"};
+
+// Fill the table encoding linear light in [0,1] as 8-bit sRGB
+void build_srgb_encode_lut(unsigned char (&lut)[srgb_lut_size])
+{
+	for (int n = 0; n < srgb_lut_size; ++n)
+	{
+		double v = static_cast<double>(n) / (srgb_lut_size - 1);
+		double encoded = (v <= 0.0031308) ? 12.92 * v : 1.055 * pow(v, 1./2.4) - 0.055;
+		lut[n] = static_cast<unsigned char>(255. * encoded + 0.5);
+	}
+}
+
+// Decode an 8-bit sRGB image into linear light
+void srgb_decode(const cv::Mat &in, cv::Mat &out)
+{
+	cv::Mat lut(1, 256, CV_32FC1);
+	for (int n = 0; n < 256; ++n)
+	{
+		double v = n / 255.;
+		lut.at<float>(0,n) = static_cast<float>((v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4));
+	}
+	cv::LUT(in, lut, out);
+}
@@ -0,0 +1,77 @@
+#ifndef COLORMAP_H
+#define COLORMAP_H
+
+#include <opencv2/core/core.hpp>
+
+/**
+ * Colormaps available for the kappa overlay (perceptually uniform ones taken from OpenCV)
+ */
+enum colormapT { CMAP_GRAY, CMAP_VIRIDIS, CMAP_MAGMA, CMAP_INFERNO, CMAP_PLASMA, N_CMAPS };
+
+/**
+ * Names of the colormaps as used on the command line (in the order of colormapT)
+ */
+extern const char *colormap_names[N_CMAPS];
+
+/**
+ * Fill a premultiplied BGRA table for blending a grayscale layer: entry v has the colormap color 
+ * at v, scaled by its opacity alpha = opacity * v/255, which is stored in the fourth channel. 
+ * Blending then reads final = lensed * (255-alpha)/255 + entry.
+ *
+ * @param cmap Colormap to use
+ * @param opacity Opacity of the layer at value 255 (0..1)
+ * @param[out] lut Premultiplied colormap (BGRA)
+ */
+void build_colormap_lut(colormapT cmap, double opacity, cv::Vec4b (&lut)[256]);
+
+/**
+ * Index range of the magnification maps: indices below 128 encode negative parity, indices from 128 
+ * encode positive parity. Within each half, log10|mu| in [mag_log_min, mag_log_max] is mapped linearly 
+ * onto 128 steps (increasing away from the center of the index range).
+ */
+const double mag_log_min = -1.;
+const double mag_log_max = 2.;
+
+/**
+ * Encode a magnification as 8-bit colormap index (log-scaled, with parity sign)
+ * @param detJ Determinant of the Jacobian of the lens mapping (mu = 1/detJ)
+ * @return Colormap index (0-127: negative parity, 128-255: positive parity)
+ */
+unsigned char magnification_index(double detJ);
+
+/**
+ * Fill the diverging colormap for the magnification map: blue for negative, red/yellow for positive 
+ * parity, brighter with increasing |mu|
+ * @param[out] lut Colormap (BGR)
+ */
+void build_parity_lut(cv::Vec3b (&lut)[256]);
+
+/**
+ * Tone mapping operators for high dynamic range sources (applied after scaling with the exposure)
+ */
+enum tone_mapT { TONE_CLIP, TONE_REINHARD, N_TONE_MAPS };
+
+/**
+ * Names of the tone mapping operators as used on the command line (in the order of tone_mapT)
+ */
+extern const char *tone_map_names[N_TONE_MAPS];
+
+/**
+ * Number of entries of the sRGB encoding table (covering linear values in [0,1])
+ */
+const int srgb_lut_size = 4096;
+
+/**
+ * Fill the table encoding linear light in [0,1] (index / (srgb_lut_size-1)) as 8-bit sRGB
+ * @param[out] lut sRGB values
+ */
+void build_srgb_encode_lut(unsigned char (&lut)[srgb_lut_size]);
+
+/**
+ * Decode an 8-bit sRGB image into linear light
+ * @param[in] in Image (CV_8UC3)
+ * @param[out] out Linear light in [0,1] (CV_32FC3)
+ */
+void srgb_decode(const cv::Mat &in, cv::Mat &out);
+
+#endif
@@ -0,0 +1,67 @@
+#include <iostream> // std::cout
+#include <cstdlib> // std::getenv
+#include <string>
+
+#include "cpu_dispatch.h"
+
+const char *isa_names[N_ISAS] = {"generic", "sse4.2", "avx2", "avx512"};
+
+// Instruction set of the kernels (generic until select_isa is called)
+static isaT current_isa = ISA_GENERIC;
+
+// Detect the most capable instruction set supported by the CPU
+isaT detect_isa()
+{
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+	__builtin_cpu_init();
+
+	// The AVX2 and AVX-512 kernels also use F16C (see TARGET_AVX2), which not every AVX2 CPU reports
+	bool f16c = __builtin_cpu_supports("f16c");
+	if (f16c and __builtin_cpu_supports("avx512f") and __builtin_cpu_supports("avx512bw")
+			and __builtin_cpu_supports("avx512vl") and __builtin_cpu_supports("avx512dq"))
+		return ISA_AVX512;
+	if (f16c and __builtin_cpu_supports("avx2"))
+		return ISA_AVX2;
+	if (__builtin_cpu_supports("sse4.2"))
+		return ISA_SSE42;
+#endif
+	return ISA_GENERIC;
+}
+
+// Select the instruction set of the kernels (detected or given by QUICKLENS_ISA)
+isaT select_isa()
+{
+	isaT detected = detect_isa();
+	current_isa = detected;
+	const char *requested = std::getenv("QUICKLENS_ISA");
+	if (requested and *requested)
+	{
+		int n = 0;
+		while (n < N_ISAS and std::string(requested) != isa_names[n])
+			++n;
+		if (n == N_ISAS)
+			std::cout << "-> Unknown instruction set QUICKLENS_ISA=" << requested << ", ignored" << std::endl;
+		else if (n > detected)
+			std::cout << "-> Instruction set " << requested << " is not supported by this CPU, ignored" << std::endl;
+		else
+			current_isa = static_cast<isaT>(n);
+	}
+
+	std::cout << "-> Using " << isa_names[current_isa] << " kernels (CPU supports " << isa_names[detected];
+	std::cout << ((current_isa != detected) ? ", set by QUICKLENS_ISA)" : ")") << std::endl;
+	return current_isa;
+}
+
+// Set the instruction set of the kernels
+isaT set_isa(isaT isa)
+{
+	isaT detected = detect_isa();
+	current_isa = (isa > detected) ? detected : isa;
+	return current_isa;
+}
+
+// Get the instruction set of the kernels
+isaT active_isa()
+{
+	return current_isa;
+}
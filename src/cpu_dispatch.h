@@ -0,0 +1,79 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+/**
+ * Runtime selection of the instruction set used by the hot kernels. The binary is built for the
+ * generic target; the kernels are additionally compiled for SSE4.2, AVX2 and AVX-512 (from the same
+ * source, see MULTIVERSION_KERNEL) and the best version supported by the CPU is chosen at startup.
+ */
+enum isaT {ISA_GENERIC, ISA_SSE42, ISA_AVX2, ISA_AVX512, N_ISAS};
+
+// Names of the instruction sets (also accepted by the environment variable QUICKLENS_ISA)
+extern const char *isa_names[N_ISAS];
+
+// The AVX2 and AVX-512 kernels also use F16C (half-precision conversion), checked by detect_isa
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2,f16c")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx512dq,avx2,f16c")))
+#define KERNEL_INLINE __attribute__((always_inline)) inline
+#else
+#define TARGET_SSE42
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define KERNEL_INLINE inline
+#endif
+
+/**
+ * Compile the kernel "name" (defined before as static KERNEL_INLINE function) once per instruction
+ * set and define name_dispatch, which calls the version selected at startup. All versions give the 
+ * same results, since the build does not contract products and sums into fused multiply-adds.
+ *
+ * @param ret Return type
+ * @param name Kernel name
+ * @param params Parenthesized parameter list
+ * @param args Parenthesized argument list (the parameter names)
+ */
+#define MULTIVERSION_KERNEL(ret, name, params, args) \
+	static TARGET_SSE42 ret name##_sse42 params { return name args; } \
+	static TARGET_AVX2 ret name##_avx2 params { return name args; } \
+	static TARGET_AVX512 ret name##_avx512 params { return name args; } \
+	static ret name##_dispatch params \
+	{ \
+		switch (active_isa()) \
+		{ \
+			case ISA_AVX512 : return name##_avx512 args; \
+			case ISA_AVX2 : return name##_avx2 args; \
+			case ISA_SSE42 : return name##_sse42 args; \
+			default : return name args; \
+		} \
+	}
+
+/**
+ * Detect the most capable instruction set supported by the CPU (via CPUID)
+ * @return Instruction set
+ */
+isaT detect_isa();
+
+/**
+ * Select the instruction set of the kernels: the detected one, unless the environment variable
+ * QUICKLENS_ISA names another (e.g. for benchmarking); unsupported choices fall back to the detected
+ * instruction set. The choice is reported on the console.
+ * @return Selected instruction set
+ */
+isaT select_isa();
+
+/**
+ * Set the instruction set of the kernels (limited to the ones supported by the CPU)
+ * @param isa Instruction set
+ * @return Instruction set in use
+ */
+isaT set_isa(isaT isa);
+
+/**
+ * Get the instruction set of the kernels
+ * @return Instruction set in use
+ */
+isaT active_isa();
+
+#endif
@@ -0,0 +1,128 @@
+#include <cmath> // sqrt, floor
+#include <algorithm> // std::min, std::max
+#include <sstream>
+
+#include "governor.h"
+
+/**
+ * governorT Constructor
+ * @param target_fps Frame rate to hold during interaction (0: disabled, i.e. always full quality)
+ * @param min_scale_ Lowest render resolution relative to the view (0..1)
+ * @param max_supersampling_ Highest supersampling factor (1: none)
+ * @param max_overlay_interval_ Max. number of frames between overlay updates
+ */
+governorT::governorT(double target_fps, double min_scale_, int max_supersampling_, int max_overlay_interval_)
+	: target_time(target_fps > 0. ? 1. / target_fps : 0.), min_scale(std::min(1., std::max(0.05, min_scale_))),
+	  max_supersampling(std::max(1, max_supersampling_)), max_overlay_interval(std::max(1, max_overlay_interval_)) {}
+
+// Check whether the governor is active
+bool governorT::enabled()
+{
+	return target_time > 0.;
+}
+
+// Check whether the idle (full) quality is in use
+bool governorT::is_idle()
+{
+	return idle;
+}
+
+// Mark the start of an interactive frame
+void governorT::begin_frame()
+{
+	idle = false;
+}
+
+// Report the times of a completed interactive frame and adjust the settings
+bool governorT::frame_done(double render_time, double overlay_time, double render_factor)
+{
+	if (!enabled())
+		return false;
+
+	// Render time at view resolution, smoothed to avoid reacting to single slow frames
+	double cost = render_time / (render_factor * render_factor);
+	render_cost = (render_cost > 0.) ? 0.5 * (render_cost + cost) : cost;
+
+	// Overlay updates may take up to half of the budget (on average over the skipped frames)
+	int interval = overlay_interval;
+	if (overlay_time > 0.)
+		overlay_cost = overlay_time;
+	if (overlay_time >= 0.)
+	{
+		interval = 1;
+		while (interval < max_overlay_interval and overlay_cost / interval > 0.5 * target_time)
+			interval *= 2;
+		interval = std::min(interval, max_overlay_interval);
+	}
+	double budget = target_time - ((overlay_time >= 0.) ? overlay_cost / interval : 0.);
+	budget = std::max(0.25 * target_time, budget);
+
+	/**
+	 * Only change the resolution if the expected render time leaves the band [0.6, 1.1] x budget,
+	 * then aim at 85% of the budget. Reduced resolutions are rounded down to steps of 1/8,
+	 * supersampling to integer factors.
+	 */
+	double new_scale = scale;
+	double expected = render_cost * scale * scale;
+	if (expected > 1.1 * budget or expected < 0.6 * budget)
+	{
+		double fit = sqrt(0.85 * budget / render_cost);
+		if (fit < 1.)
+			new_scale = std::max(min_scale, floor(fit * 8.) / 8.);
+		else
+			new_scale = std::min(static_cast<double>(max_supersampling), floor(fit));
+	}
+
+	bool changed = new_scale != scale or interval != overlay_interval;
+	scale = new_scale;
+	overlay_interval = interval;
+	return changed;
+}
+
+// Return to the idle (full) quality
+bool governorT::set_idle()
+{
+	if (idle)
+		return false;
+
+	idle = true;
+	return enabled() and (scale != max_supersampling or overlay_interval != 1);
+}
+
+// Get the render resolution relative to the view
+double governorT::get_render_factor()
+{
+	if (!enabled())
+		return 1.;
+	return idle ? static_cast<double>(max_supersampling) : scale;
+}
+
+// Get the lowest render resolution the governor may choose
+double governorT::get_min_render_factor()
+{
+	return enabled() ? min_scale : 1.;
+}
+
+// Get the number of frames between overlay updates
+int governorT::get_overlay_interval()
+{
+	return (enabled() and !idle) ? overlay_interval : 1;
+}
+
+// Describe the current quality settings
+std::string governorT::describe()
+{
+	std::ostringstream text;
+	double factor = get_render_factor();
+	if (factor > 1.)
+		text << static_cast<int>(factor) << "x supersampling";
+	else
+		text << static_cast<int>(factor * 100. + 0.5) << "% resolution";
+
+	int interval = get_overlay_interval();
+	if (interval == 1)
+		text << ", overlays every frame";
+	else
+		text << ", overlays every " << interval << " frames";
+	return text.str();
+}
@@ -0,0 +1,105 @@
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include <string>
+
+/**
+ * @brief Frame rate governor for the interactive mode: chooses the render resolution (relative to
+ * the view, values above 1 supersample it) and how often the overlays are recomputed while the
+ * user interacts, such that the frames stay within the time budget of a target frame rate.
+ *
+ * @details The cost of rendering a frame scales with the number of rendered pixels, so the measured
+ * render time is normalized to the view resolution and smoothed over frames; the resolution is then
+ * chosen to fit the budget left by the overlays. Overlay updates (critical curves, magnification map)
+ * do not depend on the resolution; they are skipped on intermediate frames if they would take more
+ * than half of the budget. When idle, the highest quality within the limits is used.
+ */
+class governorT
+{
+	private:
+		// User-set limits (a target time of 0 disables the governor)
+		double target_time = 0.;
+		double min_scale = 0.25;
+		int max_supersampling = 1;
+		int max_overlay_interval = 8;
+
+		// Current settings for interactive frames
+		double scale = 1.;
+		int overlay_interval = 1;
+		bool idle = true;
+
+		// Smoothed render time of a frame at view resolution and time of the last overlay update (s)
+		double render_cost = 0.;
+		double overlay_cost = 0.;
+
+	public:
+		/**
+		 * Constructor
+		 * @param target_fps Frame rate to hold during interaction (0: disabled, i.e. always full quality)
+		 * @param min_scale_ Lowest render resolution relative to the view (0..1)
+		 * @param max_supersampling_ Highest supersampling factor (1: none)
+		 * @param max_overlay_interval_ Max. number of frames between overlay updates
+		 */
+		governorT(double target_fps = 0., double min_scale_ = 0.25, int max_supersampling_ = 1,
+				int max_overlay_interval_ = 8);
+
+		/**
+		 * Check whether the governor is active
+		 * @return Whether a target frame rate is set
+		 */
+		bool enabled();
+
+		/**
+		 * Check whether the idle (full) quality is in use
+		 * @return Whether idle
+		 */
+		bool is_idle();
+
+		/**
+		 * Mark the start of an interactive frame (switches to the settings chosen for interaction)
+		 */
+		void begin_frame();
+
+		/**
+		 * Report the times of a completed interactive frame and adjust the settings
+		 *
+		 * @param render_time Time for rendering the frame (s)
+		 * @param overlay_time Time for updating the overlays (s), 0 if the update was skipped,
+		 * negative if no update was due in this frame
+		 * @param render_factor Render resolution the frame used (relative to the view)
+		 * @return Whether the settings changed
+		 */
+		bool frame_done(double render_time, double overlay_time, double render_factor);
+
+		/**
+		 * Return to the idle (full) quality
+		 * @return Whether the settings changed
+		 */
+		bool set_idle();
+
+		/**
+		 * Get the render resolution relative to the view
+		 * @return Resolution factor (below 1: reduced resolution, above 1: supersampling)
+		 */
+		double get_render_factor();
+
+		/**
+		 * Get the lowest render resolution the governor may choose
+		 * @return Resolution factor relative to the view
+		 */
+		double get_min_render_factor();
+
+		/**
+		 * Get the number of frames between overlay updates
+		 * @return Interval (1: every frame)
+		 */
+		int get_overlay_interval();
+
+		/**
+		 * Describe the current quality settings (for the HUD and the log)
+		 * @return Description
+		 */
+		std::string describe();
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include <iostream> // std::cout
+#include <cmath> // std::isnan
+
+// OpenCV core modules + image file codecs (no GUI dependency)
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+// Libraries needed for handling the FITS file format
+#if HAS_CCFITS == TRUE
+#include <CCfits/CCfits>
+#include <valarray>
+#endif
+
+#include "lens.h"
+#include "colormap.h"
+#include "image_io.h"
+
+// Load a lens convergence map (FITS or any image format supported by OpenCV)
+bool read_kappa(const std::string &filename, Mat &kappa)
+{
+	#if HAS_CCFITS == TRUE
+	try
+	{
+		// Try to read as FITS file. If this doesn't succeed, ...
+		readmap(filename, kappa);
+		return true;
+	}
+	catch (CCfits::FitsException&) {}
+	#endif
+
+	// ...read as normal PNG, JPG or any other file format supported by OpenCV
+	kappa = cv::imread(filename, cv::IMREAD_GRAYSCALE);
+	return kappa.data != nullptr;
+}
+
+// Load a source image (8-bit BGR, or linear light for high dynamic range sources)
+bool read_source(const std::string &filename, bool hdr, Mat &imageRGB)
+{
+	if (!hdr)
+	{
+		imageRGB = cv::imread(filename, cv::IMREAD_COLOR);
+		return imageRGB.data != nullptr;
+	}
+
+	/**
+	 * High dynamic range sources keep their depth (16-bit or float, e.g. TIFF, EXR or FITS); 
+	 * 8-bit images are decoded from sRGB into linear light
+	 */
+	imageRGB = cv::imread(filename, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+#if HAS_CCFITS == TRUE
+	if (!imageRGB.data)
+	{
+		try
+		{
+			Mat gray;
+			readmap(filename, gray);
+			gray.convertTo(gray, CV_32F);
+			cv::cvtColor(gray, imageRGB, cv::COLOR_GRAY2BGR);
+		}
+		catch (CCfits::FitsException&) {}
+	}
+#endif
+	if (imageRGB.data and imageRGB.depth() == CV_8U)
+		srgb_decode(imageRGB, imageRGB);
+	return imageRGB.data != nullptr;
+}
+
+#if HAS_CCFITS == TRUE
+// Function for importing *.FITS image data into a Mat array
+void readmap(std::string filename, Mat &cv_image)
+{
+	// Open FITS file and load primary HDU data into valarray
+	CCfits::FITS infile(filename, CCfits::Read, true);
+	CCfits::PHDU &img = infile.pHDU();
+	std::valarray<double> contents;
+	img.read(contents);
+	size_t w(img.axis(0));
+	size_t h(img.axis(1));
+
+	// Read the contents into Mat image
+	cv_image = Mat::zeros(h, w, CV_64FC1);
+	for (size_t i = 0; i < h; i++)
+		for(size_t j = 0; j < w; j++)
+		{
+			double val = contents[i*w + j];
+			if (std::isnan(val))
+				cv_image.at<double>(h-1-i, j) = 0.;
+			else
+				cv_image.at<double>(h-1-i, j) = val;
+
+		}	
+}
+
+/**
+ * Parallel_fits_encoder Constructor
+ * @param[in] products_ Lens products to convert
+ * @param[in] depths_ Output depth (CV_8U, CV_32F or CV_64F) per product
+ * @param[out] encoded_ Converted products (needs to have the size of products_)
+ */
+Parallel_fits_encoder::Parallel_fits_encoder(const std::vector<Mat> &products_, const std::vector<int> &depths_, 
+		std::vector<Mat> &encoded_) : products(products_), depths(depths_), encoded(encoded_) {}
+
+void Parallel_fits_encoder::operator()(const cv::Range &range) const
+{
+	// FITS images start at the bottom row (see readmap)
+	for (int n = range.start; n < range.end; ++n)
+	{
+		Mat flipped;
+		cv::flip(products[n], flipped, 0);
+		flipped.convertTo(encoded[n], depths[n]);
+	}
+}
+
+// Function for exporting the lens products into a multi-extension FITS file
+bool writemaps(std::string filename, lensT &lens, bool double_precision)
+{
+	// Collect the products (the critical curves have to refer to the current weight)
+	if (lens.get_cc().empty() or lens.get_cc_weight() != lens.weight)
+		lens.update_cc_and_caustics(true);
+	Mat alpha1, alpha2, shear;
+	lens.get_deflection_field(1, alpha1);
+	lens.get_deflection_field(2, alpha2);
+	lens.compute_shear(shear);
+
+	int float_depth = double_precision ? CV_64F : CV_32F;
+	std::vector<std::string> names;
+	std::vector<Mat> products;
+	std::vector<int> depths;
+	std::vector<double> weights;
+	if (!lens.get_psi().empty())
+	{
+		names.push_back("PSI");
+		products.push_back(lens.get_psi());
+		depths.push_back(float_depth);
+		weights.push_back(1.);
+	}
+	const char *field_names[] = {"ALPHA1", "ALPHA2", "SHEAR"};
+	Mat fields[] = {alpha1, alpha2, shear};
+	for (int n = 0; n < 3; ++n)
+	{
+		names.push_back(field_names[n]);
+		products.push_back(fields[n]);
+		depths.push_back(float_depth);
+		weights.push_back(1.);
+	}
+	names.push_back("CC_MAP");
+	products.push_back(lens.get_cc());
+	depths.push_back(CV_8U);
+	weights.push_back(lens.weight);
+	names.push_back("CAUSTIC_MAP");
+	products.push_back(lens.get_caustics());
+	depths.push_back(CV_8U);
+	weights.push_back(lens.weight);
+
+	// Convert all products in parallel; CFITSIO then compresses and writes the HDUs one by one
+	std::vector<Mat> encoded(products.size());
+	cv::parallel_for_(cv::Range(0, static_cast<int>(products.size())), Parallel_fits_encoder(products, depths, encoded));
+	for (size_t n = 0; n < products.size(); ++n)
+		products[n].release();
+
+	// Lossless compression with rows of tiles (byte-shuffled gzip suits floating point data)
+	try
+	{
+		CCfits::FITS outfile("!" + filename, CCfits::Write);
+		outfile.setCompressionType(GZIP_2);
+		std::vector<long> tile(2);
+		tile[0] = lens.get_width();
+		tile[1] = 16;
+		outfile.setTileDimensions(tile);
+		outfile.pHDU().addKey("CREATOR", std::string("quicklens"), "");
+
+		for (size_t n = 0; n < encoded.size(); ++n)
+		{
+			std::vector<long> naxes(2);
+			naxes[0] = encoded[n].cols;
+			naxes[1] = encoded[n].rows;
+			long n_px = naxes[0] * naxes[1];
+			int depth = encoded[n].depth();
+			int bitpix = (depth == CV_8U) ? BYTE_IMG : ((depth == CV_64F) ? DOUBLE_IMG : FLOAT_IMG);
+			CCfits::ExtHDU *hdu = outfile.addImage(names[n], bitpix, naxes);
+			hdu->addKey("WEIGHT", weights[n], "Kappa weight the data refers to");
+			if (depth == CV_8U)
+			{
+				std::valarray<unsigned char> data(encoded[n].ptr<unsigned char>(), n_px);
+				hdu->write(1, n_px, data);
+			}
+			else if (depth == CV_64F)
+			{
+				std::valarray<double> data(encoded[n].ptr<double>(), n_px);
+				hdu->write(1, n_px, data);
+			}
+			else
+			{
+				std::valarray<float> data(encoded[n].ptr<float>(), n_px);
+				hdu->write(1, n_px, data);
+			}
+			encoded[n].release();
+		}
+	}
+	catch (CCfits::FitsException &e)
+	{
+		std::cout << "Error writing " << filename << ": " << e.message() << std::endl;
+		return false;
+	}
+	std::cout << "-> Wrote " << encoded.size() << " lens products to " << filename << std::endl;
+	return true;
+}
+#endif
@@ -0,0 +1,74 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "lens.h"
+
+using cv::Mat;
+
+/**
+ * @brief Load a lens convergence map: FITS files (if built with CCfits) are read as CV_64FC1, other 
+ * image formats (PNG, JPG, ...) as grayscale CV_8UC1 (see lensT for their normalization)
+ * @param[in] filename Filename of the convergence map
+ * @param[out] kappa Convergence map
+ * @return Whether the file could be read
+ */
+bool read_kappa(const std::string &filename, Mat &kappa);
+
+/**
+ * @brief Load a source image as BGR: 8-bit (CV_8UC3), or for high dynamic range sources in linear light, 
+ * keeping the depth of 16-bit or floating point images (TIFF, EXR, or FITS as gray) and decoding 8-bit 
+ * images from sRGB (CV_32FC3)
+ * @param[in] filename Filename of the source image
+ * @param[in] hdr Load as high dynamic range source
+ * @param[out] imageRGB Source image
+ * @return Whether the file could be read
+ */
+bool read_source(const std::string &filename, bool hdr, Mat &imageRGB);
+
+#if HAS_CCFITS == TRUE
+/**
+ * @brief Function for importing *.FITS image data into a Mat array
+ * @param[in] filename Filename of FITS-image to import
+ * @param[out] cv_image Mat object for storing FITS image (can be empty, returns type CV64FC1)
+ **/
+void readmap(std::string filename, Mat &cv_image);
+
+/**
+ * @brief Function for exporting the lens products (psi, alpha1, alpha2, shear, cc_map, caustic_map) as 
+ * tile-compressed image extensions of a *.FITS file. The critical curves are computed if not available, 
+ * psi is skipped in lean memory mode.
+ * @param filename Filename of the FITS file to write (overwritten if it exists)
+ * @param lens Lens whose products to export
+ * @param double_precision Write float64 instead of float32 data
+ * @return Whether the file was written (CFITSIO errors are reported on the console)
+ **/
+bool writemaps(std::string filename, lensT &lens, bool double_precision = false);
+
+/**
+ * @brief Class for OpenCV parallelization: Convert lens products into FITS image data (flipped 
+ * vertically and converted to the output depth), one product per loop index
+ */
+class Parallel_fits_encoder : public cv::ParallelLoopBody
+{
+	private:
+		const std::vector<Mat> &products;
+		const std::vector<int> &depths;
+		std::vector<Mat> &encoded;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] products_ Lens products to convert
+		 * @param[in] depths_ Output depth (CV_8U, CV_32F or CV_64F) per product
+		 * @param[out] encoded_ Converted products (needs to have the size of products_)
+		 */
+		Parallel_fits_encoder(const std::vector<Mat> &products_, const std::vector<int> &depths_, 
+				std::vector<Mat> &encoded_);
+
+		virtual void operator()(const cv::Range &range) const;
+};
+#endif
+
+#endif
@@ -1,10 +1,14 @@
 #include <iostream> // std::cout
+#include <chrono> // std::chrono::steady_clock
 #include <array> // std::array
 #include <cmath> // floor
+#include <algorithm> // std::min, std::max
 #include <opencv2/core/core.hpp>
 
 #include "math.h"
 #include "renderer.h"
+#include "analysis.h"
+#include "autotune.h"
 #include "lens.h"
 
 using cv::Mat;
@@ -13,9 +17,12 @@ using std::vector;
 // ---- lensT class members: ----
 
 // Default constructor
-lensT::lensT(Mat &kappa_in, int x, int y) 
-	: w(kappa_in.cols), h(kappa_in.rows)
+lensT::lensT(Mat &kappa_in, int x, int y, bool lean_memory, deflection_formatT format) 
+	: w(kappa_in.cols), h(kappa_in.rows), lean(lean_memory), alpha_format(format)
 {
+	if (lean and alpha_format == DEFLECTION_F64)
+		alpha_format = DEFLECTION_F32;
+
 	// Move lens and thereby set its origin
 	move(x, y);
 
@@ -39,11 +46,8 @@ lensT::lensT(Mat &kappa_in, int x, int y)
 		 * limits of the image on the screen. Feel free to modify these choices.
 		 */
 		kappa = kappa_in.clone();
-		Mat threes = Mat::ones(h, w, CV_64FC1) * 2.5;
 		cv::log(kappa_in, kappa_in);
-		kappa_in += threes;
-		kappa_in *= 70; 
-		kappa_in.convertTo(kappa8u, CV_8U);
+		kappa_in.convertTo(kappa8u, CV_8U, 70., 70. * 2.5);
 	}
 
 	// Compute lensing potential psi from kappa, then differentiate it to get the deflection field
@@ -51,7 +55,11 @@ lensT::lensT(Mat &kappa_in, int x, int y)
 	compute_psi_from_kappa();
 	std::cout << "-> Creating deflection field and shear..." << std::endl;
 	compute_derivatives_from_psi();
-	update_cc_and_caustics(1);
+
+	// In lean mode, the critical curves are computed once they are displayed
+	if (!lean)
+		update_cc_and_caustics(1);
+	report_memory();
 }
 
 // Move lens to a specific pixel position on the sky (requires w,h to be set)
@@ -88,22 +96,177 @@ Mat &lensT::get_kappa()
 	return kappa;
 }
 
+// Get the largest absolute deflection of a component at unit weight (bounds the reach of lensed light)
+double lensT::get_max_deflection(int component)
+{
+	return max_alpha[component - 1];
+}
+
+// Get a deflection field component in its storage format (full resolution, see get_deflection_format)
+const Mat &lensT::get_deflection_storage(int component)
+{
+	return (component == 1) ? alpha1 : alpha2;
+}
+
+// Get the storage format of the deflection field at a level of detail (coarser levels are float)
+deflection_formatT lensT::get_deflection_format(int level)
+{
+	return level > 0 ? DEFLECTION_F32 : alpha_format;
+}
+
+// Get lensing potential (empty in lean memory mode)
+Mat &lensT::get_psi()
+{
+	return psi;
+}
+
 // Get lens convergence map
-Mat &lensT::get_kappa8u()
+Mat &lensT::get_kappa8u(int level)
 {
-	return kappa8u;
+	return (level == 0) ? kappa8u : kappa8u_lod[level];
 }
 
 // Get critical curve map
-Mat &lensT::get_cc() 
+Mat &lensT::get_cc(int level) 
 {
-	return cc_map;
+	return (level == 0) ? cc_map : cc_lod[level];
 }
 
 // Get caustic map
-Mat &lensT::get_caustics()
+Mat &lensT::get_caustics(int level)
+{
+	return (level == 0) ? caustic_map : caustic_lod[level];
+}
+
+// Get the critical curves as traced for the critical curve map (every contour pixel)
+const vector<vector<cv::Point>> &lensT::get_cc_contours()
+{
+	return cc_contours;
+}
+
+// Get the weight the critical curves and caustics were computed for
+double lensT::get_cc_weight()
 {
-	return caustic_map;
+	return cc_weight;
+}
+
+// Get magnification map (colormap indices, see update_magnification_map)
+Mat &lensT::get_magnification(int level)
+{
+	return (level == 0) ? mag_map : mag_lod[level];
+}
+
+// Compute the magnification map for the current weight (if outdated) and its levels of detail
+void lensT::update_magnification_map()
+{
+	if (weight == mag_weight and mag_map.cols == w)
+		return;
+
+	// Shear as in update_cc_and_caustics (re-derived temporarily in lean mode)
+	Mat shear_ = shear;
+	if (shear_.cols == 0)
+		compute_shear(shear_);
+	if (!lean)
+		shear = shear_;
+
+	// detJ from both eigenvalues of the Jacobian (its sign is the image parity)
+	Mat unity = Mat::ones(h, w, kappa.type());
+	Mat tan_eigenval = unity - weight * (kappa + shear_);
+	Mat rad_eigenval = unity - weight * (kappa - shear_);
+	Mat detJ = tan_eigenval.mul(rad_eigenval);
+	shear_.release();
+	detJ.convertTo(detJ, CV_64F);
+
+	// Encode as colormap indices, so that compositing needs one table lookup per pixel
+	if (mag_map.cols != w or mag_map.rows != h)
+		mag_map = Mat::zeros(h, w, CV_8UC1);
+	cv::parallel_for_(cv::Range(0, h), magnification_img_from_detJ(detJ, mag_map));
+	mag_weight = weight;
+
+	// Coarser levels pick the nearest index (averaging indices would mix up the parity halves)
+	mag_lod.assign(n_levels, Mat());
+	for (int l = 1; l < n_levels; ++l)
+		cv::resize(mag_lod[l-1].empty() ? mag_map : mag_lod[l-1], mag_lod[l], kappa8u_lod[l].size(), 0, 0, cv::INTER_NEAREST);
+}
+
+// Build the level-of-detail pyramids of the deflection field, kappa8u and the CC and caustic maps
+void lensT::build_pyramid(int levels)
+{
+	if (levels <= n_levels)
+		return;
+
+	// Start from the coarsest available level (level 0 is represented by the full resolution members)
+	Mat prev[3];
+	if (n_levels == 1)
+	{
+		alpha1_lod.assign(1, Mat());
+		alpha2_lod.assign(1, Mat());
+		kappa8u_lod.assign(1, Mat());
+		get_deflection_field(1, prev[0]);
+		get_deflection_field(2, prev[1]);
+		prev[0].convertTo(prev[0], CV_32F);
+		prev[1].convertTo(prev[1], CV_32F);
+		prev[2] = kappa8u;
+	}
+	else
+	{
+		prev[0] = alpha1_lod.back();
+		prev[1] = alpha2_lod.back();
+		prev[2] = kappa8u_lod.back();
+	}
+
+	// Smooth and downsample each level from the previous one (keeps deflection in level 0 px units)
+	for (int l = n_levels; l < levels; ++l)
+	{
+		Mat next[3];
+		for (int c = 0; c < 3; ++c)
+			cv::pyrDown(prev[c], next[c]);
+		alpha1_lod.push_back(next[0]);
+		alpha2_lod.push_back(next[1]);
+		kappa8u_lod.push_back(next[2]);
+		for (int c = 0; c < 3; ++c)
+			prev[c] = next[c];
+	}
+
+	n_levels = levels;
+	update_cc_pyramid();
+
+	// Extend the levels of the magnification map (if computed), so that every level can be looked up
+	int mag_levels = static_cast<int>(mag_lod.size());
+	mag_lod.resize(n_levels);
+	if (!mag_map.empty())
+		for (int l = std::max(1, mag_levels); l < n_levels; ++l)
+			cv::resize(mag_lod[l-1].empty() ? mag_map : mag_lod[l-1], mag_lod[l], kappa8u_lod[l].size(), 0, 0, cv::INTER_NEAREST);
+}
+
+// Rebuild the coarser levels of the critical curve and caustic maps from the full resolution maps
+void lensT::update_cc_pyramid()
+{
+	cc_lod.assign(n_levels, Mat());
+	caustic_lod.assign(n_levels, Mat());
+	if (cc_map.empty() or caustic_map.empty())
+		return;
+
+	for (int l = 1; l < n_levels; ++l)
+	{
+		max_pool_2x2((l == 1) ? cc_map : cc_lod[l-1], cc_lod[l]);
+		max_pool_2x2((l == 1) ? caustic_map : caustic_lod[l-1], caustic_lod[l]);
+	}
+}
+
+// Get the number of available levels of detail
+int lensT::get_lod_levels()
+{
+	return n_levels;
+}
+
+// Get the level of detail matching a given pixel footprint
+int lensT::lod_for_footprint(double footprint)
+{
+	int level = 0;
+	while (level+1 < n_levels and (2 << level) <= footprint)
+		++level;
+	return level;
 }
 
 // Check if pixel (x,y) lies within the region covered by lens pixel data
@@ -116,8 +279,28 @@ bool lensT::contains(int x, int y)
 void lensT::raytrace_pixel(int x1, int x2, int rel1_safe, int rel2_safe, double scale_fac, double &y1, double &y2)
 {
 	// Solve the lens equation under the given constraints
-	y1 = x1 - alpha1.at<double>(rel2_safe, rel1_safe) * scale_fac * weight;
-	y2 = x2 - alpha2.at<double>(rel2_safe, rel1_safe) * scale_fac * weight;
+	double a1, a2;
+	get_deflection(rel1_safe, rel2_safe, a1, a2);
+	y1 = x1 - a1 * scale_fac * weight;
+	y2 = x2 - a2 * scale_fac * weight;
+}
+
+// Get the (unweighted) deflection angle at a lens pixel
+void lensT::get_deflection(int rel1_safe, int rel2_safe, double &a1, double &a2)
+{
+	get_deflection_lod(0, rel1_safe, rel2_safe, a1, a2);
+}
+
+// Get the (unweighted) deflection angle at a lens pixel from a given level of detail
+void lensT::get_deflection_lod(int level, int rel1_safe, int rel2_safe, double &a1, double &a2)
+{
+	switch (get_deflection_format(level))
+	{
+		case DEFLECTION_F64 : get_deflection_as<DEFLECTION_F64>(level, rel1_safe, rel2_safe, a1, a2); break;
+		case DEFLECTION_F32 : get_deflection_as<DEFLECTION_F32>(level, rel1_safe, rel2_safe, a1, a2); break;
+		case DEFLECTION_F16 : get_deflection_as<DEFLECTION_F16>(level, rel1_safe, rel2_safe, a1, a2); break;
+		case DEFLECTION_I16 : get_deflection_as<DEFLECTION_I16>(level, rel1_safe, rel2_safe, a1, a2); break;
+	}
 }
 
 // Compute lensing potential via convolution in Fourier space (this requires kappa to be initialized)
@@ -133,23 +316,31 @@ void lensT::compute_psi_from_kappa()
 	int orig_h = kappa.rows;
 	int opt_2w = cv::getOptimalDFTSize(2*orig_w);
 	int opt_2h = cv::getOptimalDFTSize(2*orig_h);
-	cv::copyMakeBorder(kappa, kappa, 0, opt_2h-orig_h, 0, opt_2w-orig_w, cv::BORDER_CONSTANT);
+	Mat padded;
+	cv::copyMakeBorder(kappa, padded, 0, opt_2h-orig_h, 0, opt_2w-orig_w, cv::BORDER_CONSTANT);
 	
 	// Create the Green's function kernel G
 	Mat G = Mat::zeros(opt_2h, opt_2w, CV_64FC1); 
 	Mat G_hat, kappa_hat, product;
 	fill_green_fct(G);
 
-	// Apply DFT to G and kappa, multiply and backward transform their results to obtain psi
+	/**
+	 * Apply DFT to G and kappa, multiply and backward transform their results to obtain psi.
+	 * The padded buffers are released as soon as they are no longer needed to limit the peak memory.
+	 */
 	cv::dft(G, G_hat, cv::DFT_REAL_OUTPUT);
-	cv::dft(kappa, kappa_hat, cv::DFT_REAL_OUTPUT);
+	G.release();
+	cv::dft(padded, kappa_hat, cv::DFT_REAL_OUTPUT);
+	padded.release();
 	cv::mulSpectrums(kappa_hat, G_hat, product, 0, false); 
+	kappa_hat.release();
+	G_hat.release();
 	cv::idft(product, psi, cv::DFT_SCALE);
+	product.release();
 
-	// Crop all maps back to the original size of kappa
+	// Crop psi back to the original size of kappa (copy, such that the padded buffer is freed)
 	cv::Rect crop_region(0, 0, orig_w, orig_h);
-	psi = psi(crop_region);
-	kappa = kappa(crop_region);
+	psi = psi(crop_region).clone();
 }
 
 // Compute alpha and shear by applying derivatives to psi (this requires psi to have been defined earlier)
@@ -159,16 +350,159 @@ void lensT::compute_derivatives_from_psi()
 	deriv_x(psi, alpha1);
 	deriv_y(psi, alpha2);
 
+	// Compute shear from the second derivatives (unless it is re-derived on demand), then compress alpha
+	if (!lean)
+		compute_shear(shear);
+	store_deflection();
+	if (!lean)
+		return;
+
+	// Lean mode: release psi and store kappa as float
+	psi.release();
+	kappa.convertTo(kappa, CV_32F);
+}
+
+// Convert the deflection field to the selected storage format and report the conversion error
+void lensT::store_deflection()
+{
+	// Bounds of the deflection used to clip the rendered area
+	max_alpha[0] = cv::norm(alpha1, cv::NORM_INF);
+	max_alpha[1] = cv::norm(alpha2, cv::NORM_INF);
+
+	if (alpha_format == DEFLECTION_F64)
+		return;
+
+	Mat alpha[2] = {alpha1, alpha2};
+	Mat stored[2], scale[2];
+	int tile = 1 << alpha_tile_shift;
+	int n_tiles[2] = {(w + tile - 1) / tile, (h + tile - 1) / tile};
+	for (int c = 0; c < 2; ++c)
+	{
+		switch (alpha_format)
+		{
+			case DEFLECTION_F32 :
+				alpha[c].convertTo(stored[c], CV_32F);
+				break;
+			case DEFLECTION_F16 :
+				stored[c] = Mat(h, w, CV_16UC1);
+				for (int i = 0; i < h; ++i)
+					for (int j = 0; j < w; ++j)
+						stored[c].at<ushort>(i, j) = float_to_half(alpha[c].at<double>(i, j));
+				break;
+			case DEFLECTION_I16 :
+			{
+				// Map the largest absolute value within each tile to 32767
+				stored[c] = Mat(h, w, CV_16SC1);
+				scale[c] = Mat(n_tiles[1], n_tiles[0], CV_32FC1);
+				for (int ti = 0; ti < n_tiles[1]; ++ti)
+					for (int tj = 0; tj < n_tiles[0]; ++tj)
+					{
+						cv::Rect region(tj*tile, ti*tile, std::min(tile, w - tj*tile), std::min(tile, h - ti*tile));
+						double min_val, max_val;
+						cv::minMaxLoc(alpha[c](region), &min_val, &max_val);
+						float s = std::max(std::fabs(min_val), std::fabs(max_val)) / 32767.;
+						scale[c].at<float>(ti, tj) = (s > 0) ? s : 1.f;
+						alpha[c](region).convertTo(stored[c](region), CV_16S, 1. / scale[c].at<float>(ti, tj));
+					}
+				break;
+			}
+			default :
+				break;
+		}
+	}
+
+	// Replace the double precision field
+	alpha1 = stored[0];
+	alpha2 = stored[1];
+	alpha1_scale = scale[0];
+	alpha2_scale = scale[1];
+
+	// Compare to the double precision field
+	double max_err = 0.;
+	for (int c = 0; c < 2; ++c)
+	{
+		Mat decoded;
+		get_deflection_field(c+1, decoded);
+		max_err = std::max(max_err, cv::norm(decoded, alpha[c], cv::NORM_INF));
+	}
+	std::cout << "-> Max. deflection error due to storage format: " << max_err << " px (unit weight)" << std::endl;
+}
+
+// Get a deflection field component in double precision (decoded from the storage format)
+void lensT::get_deflection_field(int component, Mat &result)
+{
+	Mat &alpha = (component == 1) ? alpha1 : alpha2;
+	Mat &scale = (component == 1) ? alpha1_scale : alpha2_scale;
+	switch (alpha_format)
+	{
+		case DEFLECTION_F64 :
+		case DEFLECTION_F32 :
+			alpha.convertTo(result, CV_64F);
+			break;
+		case DEFLECTION_F16 :
+			result = Mat(h, w, CV_64FC1);
+			for (int i = 0; i < h; ++i)
+				for (int j = 0; j < w; ++j)
+					result.at<double>(i, j) = half_to_float(alpha.at<ushort>(i, j));
+			break;
+		case DEFLECTION_I16 :
+			result = Mat(h, w, CV_64FC1);
+			for (int i = 0; i < h; ++i)
+				for (int j = 0; j < w; ++j)
+					result.at<double>(i, j) = alpha.at<short>(i, j) * 
+						scale.at<float>(i >> alpha_tile_shift, j >> alpha_tile_shift);
+			break;
+	}
+}
+
+// Compute the shear magnitude from the derivatives of alpha
+void lensT::compute_shear(Mat &result)
+{
+	// The finite differences operate on double precision
+	Mat a1, a2;
+	get_deflection_field(1, a1);
+	get_deflection_field(2, a2);
+
 	// Compute second derivatives
 	Mat psi_11, psi_22, psi_12;
-	deriv_x(alpha1, psi_11);
-	deriv_y(alpha2, psi_22);
-	deriv_y(alpha1, psi_12);
+	deriv_x(a1, psi_11);
+	deriv_y(a2, psi_22);
+	deriv_y(a1, psi_12);
 
 	// Compute shear from combination of these derivatives
 	Mat diff = psi_11 - psi_22;
-	shear = 0.25 * diff.mul(diff) + psi_12.mul(psi_12);
-	cv::sqrt(shear, shear);
+	result = 0.25 * diff.mul(diff) + psi_12.mul(psi_12);
+	cv::sqrt(result, result);
+	result.convertTo(result, kappa.depth());
+}
+
+// Print the memory occupied by each of the lens products
+void lensT::report_memory()
+{
+	const char *names[] = {"kappa", "kappa8u", "psi", "alpha1", "alpha2", "alpha scales", "shear", "cc_map", "caustic_map"};
+	Mat alpha_scales = alpha1_scale.total() ? alpha1_scale : Mat();
+	Mat *products[] = {&kappa, &kappa8u, &psi, &alpha1, &alpha2, &alpha_scales, &shear, &cc_map, &caustic_map};
+	size_t total = 0;
+
+	std::cout << "-> Lens memory" << (lean ? " (lean mode):" : ":") << std::endl;
+	for (size_t n = 0; n < sizeof(products)/sizeof(products[0]); ++n)
+	{
+		size_t bytes = products[n]->total() * products[n]->elemSize();
+		total += bytes;
+		std::cout << "   " << names[n] << ": " << bytes / (1024.*1024.) << " MB" << std::endl;
+	}
+	// Levels of detail (if any)
+	size_t lod_bytes = 0;
+	for (int l = 1; l < n_levels; ++l)
+	{
+		Mat *levels[] = {&alpha1_lod[l], &alpha2_lod[l], &kappa8u_lod[l], &cc_lod[l], &caustic_lod[l]};
+		for (Mat *m : levels)
+			lod_bytes += m->total() * m->elemSize();
+	}
+	if (n_levels > 1)
+		std::cout << "   " << n_levels-1 << " coarser levels of detail: " << lod_bytes / (1024.*1024.) << " MB" << std::endl;
+	total += lod_bytes;
+	std::cout << "   total: " << total / (1024.*1024.) << " MB" << std::endl;
 }
 
 
@@ -176,38 +510,43 @@ void lensT::compute_derivatives_from_psi()
 void lensT::update_cc_and_caustics(bool include_radial_lines)
 {
 	/** 
-	 * Compute derivatives if this wasn't done before (need to do this
-	 * only once, then re-scale the quantities by the currently applied weight)
+	 * Compute the shear if this wasn't done before (need to do this only once, then re-scale the 
+	 * quantities by the currently applied weight). In lean mode, it is re-derived temporarily.
 	 */
-	if (shear.cols == 0)
-		compute_derivatives_from_psi();
+	Mat shear_ = shear;
+	if (shear_.cols == 0)
+		compute_shear(shear_);
+	if (!lean)
+		shear = shear_;
 
 	// Define auxiliary map representing the unit matrix
 	int width = kappa.cols;
 	int height = kappa.rows;
-	Mat unity = Mat::ones(height, width, CV_64FC1);
+	Mat unity = Mat::ones(height, width, kappa.type());
 
 	/**
 	 * Compute eigenvalues of the Jacobian matrix and obtain Jacobian determinant 
 	 * (or tangential eigenvalue) map "detJ" from the eigenvalues.
 	 */
-	Mat tan_eigenval = unity - weight * (kappa + shear);
-	Mat rad_eigenval = unity - weight * (kappa - shear);
+	Mat tan_eigenval = unity - weight * (kappa + shear_);
+	Mat rad_eigenval = unity - weight * (kappa - shear_);
 	Mat detJ = (include_radial_lines) ? tan_eigenval.mul(rad_eigenval) : tan_eigenval;
+	shear_.release();
 
 	// Apply smoothing kernel to remove numerical pixel artifacts in the contours
 	cv::GaussianBlur(detJ, detJ, cv::Size(0,0), 4);
+	detJ.convertTo(detJ, CV_64F);
 
 	// Initialize cc_map if it wasn't done yet, then fill with binary data of regions with detJ < 0
 	if (cc_map.cols != width and cc_map.rows != height)
 		cc_map = Mat::zeros(height, width, CV_8UC1);
-	cv::parallel_for_(cv::Range(0, height), binary_img_from_sign(detJ, cc_map));
+	cv::parallel_for_(cv::Range(0, height), binary_img_from_sign(detJ, cc_map), cc_stripes(height));
 
 	// Auxiliary quantities for contour drawing
 	vector<vector<cv::Point>> contours;
 	vector<cv::Vec4i> hierarchy;
 	int mode = cv::RETR_LIST;
-	int method = cv::CHAIN_APPROX_SIMPLE;
+	int method = cv::CHAIN_APPROX_NONE; // Every pixel, since the caustics are mapped point by point
 	cv::Scalar white(255);
 	int thickness = 1;
 	int linestyle = 16; // Anti-aliased mode
@@ -217,11 +556,41 @@ void lensT::update_cc_and_caustics(bool include_radial_lines)
 	cc_map = Mat::zeros(height, width, CV_8UC1);
 	for (unsigned i = 0; i < contours.size(); ++i)
 		drawContours(cc_map, contours, i, white, thickness, linestyle);
+	cc_contours.swap(contours);
+	cc_weight = weight;
 
 	// As a second step, derive also the caustic lines by inversion of the CC map
 	caustic_map = Mat::zeros(h, w, CV_8UC1);	
-	cv::parallel_for_(cv::Range(0, h), invert_cc_map(this));
+	cv::parallel_for_(cv::Range(0, h), invert_cc_map(this), cc_stripes(h));
 
+	// Keep the coarser levels of detail in sync
+	if (n_levels > 1)
+		update_cc_pyramid();
+
+}
+
+// Compute Einstein radius and caustic cross-section for a list of weights
+void lensT::compute_cross_sections(const vector<double> &weights, vector<lens_statsT> &stats)
+{
+	Mat shear_ = shear;
+	if (shear_.cols == 0)
+		compute_shear(shear_);
+
+	/**
+	 * Apply the same smoothing as in update_cc_and_caustics. Since the Gaussian blur is linear, 
+	 * blurring 1 - weight * (kappa +- shear) equals 1 - weight * blur(kappa +- shear), so the 
+	 * smoothed fields only need to be computed once for all weights.
+	 */
+	Mat kappa_plus_shear, kappa_minus_shear;
+	cv::GaussianBlur(kappa + shear_, kappa_plus_shear, cv::Size(0,0), 4);
+	cv::GaussianBlur(kappa - shear_, kappa_minus_shear, cv::Size(0,0), 4);
+	shear_.release();
+	kappa_plus_shear.convertTo(kappa_plus_shear, CV_64F);
+	kappa_minus_shear.convertTo(kappa_minus_shear, CV_64F);
+
+	stats.assign(weights.size(), lens_statsT());
+	cv::parallel_for_(cv::Range(0, weights.size()), 
+			Parallel_cross_section(this, kappa_plus_shear, kappa_minus_shear, weights, stats));
 }
 
 
@@ -230,15 +599,135 @@ void lensT::update_cc_and_caustics(bool include_radial_lines)
 // Create source object
 sourceT::sourceT(Mat &imageRGB_, int x_pos, int y_pos) : imageRGB(imageRGB_)
 {
-	// Split RGB img into single channels, keep copy of original img in imageRGB, get w and h
-	split(imageRGB, channels);
 	w = imageRGB.cols;
 	h = imageRGB.rows;
 
+	// High dynamic range images are kept in linear light (16-bit integers are normalized to [0,1])
+	hdr = imageRGB.depth() != CV_8U;
+	if (hdr)
+	{
+		double norm = (imageRGB.depth() == CV_16U) ? 1./65535. : 1.;
+		imageRGB.convertTo(imageRGB, CV_32F, norm);
+		linear = imageRGB;
+		set_tone_mapping(tone_map, -1., false);
+	}
+	else
+	{
+		// Split RGB img into single channels, keep copy of original img in imageRGB
+		split(imageRGB, channels);
+	}
+
 	// Place source center at given pos. This will define its origin
 	move(x_pos, y_pos);
 }
 
+// Select the tone mapping of a high dynamic range source
+void sourceT::set_tone_mapping(tone_mapT op, double exposure_, bool half_storage)
+{
+	if (!hdr)
+		return;
+	tone_map = op;
+	build_srgb_encode_lut(encode_lut);
+
+	// Switch the storage of the original image (the resized version follows on the next resize)
+	bool is_half = imageRGB.depth() == CV_16U;
+	if (half_storage != is_half)
+	{
+		Mat converted;
+		if (half_storage)
+			encode_half(imageRGB, converted);
+		else
+			decode_half(imageRGB, converted);
+		imageRGB = converted;
+		resize_area(static_cast<double>(w) / imageRGB.cols);
+	}
+
+	// Default exposure: map the log-average luminance to middle gray
+	if (exposure_ <= 0.)
+	{
+		Mat rgb = imageRGB, luminance;
+		if (half_storage)
+			decode_half(imageRGB, rgb);
+		cv::cvtColor(rgb, luminance, cv::COLOR_BGR2GRAY);
+		cv::max(luminance, 1e-6, luminance);
+		cv::log(luminance, luminance);
+		exposure_ = 0.18 / exp(cv::mean(luminance)[0]);
+	}
+	exposure = static_cast<float>(exposure_);
+
+	std::cout << "-> HDR source (" << (half_storage ? "half" : "float") << " storage, " << tone_map_names[tone_map] 
+		<< ", exposure " << exposure << ")" << std::endl;
+}
+
+// Measure the cost of the tone mapping stage per output pixel
+double sourceT::measure_tone_mapping()
+{
+	if (!hdr)
+		return 0.;
+	const int n_samples = 1 << 20;
+	volatile unsigned sink = 0; // Keeps the loop from being optimized away
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int n = 0; n < n_samples; ++n)
+	{
+		float v = static_cast<float>(n) / n_samples / exposure;
+		sink = sink + tone_map_pixel(cv::Vec3f(v, 0.5f*v, 2.f*v))[0];
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() / n_samples * 1e9;
+}
+
+// Tone map and sRGB-encode a linear light value
+cv::Vec3b sourceT::tone_map_pixel(const cv::Vec3f &bgr)
+{
+	cv::Vec3b val_to_show;
+	for (int c = 0; c < 3; ++c)
+	{
+		float x = exposure * bgr[c];
+		if (!(x > 0)) x = 0; // Negative values and NaN
+		float t = (tone_map == TONE_REINHARD) ? x / (1.f + x) : x;
+		if (!(t < 1.f)) t = 1.f; // Overflow and inf/inf
+		int index = static_cast<int>(t * (srgb_lut_size - 1) + 0.5f);
+		val_to_show[c] = encode_lut[std::min(std::max(index, 0), srgb_lut_size - 1)];
+	}
+	return val_to_show;
+}
+
+// Create source object decoded in tiles on demand
+sourceT::sourceT(tile_cacheT *tiles_, int x_pos, int y_pos) : tiles(tiles_)
+{
+	w = tiles->get_width();
+	h = tiles->get_height();
+	move(x_pos, y_pos);
+}
+
+// Unpin the tiles of a tiled source
+sourceT::~sourceT()
+{
+	release_area();
+}
+
+// Make the source pixels available that can be sampled within a rectangle on the screen
+void sourceT::prepare_area(double x_min, double y_min, double x_max, double y_max, bool prefetch_only)
+{
+	if (!tiles)
+		return;
+
+	// Convert to pixels of the full resolution image (one extra pixel for the interpolation)
+	double bounds[4] = {(x_min - origin[0]) / tile_scale, (y_min - origin[1]) / tile_scale, 
+		(x_max - origin[0]) / tile_scale + 1., (y_max - origin[1]) / tile_scale + 1.};
+	if (prefetch_only)
+		tiles->prefetch(tile_level, bounds[0], bounds[1], bounds[2], bounds[3]);
+	else
+		tile_level = tiles->prepare(this, tile_lod, bounds[0], bounds[1], bounds[2], bounds[3]);
+}
+
+// Allow the tiles made available by prepare_area to be evicted
+void sourceT::release_area()
+{
+	if (tiles)
+		tiles->release(this);
+}
+
 // Move source center to a specific pixel position on the screen
 void sourceT::move (int x_pos, int y_pos)
 {
@@ -286,12 +775,39 @@ void sourceT::resize_area (double factor)
 	// Remember current position of source center and size
 	int orig_xpos = origin[0] + w/2;
 	int orig_ypos = origin[1] + h/2;
+
+	// Tiled sources are resampled on the fly
+	if (tiles)
+	{
+		// Level of detail whose pixels do not exceed the screen pixels (sampled without aliasing)
+		tile_scale = factor;
+		tile_lod = 0;
+		while (tile_lod + 1 < tiles->get_levels() and (2 << tile_lod) <= 1. / factor)
+			++tile_lod;
+		tile_level = tile_lod;
+		w = tiles->get_width() * factor;
+		h = tiles->get_height() * factor;
+		move(orig_xpos, orig_ypos);
+		return;
+	}
+
 	w = imageRGB.cols * factor;
 	h = imageRGB.rows * factor;
 
-	// Resize the image
+	// Resize the image (high dynamic range sources in linear light, half floats via float)
 	Mat rescaled;
-	if (w > 0 and h > 0)
+	if (w > 0 and h > 0 and hdr)
+	{
+		bool half_storage = imageRGB.depth() == CV_16U;
+		Mat full = imageRGB;
+		if (half_storage)
+			decode_half(imageRGB, full);
+		cv::resize(full, rescaled, cv::Size(), factor, factor);
+		if (half_storage)
+			encode_half(rescaled, rescaled);
+		linear = rescaled;
+	}
+	else if (w > 0 and h > 0)
 	{
 		cv::resize(imageRGB, rescaled, cv::Size(), factor, factor);
 		cv::split(rescaled, channels);
@@ -301,56 +817,67 @@ void sourceT::resize_area (double factor)
 	move(orig_xpos, orig_ypos);
 }
 
-// Check if coordinate lies within area covered by source pixel data
-bool sourceT::contains(double x_, double y_)
+// Get linearly interpolated pixel of a tiled source
+cv::Vec3b sourceT::get_tiled_pixel(double x_, double y_)
 {
-	int x = static_cast<int>(x_);
-	int y = static_cast<int>(y_+0.5);
-	return origin[0] < x and x < end_points[0] and origin[1] < y and y < end_points[1];
+	// Position within the level of detail (its pixel k is centered on full resolution pixel (k+0.5)*f-0.5)
+	double f = 1 << tile_level;
+	double u = (x_ + 0.5) / f - 0.5;
+	double v = (y_ + 0.5) / f - 0.5;
+	int tw = tiles->get_width(tile_level);
+	int th = tiles->get_height(tile_level);
+	double fl1 = floor(u);
+	double fl2 = floor(v);
+	unsigned low1 = relocate(fl1, tw);
+	unsigned low2 = relocate(fl2, th);
+	unsigned up1 = relocate(fl1+1., tw);
+	unsigned up2 = relocate(fl2+1., th);
+	double x = u - fl1;
+	double y = v - fl2;
+	double xy = x*y;
+
+	// Same interpolation as for the channels of an untiled source
+	cv::Vec3b I00 = tiles->pixel(tile_level, low1, low2);
+	cv::Vec3b I01 = tiles->pixel(tile_level, up1, low2);
+	cv::Vec3b I10 = tiles->pixel(tile_level, low1, up2);
+	cv::Vec3b I11 = tiles->pixel(tile_level, up1, up2);
+	cv::Vec3b val_to_show;
+	for (size_t c = 0; c < 3; ++c)
+		val_to_show[c] = I00[c]*(1.-x-y+xy) + I01[c]*(x-xy) + I10[c]*(y-xy) + I11[c]*xy;
+	return val_to_show;
 }
 
-/**
- * Return source pixel at the given coordinate, using linear interpolation between neighboring 
- * pixels to obtain the contributions at a particular coordinate (which in general will lie 
- * between different pixels).
- */
-cv::Vec3b sourceT::get_linear_interpolated_pixel(double beta1, double beta2)
+// Get pixel of a high dynamic range source, interpolated in linear light and tone mapped
+cv::Vec3b sourceT::get_hdr_pixel(double rel_beta1, double rel_beta2)
 {
-	// If beta is outside the area covered by source img, display zero...
-	cv::Vec3b val_to_show(0, 0, 0);
-	if (!contains(beta1, beta2))
-		return val_to_show;
-
-	// Abbreviations
-	double rel_beta1 = beta1 - origin[0];
-	double rel_beta2 = beta2 - origin[1];
 	double fl1 = floor(rel_beta1);
 	double fl2 = floor(rel_beta2);
 	unsigned low1 = relocate(fl1, w);
 	unsigned low2 = relocate(fl2, h);
 	unsigned up1 = relocate(fl1+1., w);
 	unsigned up2 = relocate(fl2+1., h);
-	double x = rel_beta1 - fl1;
-	double y = rel_beta2 - fl2;
-	double xy = x*y;
-
-	// Define coefficient matrix for linear interpolation
-	double c00 = 1.-x-y+xy;
-	double c01 = x-xy;
-	double c10 = y-xy;
-	double c11 = xy;
-
-	// Perform linear interpolated raytracing for each channel R,G,B
-	for (size_t c = 0; c < 3; ++c)
-	{
-		unsigned I00 = channels[c].at<uchar>(low2, low1);
-		unsigned I01 = channels[c].at<uchar>(low2, up1);
-		unsigned I10 = channels[c].at<uchar>(up2, low1);
-		unsigned I11 = channels[c].at<uchar>(up2, up1);
-		val_to_show[c] = I00*c00 + I01*c01 + I10*c10 + I11*c11;
-	}
-
-	return val_to_show;
+	float x = static_cast<float>(rel_beta1 - fl1);
+	float y = static_cast<float>(rel_beta2 - fl2);
+	float xy = x*y;
+	float coeffs[4] = {1.f-x-y+xy, x-xy, y-xy, xy};
+	unsigned taps[4][2] = {{low2, low1}, {low2, up1}, {up2, low1}, {up2, up1}};
+
+	cv::Vec3f sum(0.f, 0.f, 0.f);
+	if (linear.depth() == CV_16U)
+		for (int n = 0; n < 4; ++n)
+		{
+			const cv::Vec3w &tap = linear.at<cv::Vec3w>(taps[n][0], taps[n][1]);
+			for (int c = 0; c < 3; ++c)
+				sum[c] += coeffs[n] * half_to_float(tap[c]);
+		}
+	else
+		for (int n = 0; n < 4; ++n)
+		{
+			const cv::Vec3f &tap = linear.at<cv::Vec3f>(taps[n][0], taps[n][1]);
+			for (int c = 0; c < 3; ++c)
+				sum[c] += coeffs[n] * tap[c];
+		}
+
+	// The tone mapping is applied once to the interpolated value
+	return tone_map_pixel(sum);
 }
-
-
@@ -1,10 +1,32 @@
 #ifndef LENS_H
 #define LENS_H
 
+#include <vector>
+#include <cmath>	// std::floor
+#include <algorithm>	// std::min, std::max
 #include <opencv2/core/core.hpp>
+#include "tile_cache.h"
+#include "colormap.h"
+#include "math.h"
 
 using cv::Mat;
 
+/**
+ * @brief Storage formats for the deflection field (the int16 format uses a scale per tile)
+ */
+enum deflection_formatT { DEFLECTION_F64, DEFLECTION_F32, DEFLECTION_F16, DEFLECTION_I16 };
+
+/**
+ * @brief Strong lensing properties of a lens at a given weight (all lengths and areas in pixels)
+ */
+struct lens_statsT
+{
+	double weight = 0.;		// Weight factor applied to the convergence
+	double cc_area = 0.;		// Area enclosed by the tangential critical curves
+	double einstein_radius = 0.;	// Effective Einstein radius sqrt(cc_area/pi)
+	double caustic_area = 0.;	// Cross-section for multiple imaging in the source plane
+};
+
 /**
  * @brief Class implementing a gravitational lens, its physical properties and its screen geometry.
  */
@@ -17,16 +39,38 @@ class lensT
 		const int w;
 		const int h;
 
+		// Keep only the products needed for rendering (see constructor)
+		const bool lean;
+
+		// Storage format of alpha1/alpha2 and tile size (2^alpha_tile_shift px) of the int16 scales
+		deflection_formatT alpha_format;
+		static const int alpha_tile_shift = 6;
+		Mat alpha1_scale, alpha2_scale;
+		double max_alpha[2] = {0., 0.};	// Largest absolute deflection per component (unit weight)
+
 		// Meshgrids
-		Mat psi;	// Lensing potential
+		Mat psi;	// Lensing potential (released in lean mode)
 		Mat alpha1;	// Deflection angle field component in x direction
 		Mat alpha2;	// Deflection angle field component in y direction
 		Mat kappa, kappa8u; 	// Convergence
-		Mat shear;	// Shear magnitude
+		Mat shear;	// Shear magnitude (not stored in lean mode)
 		Mat cc_map;	// Critical curve contour map
 		Mat caustic_map;	// Caustic map
+		std::vector<std::vector<cv::Point>> cc_contours;	// Critical curves as traced for cc_map
+		double cc_weight = -1.;	// Weight the critical curves were computed for
+		Mat mag_map;	// Magnification colormap indices (see colormap.h)
+		double mag_weight = -1.;	// Weight the magnification map was computed for
+
+		/**
+		 * Level-of-detail pyramids (index 0 refers to the full resolution maps above, level n has 
+		 * half the resolution of level n-1). The deflection levels are stored as float in units 
+		 * of full resolution pixels.
+		 */
+		int n_levels = 1;
+		std::vector<Mat> alpha1_lod, alpha2_lod, kappa8u_lod, cc_lod, caustic_lod, mag_lod;
 
 		friend class invert_cc_map;
+		friend class Parallel_cross_section;
 
 	public:
 		// User defined weight factor to re-scale convergence
@@ -34,12 +78,17 @@ class lensT
 
 		/** 
 		 * Constructor
+		 * @details In lean memory mode, psi is released after differentiation, kappa and alpha are 
+		 * stored as float, the shear is re-derived from alpha when needed and the critical curves 
+		 * are only computed once they are requested.
 		 *
 		 * @param kappa_in Input convergence map (CV_64FC1)
 		 * @param x Lens center x-position
 		 * @param y Lens center y-position
+		 * @param lean_memory Keep only the render-critical lens products in memory
+		 * @param format Storage format of the deflection field (in lean mode, at most DEFLECTION_F32)
 		 */
-		lensT(Mat &kappa_in, int x, int y);
+		lensT(Mat &kappa_in, int x, int y, bool lean_memory = false, deflection_formatT format = DEFLECTION_F64);
 
 		/**
 		 * Move lens to a specific pixel position, update origin (requires w,h to be set!)
@@ -69,27 +118,102 @@ class lensT
 
 		/**
 		 * Get lens convergence map
-		 * @return Convergence map in CV_64FC1 (double) format
+		 * @return Convergence map in CV_64FC1 (double) format (CV_32FC1 in lean memory mode)
 		 */
 		Mat &get_kappa();
 
+		/**
+		 * Get the largest absolute (unweighted) deflection of a component. Since the deflection 
+		 * falls off outside the lens area, no ray is deflected further than this times the weight.
+		 * @param component 1: x direction, 2: y direction
+		 * @return Largest absolute deflection in pixels
+		 */
+		double get_max_deflection(int component);
+
+		/**
+		 * Get the stored deflection field component without decoding it (the int16 format can only
+		 * be interpreted with the tile scales, see get_deflection_field)
+		 * @param component 1: x direction, 2: y direction
+		 * @return Deflection field component in the storage format (CV_64FC1, CV_32FC1, CV_16UC1 
+		 * holding IEEE half floats or CV_16SC1)
+		 */
+		const Mat &get_deflection_storage(int component);
+
+		/**
+		 * Get the storage format of the deflection field
+		 * @param level Level of detail (the coarser levels are always stored as float)
+		 * @return Storage format
+		 */
+		deflection_formatT get_deflection_format(int level = 0);
+
+		/**
+		 * Get lensing potential
+		 * @return Lensing potential in CV_64FC1 (double) format (empty in lean memory mode)
+		 */
+		Mat &get_psi();
+
 		/**
 		 * Get lens convergence map
+		 * @param level Level of detail (0: full resolution)
 		 * @return Convergence map in CV_8UC1 (uchar) format
 		 */
-		Mat &get_kappa8u();
+		Mat &get_kappa8u(int level = 0);
 		
 		/**
 		 * Get critical curve map
+		 * @param level Level of detail (0: full resolution)
 		 * @return Critical curve contour map in CV_8UC1 (uchar) format
 		 */
-		Mat &get_cc();
+		Mat &get_cc(int level = 0);
 
 		/**
 		 * Get caustic map
+		 * @param level Level of detail (0: full resolution)
 		 * @return Caustic contour map in CV_8UC1 (uchar) format
 		 */
-		Mat &get_caustics();
+		Mat &get_caustics(int level = 0);
+
+		/**
+		 * Get the critical curves as polylines (closed contours in lens pixel coordinates, one point 
+		 * per contour pixel), as traced by the last call of update_cc_and_caustics
+		 * @return Contours
+		 */
+		const std::vector<std::vector<cv::Point>> &get_cc_contours();
+
+		/**
+		 * Get the weight the critical curves and caustics were computed for
+		 * @return Weight (negative if they have not been computed yet)
+		 */
+		double get_cc_weight();
+
+		/**
+		 * Get magnification map (call update_magnification_map first)
+		 * @param level Level of detail (0: full resolution)
+		 * @return Magnification colormap indices in CV_8UC1 (uchar) format
+		 */
+		Mat &get_magnification(int level = 0);
+
+		/**
+		 * Build the level-of-detail pyramids of the deflection field and kappa8u (and of the 
+		 * critical curve and caustic maps, which are then also rebuilt by update_cc_and_caustics). An 
+		 * already computed magnification map gets the new levels as well.
+		 *
+		 * @param levels Number of levels including the full resolution (does nothing if already available)
+		 */
+		void build_pyramid(int levels);
+
+		/**
+		 * Get the number of available levels of detail
+		 * @return Number of levels (1: only full resolution)
+		 */
+		int get_lod_levels();
+
+		/**
+		 * Get the level of detail matching a given pixel footprint
+		 * @param footprint Number of lens pixels covered by one output pixel (in 1D)
+		 * @return The coarsest level whose pixels do not exceed the footprint (among available levels)
+		 */
+		int lod_for_footprint(double footprint);
 		
 		/**
 		 * Check if pixel (x,y) lies within the region covered by lens pixel data
@@ -114,6 +238,42 @@ class lensT
 		 */
 		void raytrace_pixel(int x1, int x2, int rel1_safe, int rel2_safe, double scale_fac, double &y1, double &y2);
 
+		/**
+		 * Get the (unweighted) deflection angle at a lens pixel
+		 *
+		 * @param[in] rel1_safe Lens plane x coord rel to lens origin (has to be within range)
+		 * @param[in] rel2_safe Lens plane y coord rel to lens origin (has to be within range)
+		 * @param[out] a1 Deflection angle component in x direction
+		 * @param[out] a2 Deflection angle component in y direction
+		 */
+		void get_deflection(int rel1_safe, int rel2_safe, double &a1, double &a2);
+
+		/**
+		 * Get the (unweighted) deflection angle at a lens pixel from a given level of detail
+		 *
+		 * @param[in] level Level of detail (has to be available)
+		 * @param[in] rel1_safe Full resolution lens plane x coord rel to lens origin (has to be within range)
+		 * @param[in] rel2_safe Full resolution lens plane y coord rel to lens origin (has to be within range)
+		 * @param[out] a1 Deflection angle component in x direction
+		 * @param[out] a2 Deflection angle component in y direction
+		 */
+		void get_deflection_lod(int level, int rel1_safe, int rel2_safe, double &a1, double &a2);
+
+		/**
+		 * Get the (unweighted) deflection angle at a lens pixel, decoded from a storage format fixed at
+		 * compile time. The render loops pick the format once per render (see get_deflection_format) and
+		 * inline the decoder, rather than switching over the format per pixel.
+		 *
+		 * @tparam format Storage format of the level of detail
+		 * @param[in] level Level of detail (has to be available)
+		 * @param[in] rel1_safe Full resolution lens plane x coord rel to lens origin (has to be within range)
+		 * @param[in] rel2_safe Full resolution lens plane y coord rel to lens origin (has to be within range)
+		 * @param[out] a1 Deflection angle component in x direction
+		 * @param[out] a2 Deflection angle component in y direction
+		 */
+		template <deflection_formatT format>
+		void get_deflection_as(int level, int rel1_safe, int rel2_safe, double &a1, double &a2) const;
+
 		/**
 		 * Compute lensing potential psi from convergence via superposition with Green's fct
 		 * (this requires that kappa has been defined)
@@ -126,12 +286,89 @@ class lensT
 		 */
 		void compute_derivatives_from_psi();
 
+		/**
+		 * Convert the deflection field (computed in double precision) to the selected storage format 
+		 * and report the maximum error introduced by the conversion
+		 */
+		void store_deflection();
+
+		/**
+		 * Get a deflection field component in double precision (decoded from the storage format)
+		 * @param[in] component Component (1: x direction, 2: y direction)
+		 * @param[out] result Deflection field component (CV_64FC1)
+		 */
+		void get_deflection_field(int component, Mat &result);
+
+		/**
+		 * Compute the shear magnitude from the second derivatives of psi, i.e. the derivatives of alpha
+		 * @param[out] result Shear magnitude (same depth as kappa)
+		 */
+		void compute_shear(Mat &result);
+
+		/**
+		 * Print the memory occupied by each of the lens products
+		 */
+		void report_memory();
+
+		/**
+		 * Rebuild the coarser levels of the critical curve and caustic maps from the full resolution maps
+		 */
+		void update_cc_pyramid();
 		/**
 		 * (Re)-compute critical lines and caustics via the Jacobian from pre-computed kappa and shear
 		 */
 		void update_cc_and_caustics(bool include_radial_lines);
+
+		/**
+		 * (Re)-compute the magnification map |mu| = 1/|detJ| with parity sign for the current weight, 
+		 * encoded as 8-bit colormap indices. Does nothing if the map is up to date for this weight.
+		 */
+		void update_magnification_map();
+
+		/**
+		 * Compute Einstein radius and caustic cross-section for a list of weights. The smoothed 
+		 * kappa+shear and kappa-shear fields are computed once; the weights are then evaluated in 
+		 * parallel without modifying the current weight, cc_map or caustic_map.
+		 *
+		 * @param[in] weights Weight factors to evaluate
+		 * @param[out] stats Strong lensing properties for each weight
+		 */
+		void compute_cross_sections(const std::vector<double> &weights, std::vector<lens_statsT> &stats);
 };
 
+template <deflection_formatT format>
+inline void lensT::get_deflection_as(int level, int rel1_safe, int rel2_safe, double &a1, double &a2) const
+{
+	switch (format)
+	{
+		case DEFLECTION_F64 :
+			a1 = alpha1.ptr<double>(rel2_safe)[rel1_safe];
+			a2 = alpha2.ptr<double>(rel2_safe)[rel1_safe];
+			break;
+		case DEFLECTION_F32 :
+		{
+			// Full resolution float storage or a coarser level of detail
+			const Mat &lod1 = level ? alpha1_lod[level] : alpha1;
+			const Mat &lod2 = level ? alpha2_lod[level] : alpha2;
+			a1 = lod1.ptr<float>(rel2_safe >> level)[rel1_safe >> level];
+			a2 = lod2.ptr<float>(rel2_safe >> level)[rel1_safe >> level];
+			break;
+		}
+		case DEFLECTION_F16 :
+			a1 = half_to_float(alpha1.ptr<ushort>(rel2_safe)[rel1_safe]);
+			a2 = half_to_float(alpha2.ptr<ushort>(rel2_safe)[rel1_safe]);
+			break;
+		case DEFLECTION_I16 :
+		{
+			int tile_i = rel2_safe >> alpha_tile_shift;
+			int tile_j = rel1_safe >> alpha_tile_shift;
+			a1 = alpha1.ptr<short>(rel2_safe)[rel1_safe] * alpha1_scale.ptr<float>(tile_i)[tile_j];
+			a2 = alpha2.ptr<short>(rel2_safe)[rel1_safe] * alpha2_scale.ptr<float>(tile_i)[tile_j];
+			break;
+		}
+	}
+}
+
 /**
  * @brief Class representing a source and its geometric properties on the screen.
  */
@@ -146,6 +383,26 @@ class sourceT
 
 		// Meshgrids
 		Mat imageRGB, channels[3];
+
+		/**
+		 * High dynamic range sources: imageRGB holds linear light (CV_32FC3, or half floats as CV_16UC3) 
+		 * and "linear" its currently resized version, which is interpolated and then tone mapped once 
+		 * per output pixel: exposure, tone curve and sRGB encoding via table lookup
+		 */
+		bool hdr = false;
+		Mat linear;
+		tone_mapT tone_map = TONE_REINHARD;
+		float exposure = 1.f;
+		unsigned char encode_lut[srgb_lut_size];
+
+		/**
+		 * Tiled backend (if set, replaces imageRGB/channels; sampled at 1/tile_scale per screen px) 
+		 * and its level of detail matching tile_scale and the one made available by prepare_area
+		 */
+		tile_cacheT *tiles = nullptr;
+		double tile_scale = 1.;
+		int tile_lod = 0;
+		int tile_level = 0;
 	public:
 		/**
 		 * Constructor
@@ -156,6 +413,60 @@ class sourceT
 		 */
 		sourceT(Mat &imageRGB_, int x_pos, int y_pos);
 
+		/**
+		 * Select the tone mapping of a high dynamic range source (i.e. one created from a non 8-bit 
+		 * image) and optionally store its linear light as half floats
+		 *
+		 * @param op Tone mapping operator
+		 * @param exposure_ Factor applied before the tone curve (<= 0: map the log-average luminance to 0.18)
+		 * @param half_storage Store the linear light as half floats (halves the memory)
+		 */
+		void set_tone_mapping(tone_mapT op, double exposure_, bool half_storage);
+
+		/**
+		 * Measure the cost of the tone mapping stage (benchmark, e.g. for --autotune)
+		 *
+		 * @return Time per output pixel in ns (0 for 8-bit sources)
+		 */
+		double measure_tone_mapping();
+
+		/**
+		 * Tone map and sRGB-encode a linear light value
+		 *
+		 * @param bgr Linear light (BGR)
+		 * @return Display value (BGR)
+		 */
+		cv::Vec3b tone_map_pixel(const cv::Vec3f &bgr);
+
+		/**
+		 * Constructor for a source decoded in tiles on demand (see tile_cacheT)
+		 *
+		 * @param tiles_ Tile cache of the source image (has to outlive the source)
+		 * @param x_pos Lens center x pixel coordinate
+		 * @param y_pos Lens center y pixel coordinate
+		 */
+		sourceT(tile_cacheT *tiles_, int x_pos, int y_pos);
+
+		/**
+		 * Destructor: Unpin the tiles of a tiled source
+		 */
+		~sourceT();
+
+		/**
+		 * Make the source pixels available that can be sampled within a rectangle on the screen 
+		 * (only has an effect for tiled sources)
+		 *
+		 * @param x_min, y_min, x_max, y_max Screen coordinates of the rectangle (inclusive)
+		 * @param prefetch_only Decode in the background for a later frame instead
+		 */
+		void prepare_area(double x_min, double y_min, double x_max, double y_max, bool prefetch_only = false);
+
+		/**
+		 * Allow the tiles made available by prepare_area to be evicted (once the frames using them 
+		 * are rendered; only has an effect for tiled sources)
+		 */
+		void release_area();
+
 		/**
 		 * Move source center + update origin according to size (requires w,h to be set)
 		 *
@@ -216,6 +527,84 @@ class sourceT
 		 * @return The value at (beta1, beta2) computed from the nearest neighbors (RGB value)
 		 */
 		cv::Vec3b get_linear_interpolated_pixel(double beta1, double beta2);
+
+		/**
+		 * Get pixel of a tiled source (from the prepared level of detail), applying linear 
+		 * interpolation between neighboring pixels
+		 *
+		 * @param x_ X-coordinate in pixels of the full resolution image
+		 * @param y_ Y-coordinate in pixels of the full resolution image
+		 * @return The interpolated value (BGR)
+		 */
+		cv::Vec3b get_tiled_pixel(double x_, double y_);
+
+		/**
+		 * Get pixel of a high dynamic range source, interpolated in linear light and tone mapped
+		 *
+		 * @param rel_beta1 X-coordinate relative to the source origin
+		 * @param rel_beta2 Y-coordinate relative to the source origin
+		 * @return Display value (BGR)
+		 */
+		cv::Vec3b get_hdr_pixel(double rel_beta1, double rel_beta2);
 };
 
+// Check if coordinate lies within area covered by source pixel data
+inline bool sourceT::contains(double x_, double y_)
+{
+	int x = static_cast<int>(x_);
+	int y = static_cast<int>(y_+0.5);
+	return origin[0] < x and x < end_points[0] and origin[1] < y and y < end_points[1];
+}
+
+/**
+ * Return source pixel at the given coordinate, using linear interpolation between neighboring 
+ * pixels to obtain the contributions at a particular coordinate (which in general will lie 
+ * between different pixels). Defined inline, so that the 8-bit path is compiled into the 
+ * instruction set specific clones of the render loops.
+ */
+inline cv::Vec3b sourceT::get_linear_interpolated_pixel(double beta1, double beta2)
+{
+	// If beta is outside the area covered by source img, display zero...
+	cv::Vec3b val_to_show(0, 0, 0);
+	if (!contains(beta1, beta2))
+		return val_to_show;
+
+	// Abbreviations
+	double rel_beta1 = beta1 - origin[0];
+	double rel_beta2 = beta2 - origin[1];
+	if (tiles)
+		return get_tiled_pixel(rel_beta1 / tile_scale, rel_beta2 / tile_scale);
+	if (hdr)
+		return get_hdr_pixel(rel_beta1, rel_beta2);
+	double fl1 = std::floor(rel_beta1);
+	double fl2 = std::floor(rel_beta2);
+	int low1 = std::min(std::max(static_cast<int>(fl1), 0), w-1);
+	int low2 = std::min(std::max(static_cast<int>(fl2), 0), h-1);
+	int up1 = std::min(std::max(static_cast<int>(fl1)+1, 0), w-1);
+	int up2 = std::min(std::max(static_cast<int>(fl2)+1, 0), h-1);
+	double x = rel_beta1 - fl1;
+	double y = rel_beta2 - fl2;
+	double xy = x*y;
+
+	// Define coefficient matrix for linear interpolation
+	double c00 = 1.-x-y+xy;
+	double c01 = x-xy;
+	double c10 = y-xy;
+	double c11 = xy;
+
+	// Perform linear interpolated raytracing for each channel R,G,B
+	for (size_t c = 0; c < 3; ++c)
+	{
+		const uchar *row_low = channels[c].ptr<uchar>(low2);
+		const uchar *row_up = channels[c].ptr<uchar>(up2);
+		unsigned I00 = row_low[low1];
+		unsigned I01 = row_low[up1];
+		unsigned I10 = row_up[low1];
+		unsigned I11 = row_up[up1];
+		val_to_show[c] = I00*c00 + I01*c01 + I10*c10 + I11*c11;
+	}
+
+	return val_to_show;
+}
+
 #endif
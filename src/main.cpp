@@ -12,23 +12,53 @@
 #include <math.h>	// std::floor()
 #include <algorithm>	// std::min()
 #include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <memory>
+#include <cstdlib>	// std::getenv
 
 // OpenCV (Fast image manipulation / matrix calculations + very basic GUI features)
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
-// Libraries needed for handling the FITS file format
-#if HAS_CCFITS == TRUE
-#include <CCfits/CCfits>
-#include <valarray>
-#endif
-
 // Project includes
 #include "math.h" 	// Auxiliary functions
 #include "lens.h" 	// Physical objects
-#include "screen_io.h"	// Screen + file I/O
+#include "screen_io.h"	// Screen
+#include "image_io.h"	// File I/O
 #include "renderer.h"	// Parallel rendering
+#include "batch.h"	// Headless batch modes
+#include "work_queue.h"	// Shared work queue of batch workers
+#include "colormap.h"	// Overlay colormaps
+#include "tile_cache.h"	// Tiled sources
+#include "governor.h"	// Interactive frame rate governor
+#include "cpu_dispatch.h"	// Instruction set of the kernels
+#include "autotune.h"	// Parallelization settings
+
+/**
+ * Split the command line into positional arguments and options of the form "--key=value" 
+ * (or "--key", which is stored with an empty value)
+ */
+void parse_cmdline(int argc, char** argv, std::vector<std::string> &args, std::map<std::string, std::string> &opts)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg.compare(0, 2, "--") != 0)
+		{
+			args.push_back(arg);
+			continue;
+		}
+
+		size_t eq = arg.find('=');
+		if (eq == std::string::npos)
+			opts[arg.substr(2)] = "";
+		else
+			opts[arg.substr(2, eq-2)] = arg.substr(eq+1);
+	}
+}
 
 /** 
  * Main function: Load image and perform all the necessary calculations that can be done beforehand 
@@ -41,39 +71,108 @@ int main(int argc, char** argv)
 
 	// Display program name, check number of cmd line arguments
 	cout << "quicklens v1" << endl;
-	if (argc < 3)
+	std::vector<std::string> args;
+	std::map<std::string, std::string> opts;
+	parse_cmdline(argc, argv, args, opts);
+	if (args.size() < 2)
 	{
-		cout << "Usage: %prog lensfile sourcefile [N_threads (default:all)]" << endl;
+		cout << "Usage: %prog lensfile sourcefile [N_threads (default:all)] [options]" << endl;
+		cout << "Options:" << endl;
+		cout << "  --canvas=WxH     Canvas size (default: overlap of lens and source image)" << endl;
+		cout << "  --lens-pos=X,Y   Lens center on the canvas (default: canvas center)" << endl;
+		cout << "  --source-pos=X,Y Source center on the canvas (default: canvas center)" << endl;
+		cout << "  --tiled-source[=MB]" << endl;
+		cout << "                   Decode the source (binary PPM) in tiles on demand, caching up to MB" << endl;
+		cout << "                   (default: 1024)" << endl;
+		cout << "  --hdr[=half]     Keep the source in linear light (16-bit/float images or FITS), optionally" << endl;
+		cout << "                   as half floats, and tone map the lensed image" << endl;
+		cout << "  --tonemap=reinhard|clip" << endl;
+		cout << "                   Tone curve for --hdr (default: reinhard)" << endl;
+		cout << "  --exposure=E     Exposure for --hdr (default: log-average luminance mapped to 0.18)" << endl;
+		cout << "  --lean           Keep only the render-critical lens products in memory" << endl;
+		cout << "  --deflection=f64|f32|f16|i16" << endl;
+		cout << "                   Storage format of the deflection field (default: f64, lean: f32)" << endl;
+		cout << "  --kappa-colormap=gray|viridis|magma|inferno|plasma" << endl;
+		cout << "                   Colormap of the kappa overlay (default: viridis, key c cycles)" << endl;
+		cout << "  --kappa-opacity=A" << endl;
+		cout << "                   Opacity of the kappa overlay at its highest value (default: 0.6)" << endl;
+		cout << "  --target-fps=F   Lower the quality during interaction to hold F frames per second" << endl;
+		cout << "  --min-scale=S    Lowest render resolution relative to the view (default: 0.25)" << endl;
+		cout << "  --max-supersampling=N" << endl;
+		cout << "                   Highest supersampling factor, used when idle (default: 1)" << endl;
+		cout << "  --max-overlay-interval=K" << endl;
+		cout << "                   Max. frames between overlay updates during interaction (default: 8)" << endl;
+		cout << "  --autotune       Benchmark threads, chunk sizes and kernels for this machine and canvas size" << endl;
+		cout << "                   and store the best settings (used automatically on later runs)" << endl;
+		cout << "  --tuning-cache=FILE" << endl;
+		cout << "                   File of the stored settings (default: ~/.quicklens_tuning)" << endl;
+		cout << "  --no-tuning      Ignore the stored settings" << endl;
+		cout << "  --export-fits=FILE" << endl;
+		cout << "                   Write psi, alpha, shear and the CC/caustic maps to FITS and exit" << endl;
+		cout << "  --fits-f64       Write the FITS export in double instead of single precision" << endl;
+		cout << "  --poster=FILE    Render the canvas in bands into a binary PPM file and exit" << endl;
+		cout << "  --band=ROWS      Rows per band in poster mode (default: 256)" << endl;
+		cout << "  --weight=W       Kappa weight for the FITS export and poster mode (default: 5)" << endl;
+		cout << "  --sweep=FILE     Headless batch sweep over the parameter sets in FILE" << endl;
+		cout << "  --out=PREFIX     Output file prefix for batch modes (default: sweep)" << endl;
+		cout << "  --batch=N        Number of frames rendered at once in sweep mode (default: 16)" << endl;
+		cout << "  --scale=S        Output resolution relative to the screen in sweep mode (0 < S <= 1)" << endl;
+		cout << "  --queue=DIR      Render the sweep as one of several workers sharing the work queue DIR" << endl;
+		cout << "                   (on a filesystem shared by all nodes)" << endl;
+		cout << "  --shard=N        Number of frames per work queue shard (default: 256)" << endl;
+		cout << "  --stale=SECONDS  Take over shards of workers unresponsive for SECONDS (default: 600)" << endl;
+		cout << "  --arcs[=THRESHOLD,MIN_AREA,MIN_RATIO]" << endl;
+		cout << "                   Write an arc catalog per frame in sweep mode (default: 30,20,7.5)" << endl;
+		cout << "  --curves=csv|geojson|svg" << endl;
+		cout << "                   Export critical curves and caustics per weight in sweep mode" << endl;
+		cout << "  --cross-section=W1,W2,..|START:STOP:STEP" << endl;
+		cout << "                   Headless table of Einstein radius and caustic area per weight" << endl;
 		return -1;
 	}
 
 	// Get number of threads from argument list (default: use all threads)
-	if (argc == 4)
+	if (args.size() >= 3)
 	{
 		char *eptr;
-		int N_threads = std::strtol(argv[3], &eptr, 0);
+		int N_threads = std::strtol(args[2].c_str(), &eptr, 0);
 		cv::setNumThreads(N_threads);
 	}
 	cout << "Started with " << cv::getNumThreads() << " threads" << endl;
 
+	// Instruction set of the hot kernels (best supported by the CPU or set by QUICKLENS_ISA)
+	select_isa();
+
 	// Get filename for lens convergence and source image
-	std::string lens_fn = argv[1];
-	std::string fn = argv[2];
+	std::string lens_fn = args[0];
+	std::string fn = args[1];
 
 	// Display settings (feel free to adapt this to your needs)
 	int resize_w = 1024;
 	int resize_h = 768;
+	int view_max_w = 1920;
+	int view_max_h = 1080;
 
 	/**
 	 * Load source image (*.PNG, *.JPG, ...) as RGB color image (note: OpenCV uses "BGR" ordering).
 	 * This yields a Mat object of type CV_8UC3 (3-channel uchar).
 	 */
-	cv::Mat imageRGB = cv::imread(fn, cv::IMREAD_COLOR);
-	if (!imageRGB.data)
+	cv::Mat imageRGB;
+	std::unique_ptr<tile_cacheT> source_tiles;
+	if (opts.count("tiled-source"))
+	{
+		// Huge sources (binary PPM) are decoded in tiles on demand, up to the given memory (MB)
+		double cache_mb = opts["tiled-source"].empty() ? 1024. : std::strtod(opts["tiled-source"].c_str(), nullptr);
+		source_tiles.reset(new tile_cacheT(fn, static_cast<size_t>(cache_mb * 1024. * 1024.)));
+		if (!source_tiles->is_open())
+			return -1;
+	}
+	else if (!read_source(fn, opts.count("hdr") > 0, imageRGB))
 	{
 		cout << "Error opening image file..." << endl;
 		return -1;
 	}
+	int source_w = source_tiles ? source_tiles->get_width() : imageRGB.cols;
+	int source_h = source_tiles ? source_tiles->get_height() : imageRGB.rows;
 	
 	/**
 	 * Load lens convergence distribution (*.FITS, *.PNG, *.JPG, ...) as grayscale,
@@ -82,44 +181,289 @@ int main(int argc, char** argv)
 	 * in order to have an array of floating point numbers.
 	 */
 	cv::Mat kappa_input;
-	int has_fits_input = false;
-	#if HAS_CCFITS == TRUE
-	try
+	if (!read_kappa(lens_fn, kappa_input))
+	{
+		cout << "Error opening the image file..." << endl;
+		return 0;
+	}
+
+	// Storage format of the deflection field
+	deflection_formatT alpha_format = DEFLECTION_F64;
+	if (opts.count("deflection"))
+	{
+		const char *formats[] = {"f64", "f32", "f16", "i16"};
+		int n = 0;
+		while (n < 4 and opts["deflection"] != formats[n])
+			++n;
+		if (n == 4)
+		{
+			cout << "Unknown deflection format " << opts["deflection"] << endl;
+			return -1;
+		}
+		alpha_format = static_cast<deflection_formatT>(n);
+	}
+
+	/**
+	 * Canvas size (default: overlap of lens and source) and the center positions of lens and source 
+	 * on the canvas (default: canvas center)
+	 */
+	int max_w = std::min(kappa_input.cols, source_w);
+	int max_h = std::min(kappa_input.rows, source_h);
+	char sep;
+	if (opts.count("canvas") and !(std::istringstream(opts["canvas"]) >> max_w >> sep >> max_h and sep == 'x' 
+			and max_w > 0 and max_h > 0))
+	{
+		cout << "Canvas size has to be given as WxH" << endl;
+		return -1;
+	}
+	int lens_pos[2] = {max_w/2, max_h/2};
+	int source_pos[2] = {max_w/2, max_h/2};
+	if (opts.count("lens-pos") and !(std::istringstream(opts["lens-pos"]) >> lens_pos[0] >> sep >> lens_pos[1]))
+	{
+		cout << "Lens position has to be given as X,Y" << endl;
+		return -1;
+	}
+	if (opts.count("source-pos") and !(std::istringstream(opts["source-pos"]) >> source_pos[0] >> sep >> source_pos[1]))
+	{
+		cout << "Source position has to be given as X,Y" << endl;
+		return -1;
+	}
+
+	/**
+	 * Parallelization settings of the hot kernels: benchmarked with --autotune and stored per machine 
+	 * and canvas size, then used on later runs (an explicit thread count or QUICKLENS_ISA take precedence)
+	 */
+	if (!opts.count("no-tuning"))
 	{
-		// Try to read as FITS file. If this doesn't succeed, ...
-		readmap(lens_fn, kappa_input);
-		has_fits_input = true;
+		std::string cache_fn = opts.count("tuning-cache") ? opts["tuning-cache"] : default_tuning_cache();
+		std::string key = tuning_key(max_w, max_h);
+		tuningT tuning;
+		if (opts.count("autotune"))
+		{
+			tuning = autotune(max_w, max_h);
+			if (save_tuning(cache_fn, key, tuning))
+				cout << "-> Stored for " << key << " in " << cache_fn << endl;
+			else
+				cout << "Error writing " << cache_fn << endl;
+		}
+		else if (load_tuning(cache_fn, key, tuning))
+		{
+			if (args.size() >= 3)
+				tuning.threads = 0;
+			if (std::getenv("QUICKLENS_ISA"))
+				tuning.isa = N_ISAS;
+			apply_tuning(tuning);
+			tuning.threads = cv::getNumThreads();
+			tuning.isa = active_isa();
+			cout << "-> Tuned settings for this machine and canvas size: " << describe_tuning(tuning) << endl;
+		}
 	}
-	catch (CCfits::FitsException&)
+
+	// Create lens and source objects
+	cout << "Creating lens and source..." << endl;
+	lensT lens(kappa_input, lens_pos[0], lens_pos[1], opts.count("lean") > 0, alpha_format);
+	sourceT source = source_tiles ? sourceT(source_tiles.get(), source_pos[0], source_pos[1]) 
+		: sourceT(imageRGB, source_pos[0], source_pos[1]);
+	if (opts.count("hdr"))
 	{
-		has_fits_input = false;
+		int op = TONE_REINHARD;
+		if (opts.count("tonemap"))
+		{
+			op = 0;
+			while (op < N_TONE_MAPS and opts["tonemap"] != tone_map_names[op])
+				++op;
+			if (op == N_TONE_MAPS)
+			{
+				cout << "Unknown tone mapping " << opts["tonemap"] << endl;
+				return -1;
+			}
+		}
+		double exposure = opts.count("exposure") ? std::strtod(opts["exposure"].c_str(), nullptr) : -1.;
+		source.set_tone_mapping(static_cast<tone_mapT>(op), exposure, opts["hdr"] == "half");
+		if (opts.count("autotune"))
+			cout << "-> Tone mapping takes " << source.measure_tone_mapping() << " ns per pixel" << endl;
 	}
+
+	// Headless export of the lens products
+	if (opts.count("export-fits"))
+	{
+	#if HAS_CCFITS == TRUE
+		lens.weight = opts.count("weight") ? std::strtod(opts["weight"].c_str(), nullptr) : 5.;
+		return writemaps(opts["export-fits"], lens, opts.count("fits-f64") > 0) ? 0 : -1;
+	#else
+		cout << "FITS export requires CCfits (USE_CCFITS = TRUE)" << endl;
+		return -1;
 	#endif
-	if (!has_fits_input) {
-		// ...read as normal PNG, JPG or any other file format supported by OpenCV
-		kappa_input = cv::imread(lens_fn, cv::IMREAD_GRAYSCALE);
-		if (!kappa_input.data)
+	}
+
+	// Headless poster rendering in bands, streamed to disk
+	if (opts.count("poster"))
+	{
+		lens.weight = opts.count("weight") ? std::strtod(opts["weight"].c_str(), nullptr) : 5.;
+		int band_height = opts.count("band") ? static_cast<int>(std::strtol(opts["band"].c_str(), nullptr, 0)) : 256;
+		cout << "Rendering " << max_w << "x" << max_h << " poster..." << endl;
+		return run_poster(lens, source, max_w, max_h, opts["poster"], band_height) ? 0 : -1;
+	}
+
+	// Headless batch sweep: render all parameter sets and exit without opening a window
+	std::string out_prefix = opts.count("out") ? opts["out"] : "sweep";
+	if (opts.count("sweep"))
+	{
+		std::vector<sweep_paramT> params;
+		if (!read_sweep_file(opts["sweep"], params))
+		{
+			cout << "Error reading sweep file " << opts["sweep"] << endl;
+			return -1;
+		}
+		size_t batch_size = opts.count("batch") ? std::strtoul(opts["batch"].c_str(), nullptr, 0) : 16;
+
+		// Optional arc detection settings "threshold,min_area,min_ratio"
+		arc_paramsT arc_settings;
+		if (opts.count("arcs") and !opts["arcs"].empty())
+		{
+			char sep1, sep2;
+			std::istringstream tokens(opts["arcs"]);
+			tokens >> arc_settings.threshold >> sep1 >> arc_settings.min_area >> sep2 >> arc_settings.min_ratio;
+			if (tokens.fail() or !(tokens >> std::ws).eof() or sep1 != ',' or sep2 != ',' or arc_settings.threshold < 0
+					or arc_settings.min_area < 0 or !(arc_settings.min_ratio >= 0.))
+			{
+				cout << "Arc settings have to be given as THRESHOLD,MIN_AREA,MIN_RATIO (non-negative numbers)" << endl;
+				return -1;
+			}
+		}
+
+		// Output resolution relative to the screen
+		double scale = opts.count("scale") ? std::strtod(opts["scale"].c_str(), nullptr) : 1.;
+		if (!(scale > 0. and scale <= 1.))
+		{
+			cout << "Scale has to be within (0, 1]" << endl;
+			return -1;
+		}
+
+		// Optional work queue shared with other worker processes
+		std::unique_ptr<work_queueT> queue;
+		if (opts.count("queue"))
+		{
+			double stale = opts.count("stale") ? std::strtod(opts["stale"].c_str(), nullptr) : 600.;
+			queue.reset(new work_queueT(opts["queue"], stale));
+			if (!queue->is_valid())
+			{
+				cout << "Error opening work queue " << opts["queue"] << endl;
+				return -1;
+			}
+			cout << "Worker " << queue->get_owner() << " of work queue " << opts["queue"] << endl;
+		}
+
+		// Optional vector export of the critical curves and caustics per weight (a task of the work queue)
+		int n_failed = 0;
+		curve_formatT curve_format = CURVES_CSV;
+		if (opts.count("curves"))
 		{
-			cout << "Error opening the image file..." << endl;
-			return 0;
+			int format = 0;
+			while (format < N_CURVE_FORMATS and opts["curves"] != curve_format_names[format])
+				++format;
+			if (format == N_CURVE_FORMATS)
+			{
+				cout << "Unknown curve format " << opts["curves"] << endl;
+				return -1;
+			}
+			curve_format = static_cast<curve_formatT>(format);
+			if (!queue)
+				n_failed += run_curve_export(lens, params, out_prefix, curve_format);
 		}
+
+		cout << "Rendering sweep of " << params.size() << " frames..." << endl;
+		const arc_paramsT *arcs = opts.count("arcs") ? &arc_settings : nullptr;
+		if (queue)
+		{
+			size_t shard_size = opts.count("shard") ? std::strtoul(opts["shard"].c_str(), nullptr, 0) : 256;
+			n_failed += run_sweep_worker(*queue, shard_size, lens, source, params, max_w, max_h, out_prefix, 
+					batch_size, scale, arcs, opts.count("curves") ? &curve_format : nullptr);
+		}
+		else
+			n_failed += run_sweep(lens, source, params, max_w, max_h, out_prefix, batch_size, scale, arcs);
+		return n_failed == 0 ? 0 : -1;
+	}
+
+	// Headless analysis of the strong lensing cross-section for a list of weights
+	if (opts.count("cross-section"))
+	{
+		std::vector<double> weights;
+		if (!parse_weight_list(opts["cross-section"], weights))
+		{
+			cout << "Error parsing weight list " << opts["cross-section"] << endl;
+			return -1;
+		}
+		return run_cross_section(lens, weights, opts.count("out") ? opts["out"] : "") ? 0 : -1;
+	}
+
+	// Colormap and opacity of the kappa overlay
+	colormapT kappa_cmap = CMAP_VIRIDIS;
+	if (opts.count("kappa-colormap"))
+	{
+		int n = 0;
+		while (n < N_CMAPS and opts["kappa-colormap"] != colormap_names[n])
+			++n;
+		if (n == N_CMAPS)
+		{
+			cout << "Unknown colormap " << opts["kappa-colormap"] << endl;
+			return -1;
+		}
+		kappa_cmap = static_cast<colormapT>(n);
 	}
+	double kappa_opacity = opts.count("kappa-opacity") ? std::strtod(opts["kappa-opacity"].c_str(), nullptr) : 0.6;
 
-	// Create lens, source and screen objects (the latter opens an OpenCV window)
-	int max_w = std::min(kappa_input.cols, imageRGB.cols);
-	int max_h = std::min(kappa_input.rows, imageRGB.rows);
+	// Create the screen object (this opens an OpenCV window)
 	const char* win = "CV_Window_";
-	cout << "Creating lens, source and screen..." << endl;
-	lensT lens(kappa_input, max_w/2, max_h/2);
-	sourceT source(imageRGB, max_w/2, max_h/2);
-	screenT screen(win, max_w, max_h, resize_w, resize_h, lens, source);
+	cout << "Creating screen..." << endl;
+	screenT screen(win, max_w, max_h, resize_w, resize_h, lens, source, view_max_w, view_max_h);
+	if (opts.count("kappa-colormap") or opts.count("kappa-opacity"))
+	{
+		screen.set_kappa_colormap(kappa_cmap, kappa_opacity);
+		screen.request_frame();
+	}
 
-	// Enter refresh loop waiting for key/mouse event. The loop is exited with "q" or window close
+	// Quality governor holding a target frame rate during interaction
+	if (opts.count("target-fps"))
+	{
+		double min_scale = opts.count("min-scale") ? std::strtod(opts["min-scale"].c_str(), nullptr) : 0.25;
+		int max_supersampling = opts.count("max-supersampling") ? 
+			static_cast<int>(std::strtol(opts["max-supersampling"].c_str(), nullptr, 0)) : 1;
+		int max_overlay_interval = opts.count("max-overlay-interval") ? 
+			static_cast<int>(std::strtol(opts["max-overlay-interval"].c_str(), nullptr, 0)) : 8;
+		screen.set_governor(governorT(std::strtod(opts["target-fps"].c_str(), nullptr), min_scale, 
+				max_supersampling, max_overlay_interval));
+		screen.request_frame();
+	}
+
+	/**
+	 * Enter event loop: the screen renders from the callbacks when something changed, so the loop only 
+	 * waits for keys until the message text has to be hidden or the full quality has to be restored 
+	 * after interaction. Otherwise, it blocks until the next key (polling twice per second only while 
+	 * the source plane window is open, to notice when it is closed). The loop is exited with "q" or 
+	 * window close.
+	 */
+	const int source_plane_poll = 500;
 	while (true)
 	{
-		if (cv::waitKey(200) == 113 or cv::getWindowProperty(win, cv::WND_PROP_AUTOSIZE) == -1)
+		int key = screen.take_queued_key();
+		if (key == -1)
+		{
+			int timeout = screen.msg_timeout();
+			int restore = screen.quality_timeout();
+			if (restore >= 0 and (timeout < 0 or restore < timeout))
+				timeout = restore;
+			if (timeout >= 0)
+				key = cv::waitKey(std::max(1, timeout));
+			else
+				key = cv::waitKey(screen.source_plane_shown() ? source_plane_poll : 0);
+		}
+		if (key == 113 or cv::getWindowProperty(win, cv::WND_PROP_AUTOSIZE) == -1)
 			break;
+		screen.check_source_plane_window();
+		screen.handle_key(key);
 		screen.clear_msg_display();
+		screen.restore_quality();
 	}
 
 	cv::destroyAllWindows();
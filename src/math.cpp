@@ -1,9 +1,13 @@
 #include <iostream> // std::count
 #include <cmath>
+#include <cstring> // std::memcpy
+#include <algorithm> // std::max
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "math.h"
+#include "cpu_dispatch.h"
 
 using cv::Mat;
 
@@ -87,6 +91,23 @@ double relocate_and_compute_exp_falloff(int rel_px, int len, double half, double
 	return 1.;
 }
 
+// Distances sqrt(i_sq + j^2) for j = 0..n-1 (compiled once per instruction set, see cpu_dispatch.h)
+static KERNEL_INLINE void distance_row(double i_sq, double *out, int n)
+{
+	for (int j = 0; j < n; ++j)
+		out[j] = sqrt(i_sq + static_cast<double>(j) * j);
+}
+MULTIVERSION_KERNEL(void, distance_row, (double i_sq, double *out, int n), (i_sq, out, n))
+
+// Central differences (plus - minus) / 2 of a row (compiled once per instruction set)
+static KERNEL_INLINE void central_diff_row(const double *minus, const double *plus, double *out, int n)
+{
+	for (int j = 0; j < n; ++j)
+		out[j] = (plus[j] - minus[j]) / 2.0;
+}
+MULTIVERSION_KERNEL(void, central_diff_row, (const double *minus, const double *plus, double *out, int n), 
+		(minus, plus, out, n))
+
 /**
  * Fill the Green's function kernel
  * @param[out] green_fct Kernel to fill (needs to be initialized with zero and to have the desired width and height)
@@ -101,10 +122,11 @@ void fill_green_fct(Mat &green_fct)
 	double factor = 1/M_PI;
 
 	size_t i, j;
+	std::vector<double> dist(X2 + 1);
 	for (i = 0; i <= Y2; ++i)
 	{
 		size_t Ymi = Y - i;
-		int i_sq = i*i;
+		distance_row_dispatch(static_cast<double>(i*i), dist.data(), static_cast<int>(X2 + 1));
 
 		for (j = 0; j <= X2; ++j)
 		{
@@ -113,7 +135,7 @@ void fill_green_fct(Mat &green_fct)
 			if (i == 0 and j == 0)
 				val = -1.4658711977588554; // G(theta = 0.01) as a lower cut for the log
 			else
-				val = factor * log(sqrt(i_sq + j*j));
+				val = factor * log(dist[j]);
 
 			// Compute values for one quarter and...
 			green_fct.at<double>(i, j) = val;
@@ -132,40 +154,6 @@ void fill_green_fct(Mat &green_fct)
 }
 
 
-/**
- * Shift all pixel coordinates by N pixels into given direction (required for finite differentiation)
- *
- * @param f Matrix to translate
- * @param N Number of pixels to shift image by
- * @param direction Direction to shift image into
- * @return The translated Mat image
- */
-Mat translateImg(Mat f, int N, Direction direction)
-{
-    // Create a same sized temporary Mat with all the pixels flagged as invalid (-1)
-    Mat tmp = Mat::zeros(f.size(), f.type());
-
-    switch (direction)
-    {
-	    case(ShiftUp) :
-		f(cv::Rect(0, N, f.cols, f.rows - N)).copyTo(tmp(cv::Rect(0, 0, tmp.cols, tmp.rows - N)));
-		break;
-	    case(ShiftLeft) :
-		f(cv::Rect(0, 0, f.cols - N, f.rows)).copyTo(tmp(cv::Rect(N, 0, f.cols - N, f.rows)));
-		break;
-	    case(ShiftDown) :
-		f(cv::Rect(0, 0, f.cols, f.rows - N)).copyTo(tmp(cv::Rect(0, N, f.cols, f.rows - N)));
-		break;
-	    case(ShiftRight) :
-		f(cv::Rect(N, 0, f.cols - N, f.rows)).copyTo(tmp(cv::Rect(0, 0, f.cols - N, f.rows)));
-		break;
-	    default:
-		std::cout << "Shift direction is not set properly" << std::endl;
-	    }
-
-    return tmp;
-}
-
 /**
  * Compute partial numerical derivative of scalar field in x-direction
  *
@@ -174,14 +162,17 @@ Mat translateImg(Mat f, int N, Direction direction)
  */
 void deriv_x(Mat &input, Mat &result)
 {
-	// Apply the finite differences
-	Mat xp1, xm1;
-	xp1 = translateImg(input, 1, ShiftRight);
-	xm1 = translateImg(input, 1, ShiftLeft);
-	result = (xp1-xm1)/2.0;
-
-	int N_r = result.rows;
-	int N_c = result.cols;
+	// Apply the finite differences (the border columns are set below)
+	int N_r = input.rows;
+	int N_c = input.cols;
+	Mat diff(N_r, N_c, CV_64FC1);
+	for (int i = 0; i < N_r; ++i)
+	{
+		const double *row = input.ptr<double>(i);
+		central_diff_row_dispatch(row, row + 2, diff.ptr<double>(i) + 1, N_c - 2);
+	}
+	result = diff;
+
 	for (int i = 0; i < N_r; ++i)
         {
 		double border1 = result.at<double>(i, 2);
@@ -201,15 +192,15 @@ void deriv_x(Mat &input, Mat &result)
  */
 void deriv_y(Mat &input, Mat &result)
 {
-	// Apply the finite differences
-	Mat yp1, ym1;
-	yp1 = translateImg(input, 1, ShiftUp);
-	ym1 = translateImg(input, 1, ShiftDown);
-	result = (yp1-ym1)/2.0;
+	// Apply the finite differences (the border rows are set below)
+	int N_c = input.cols;
+	int N_r = input.rows;
+	Mat diff(N_r, N_c, CV_64FC1);
+	for (int i = 1; i < N_r - 1; ++i)
+		central_diff_row_dispatch(input.ptr<double>(i-1), input.ptr<double>(i+1), diff.ptr<double>(i), N_c);
+	result = diff;
 	
 	// Check the boundaries
-	int N_c = result.cols;
-	int N_r = result.rows;
 	for (int i = 0; i < N_c; ++i)
         {
 		double border1 = result.at<double>(2, i);
@@ -221,6 +212,107 @@ void deriv_y(Mat &input, Mat &result)
         }
 }
 
+/**
+ * Halve the size of an image by taking the maximum of each 2x2 block (keeps thin lines visible)
+ *
+ * @param[in] input Input image (CV_8UC1)
+ * @param[out] result Image of size ((cols+1)/2, (rows+1)/2) (CV_8UC1)
+ */
+void max_pool_2x2(const Mat &input, Mat &result)
+{
+	int N_r = (input.rows + 1) / 2;
+	int N_c = (input.cols + 1) / 2;
+	Mat pooled(N_r, N_c, CV_8UC1);
+
+	for (int i = 0; i < N_r; ++i)
+		for (int j = 0; j < N_c; ++j)
+		{
+			uchar val = 0;
+			for (int di = 0; di < 2 and 2*i+di < input.rows; ++di)
+				for (int dj = 0; dj < 2 and 2*j+dj < input.cols; ++dj)
+					val = std::max(val, input.at<uchar>(2*i+di, 2*j+dj));
+			pooled.at<uchar>(i, j) = val;
+		}
+
+	result = pooled;
+}
+
+/**
+ * Convert a half-precision (IEEE 754 binary16) value to float via shifts
+ * @param h Bit pattern of the half-precision value
+ * @return The value as float
+ */
+float half_to_float_soft(unsigned short h)
+{
+	unsigned sign = (h & 0x8000u) << 16;
+	unsigned expo = (h >> 10) & 0x1fu;
+	unsigned mant = h & 0x3ffu;
+	unsigned bits;
+
+	if (expo == 0x1f) // Inf or NaN
+		bits = sign | 0x7f800000u | (mant << 13);
+	else if (expo != 0) // Normal number: re-bias the exponent from 15 to 127
+		bits = sign | ((expo + 112) << 23) | (mant << 13);
+	else if (mant == 0) // Signed zero
+		bits = sign;
+	else
+	{
+		// Subnormal number: normalize the mantissa
+		expo = 113;
+		while (!(mant & 0x400u))
+		{
+			mant <<= 1;
+			--expo;
+		}
+		bits = sign | (expo << 23) | ((mant & 0x3ffu) << 13);
+	}
+
+	float f;
+	std::memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+/**
+ * Convert a float to half-precision (IEEE 754 binary16), rounding to nearest even
+ * @param f Value to convert
+ * @return Bit pattern of the half-precision value
+ */
+unsigned short float_to_half(float f)
+{
+	unsigned bits;
+	std::memcpy(&bits, &f, sizeof(f));
+	unsigned sign = (bits >> 16) & 0x8000u;
+	unsigned f_expo = (bits >> 23) & 0xffu;
+	unsigned mant = bits & 0x7fffffu;
+	int expo = static_cast<int>(f_expo) - 127 + 15;
+
+	if (f_expo == 0xff) // Inf or NaN
+		return sign | 0x7c00u | (mant ? 0x200u : 0u);
+	if (expo >= 0x1f) // Overflow to Inf
+		return sign | 0x7c00u;
+	if (expo <= 0)
+	{
+		// Subnormal result (or underflow to zero)
+		if (expo < -10)
+			return sign;
+		mant |= 0x800000u;
+		int shift = 14 - expo;
+		unsigned half_mant = mant >> shift;
+		unsigned rest = mant & ((1u << shift) - 1);
+		unsigned halfway = 1u << (shift - 1);
+		if (rest > halfway or (rest == halfway and (half_mant & 1)))
+			++half_mant;
+		return sign | half_mant;
+	}
+
+	// Normal result (a carry of the rounding correctly propagates into the exponent)
+	unsigned half = sign | (static_cast<unsigned>(expo) << 10) | (mant >> 13);
+	unsigned rest = mant & 0x1fffu;
+	if (rest > 0x1000u or (rest == 0x1000u and (half & 1)))
+		++half;
+	return half;
+}
+
 /**
  * Compute median of a Mat image
  * @param img_orig Input matrix (CV_64FC1)
@@ -238,3 +330,32 @@ double calculate_median(Mat img_orig)
         return flat[flat.size() / 2]; 
 }
 
+// Convert a float image into half-precision bit patterns
+void encode_half(const Mat &in, Mat &out)
+{
+	Mat result(in.rows, in.cols, CV_MAKETYPE(CV_16U, in.channels()));
+	int n = in.cols * in.channels();
+	for (int i = 0; i < in.rows; ++i)
+	{
+		const float *src = in.ptr<float>(i);
+		unsigned short *dst = result.ptr<unsigned short>(i);
+		for (int j = 0; j < n; ++j)
+			dst[j] = float_to_half(src[j]);
+	}
+	out = result;
+}
+
+// Convert an image of half-precision bit patterns into float
+void decode_half(const Mat &in, Mat &out)
+{
+	Mat result(in.rows, in.cols, CV_MAKETYPE(CV_32F, in.channels()));
+	int n = in.cols * in.channels();
+	for (int i = 0; i < in.rows; ++i)
+	{
+		const unsigned short *src = in.ptr<unsigned short>(i);
+		float *dst = result.ptr<float>(i);
+		for (int j = 0; j < n; ++j)
+			dst[j] = half_to_float(src[j]);
+	}
+	out = result;
+}
@@ -1,6 +1,7 @@
 #ifndef MATH_H
 #define MATH_H
 
+#include <cstring> // std::memcpy
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
@@ -54,21 +55,6 @@ double relocate_and_compute_exp_falloff(int rel_px, int len, double half, double
  */
 void fill_green_fct(Mat &green_fct);
 
-// Define enum for direction of image translations
-enum Direction{
-    ShiftUp=1, ShiftRight, ShiftDown, ShiftLeft
-   };
-
-/**
- * Shift all pixel coordinates by N pixels into given direction (required for finite differentiation)
- *
- * @param f Matrix to translate
- * @param N Number of pixels to shift image by
- * @param direction Direction to shift image into
- * @return The translated Mat image
- */
-Mat translateImg(Mat f, int N, Direction direction);
-
 /**
  * Compute partial numerical derivative of scalar field in x-direction
  *
@@ -85,6 +71,60 @@ void deriv_x(Mat &input, Mat &result);
  */
 void deriv_y(Mat &input, Mat &result);
 
+/**
+ * Halve the size of an image by taking the maximum of each 2x2 block (keeps thin lines visible)
+ *
+ * @param[in] input Input image (CV_8UC1)
+ * @param[out] result Image of size ((cols+1)/2, (rows+1)/2) (CV_8UC1)
+ */
+void max_pool_2x2(const Mat &input, Mat &result);
+
+/**
+ * Convert a half-precision (IEEE 754 binary16) value to float via shifts
+ * @param h Bit pattern of the half-precision value
+ * @return The value as float
+ */
+float half_to_float_soft(unsigned short h);
+
+/**
+ * Convert a half-precision (IEEE 754 binary16) value to float. Inlined into the render kernels: the 
+ * compiler's half type converts with the F16C instruction in the kernel versions built for AVX2 and 
+ * up (see cpu_dispatch.h) and via the runtime library otherwise.
+ * @param h Bit pattern of the half-precision value
+ * @return The value as float
+ */
+inline float half_to_float(unsigned short h)
+{
+#ifdef __FLT16_MAX__
+	_Float16 value;
+	std::memcpy(&value, &h, sizeof(value));
+	return value;
+#else
+	return half_to_float_soft(h);
+#endif
+}
+
+/**
+ * Convert a float to half-precision (IEEE 754 binary16), rounding to nearest even
+ * @param f Value to convert
+ * @return Bit pattern of the half-precision value
+ */
+unsigned short float_to_half(float f);
+
+/**
+ * Convert a float image (CV_32F, any number of channels) into half-precision bit patterns
+ * @param[in] in Float image
+ * @param[out] out Half-precision image (CV_16U, same number of channels)
+ */
+void encode_half(const Mat &in, Mat &out);
+
+/**
+ * Convert an image of half-precision bit patterns (CV_16U, any number of channels) into float
+ * @param[in] in Half-precision image
+ * @param[out] out Float image (CV_32F, same number of channels)
+ */
+void decode_half(const Mat &in, Mat &out);
+
 /**
  * Compute median of a Mat image
  * @param img_orig Input matrix (CV_64FC1)
@@ -0,0 +1,248 @@
+#include <iostream> // std::cout
+#include <cmath> // fabs
+#include <algorithm> // std::min, std::max
+#include <opencv2/core/core.hpp>
+
+#include "quicklens.h"
+#include "quicklens_impl.h"
+#include "lens.h"
+#include "renderer.h"
+#include "image_io.h"
+#include "cpu_dispatch.h"
+#include "autotune.h"
+
+using cv::Mat;
+
+namespace quicklens
+{
+
+// Implementation of the renderer (lens and source: see quicklens_impl.h)
+struct Renderer::impl
+{
+	Lens::impl *lens;
+	Source::impl *source;
+	int canvas[2];
+	int lens_pos[2];
+	int source_pos[2];
+	double weight = 1.;
+};
+
+// Set up the library for this process
+void initialize(int n_threads)
+{
+	if (n_threads > 0)
+		cv::setNumThreads(n_threads);
+	select_isa();
+}
+
+/**
+ * Create the internal lens from a convergence map (reports an empty map and returns nullptr)
+ * @param kappa Convergence map (CV_64FC1 or CV_8UC1, modified by the lens)
+ * @param lean Keep only the products needed for rendering
+ * @param format Storage format of the deflection field
+ * @return The lens
+ */
+lensT *make_lens(Mat &kappa, bool lean, DeflectionFormat format)
+{
+	if (kappa.empty())
+	{
+		std::cout << "-> Empty convergence map, no lens created" << std::endl;
+		return nullptr;
+	}
+	return new lensT(kappa, kappa.cols/2, kappa.rows/2, lean, static_cast<deflection_formatT>(format));
+}
+
+/**
+ * Create the internal source from an image (nullptr for an empty image)
+ * @param image Source image (8-bit, or 16-bit/float for high dynamic range, 3 channels BGR)
+ * @return The source
+ */
+sourceT *make_source(Mat &image)
+{
+	if (image.empty())
+		return nullptr;
+	return new sourceT(image, image.cols/2, image.rows/2);
+}
+
+// Adopt an implementation (see access in quicklens_impl.h)
+Lens::Lens(impl *d_) : d(d_)
+{
+}
+
+// Create a lens from a convergence map in memory
+Lens::Lens(const double *kappa, int width, int height, size_t row_stride, bool lean, DeflectionFormat format)
+	: d(new impl)
+{
+	if (kappa and width > 0 and height > 0)
+	{
+		Mat wrapped(height, width, CV_64FC1, const_cast<double*>(kappa), row_stride);
+		d->kappa = wrapped.clone();
+	}
+	d->lens.reset(make_lens(d->kappa, lean, format));
+}
+
+// Load the convergence map from a file
+Lens::Lens(const std::string &filename, bool lean, DeflectionFormat format) : d(new impl)
+{
+	if (!read_kappa(filename, d->kappa))
+		std::cout << "Error opening " << filename << std::endl;
+	d->lens.reset(make_lens(d->kappa, lean, format));
+}
+
+Lens::Lens(Lens &&other) = default;
+Lens &Lens::operator=(Lens &&other) = default;
+Lens::~Lens() = default;
+
+bool Lens::is_valid() const
+{
+	return d and d->lens;
+}
+
+int Lens::width() const
+{
+	return is_valid() ? d->lens->get_width() : 0;
+}
+
+int Lens::height() const
+{
+	return is_valid() ? d->lens->get_height() : 0;
+}
+
+// Copy an (unweighted) deflection field component into a caller-provided buffer
+bool Lens::get_deflection(int component, double *out, size_t row_stride) const
+{
+	if (!is_valid() or !out or (component != 1 and component != 2))
+		return false;
+	Mat field;
+	d->lens->get_deflection_field(component, field);
+	Mat wrapped(field.rows, field.cols, CV_64FC1, out, row_stride);
+	field.copyTo(wrapped);
+	return true;
+}
+
+// Adopt an implementation (see access in quicklens_impl.h)
+Source::Source(impl *d_) : d(d_)
+{
+}
+
+// Create a source from an 8-bit BGR image in memory
+Source::Source(const unsigned char *bgr, int width, int height, size_t row_stride) : d(new impl)
+{
+	if (!bgr or width <= 0 or height <= 0)
+		return;
+	Mat wrapped(height, width, CV_8UC3, const_cast<unsigned char*>(bgr), row_stride);
+	d->image = wrapped.clone();
+	d->source.reset(make_source(d->image));
+}
+
+// Load the source image from a file
+Source::Source(const std::string &filename, bool hdr) : d(new impl)
+{
+	if (!read_source(filename, hdr, d->image))
+	{
+		std::cout << "Error opening " << filename << std::endl;
+		return;
+	}
+	d->source.reset(make_source(d->image));
+}
+
+Source::Source(Source &&other) = default;
+Source &Source::operator=(Source &&other) = default;
+Source::~Source() = default;
+
+bool Source::is_valid() const
+{
+	return d and d->source;
+}
+
+int Source::width() const
+{
+	return is_valid() ? d->source->get_width() : 0;
+}
+
+int Source::height() const
+{
+	return is_valid() ? d->source->get_height() : 0;
+}
+
+void Source::set_size(double factor)
+{
+	if (is_valid() and factor > 0.)
+		d->source->resize_area(factor);
+}
+
+/**
+ * Renderer Constructor (lens and source have to outlive the renderer; both are centered on the canvas)
+ * @param lens Lens to render with
+ * @param source Source to be lensed
+ * @param canvas_width Width of the rendered image (px)
+ * @param canvas_height Height of the rendered image (px)
+ */
+Renderer::Renderer(Lens &lens, Source &source, int canvas_width, int canvas_height) : d(new impl)
+{
+	d->lens = lens.d.get();
+	d->source = source.d.get();
+	d->canvas[0] = std::max(0, canvas_width);
+	d->canvas[1] = std::max(0, canvas_height);
+	d->lens_pos[0] = d->source_pos[0] = d->canvas[0]/2;
+	d->lens_pos[1] = d->source_pos[1] = d->canvas[1]/2;
+}
+
+Renderer::Renderer(Renderer &&other) = default;
+Renderer &Renderer::operator=(Renderer &&other) = default;
+Renderer::~Renderer() = default;
+
+void Renderer::set_lens_position(int x, int y)
+{
+	d->lens_pos[0] = x;
+	d->lens_pos[1] = y;
+}
+
+void Renderer::set_source_position(int x, int y)
+{
+	d->source_pos[0] = x;
+	d->source_pos[1] = y;
+}
+
+void Renderer::set_weight(double weight)
+{
+	d->weight = weight;
+}
+
+int Renderer::canvas_width() const
+{
+	return d->canvas[0];
+}
+
+int Renderer::canvas_height() const
+{
+	return d->canvas[1];
+}
+
+// Render the lensed image (or a band of its rows) into a caller-provided buffer
+bool Renderer::render(unsigned char *out, size_t row_stride, int first_row, int rows)
+{
+	if (!out or !d->lens or !d->lens->lens or !d->source or !d->source->source)
+		return false;
+	if (rows < 0)
+		rows = d->canvas[1] - first_row;
+	if (first_row < 0 or rows <= 0 or first_row + rows > d->canvas[1] or d->canvas[0] == 0)
+		return false;
+
+	// The placement and weight belong to the renderer, so they are applied to the shared objects here
+	lensT &lens = *d->lens->lens;
+	sourceT &src = *d->source->source;
+	lens.move(d->lens_pos[0], d->lens_pos[1]);
+	lens.weight = d->weight;
+	src.move(d->source_pos[0], d->source_pos[1]);
+
+	// Render the rows as one band of the canvas, directly into the caller's buffer
+	Mat band(rows, d->canvas[0], CV_8UC3, out, row_stride);
+	double reach[2] = {lens.get_max_deflection(1) * std::fabs(lens.weight) + 1.,
+		lens.get_max_deflection(2) * std::fabs(lens.weight) + 1.};
+	src.prepare_area(-reach[0], first_row - reach[1], d->canvas[0] + reach[0], first_row + rows + reach[1]);
+	cv::parallel_for_(cv::Range(0, rows), Parallel_band_renderer(&lens, &src, band, first_row), render_stripes(rows));
+	return true;
+}
+
+}
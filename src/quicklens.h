@@ -0,0 +1,224 @@
+#ifndef QUICKLENS_H
+#define QUICKLENS_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/**
+ * @brief Embeddable API of libquicklens: lens construction, source loading and headless rendering
+ * into caller-provided buffers, without any window dependency.
+ *
+ * @details The API only uses standard types and keeps the implementation behind private pointers,
+ * so it stays binary compatible when the internals change (api_version is only increased on
+ * incompatible changes). A lens computes its products once on construction and can then render any
+ * number of frames. Rendering runs on the internal thread pool; a lens or source must not be used by
+ * two renders at the same time.
+ */
+namespace quicklens
+{
+	// Access to the implementation for the C interface (see quicklens_impl.h)
+	struct access;
+
+	// Version of the API
+	const int api_version = 1;
+
+	/**
+	 * Set up the library for this process (optional, but recommended before the first lens): set the
+	 * number of render threads and select the instruction set of the kernels (see cpu_dispatch.h)
+	 *
+	 * @param n_threads Number of threads (<= 0: all)
+	 */
+	void initialize(int n_threads = 0);
+
+	/**
+	 * @brief Storage formats of the deflection field (see the --deflection option of the lens binary)
+	 */
+	enum class DeflectionFormat { F64, F32, F16, I16 };
+
+	/**
+	 * @brief Gravitational lens defined by its convergence map, with the precomputed lensing products
+	 */
+	class Lens
+	{
+		public:
+			/**
+			 * Create a lens from a convergence map in memory (the data is copied)
+			 *
+			 * @param kappa Convergence values (row-major)
+			 * @param width Width of the map (px)
+			 * @param height Height of the map (px)
+			 * @param row_stride Bytes between the starts of two rows (0: width * sizeof(double))
+			 * @param lean Keep only the products needed for rendering
+			 * @param format Storage format of the deflection field
+			 */
+			Lens(const double *kappa, int width, int height, size_t row_stride = 0, bool lean = false,
+					DeflectionFormat format = DeflectionFormat::F64);
+
+			/**
+			 * Load the convergence map from a file (FITS or image as for the lens binary)
+			 *
+			 * @param filename Filename of the convergence map
+			 * @param lean Keep only the products needed for rendering
+			 * @param format Storage format of the deflection field
+			 */
+			explicit Lens(const std::string &filename, bool lean = false, DeflectionFormat format = DeflectionFormat::F64);
+
+			Lens(Lens &&other);
+			Lens &operator=(Lens &&other);
+			~Lens();
+
+			/**
+			 * Check whether the lens could be created
+			 * @return Whether the lens is usable
+			 */
+			bool is_valid() const;
+
+			/**
+			 * Get the size of the convergence map
+			 * @return Width or height (px)
+			 */
+			int width() const;
+			int height() const;
+
+			/**
+			 * Copy an (unweighted) deflection field component into a caller-provided buffer
+			 *
+			 * @param component 1: x direction, 2: y direction
+			 * @param out Buffer for width x height doubles
+			 * @param row_stride Bytes between the starts of two rows (0: width * sizeof(double))
+			 * @return Whether the field was copied
+			 */
+			bool get_deflection(int component, double *out, size_t row_stride = 0) const;
+
+			struct impl;
+
+		private:
+			explicit Lens(impl *d_);
+
+			std::unique_ptr<impl> d;
+			friend class Renderer;
+			friend struct access;
+	};
+
+	/**
+	 * @brief Source image to be lensed
+	 */
+	class Source
+	{
+		public:
+			/**
+			 * Create a source from an 8-bit BGR image in memory (the data is copied)
+			 *
+			 * @param bgr Pixel data (3 bytes per pixel, blue first)
+			 * @param width Width of the image (px)
+			 * @param height Height of the image (px)
+			 * @param row_stride Bytes between the starts of two rows (0: 3 * width)
+			 */
+			Source(const unsigned char *bgr, int width, int height, size_t row_stride = 0);
+
+			/**
+			 * Load the source image from a file
+			 *
+			 * @param filename Filename of the source image
+			 * @param hdr Keep high dynamic range images in linear light (tone mapped when rendering)
+			 */
+			explicit Source(const std::string &filename, bool hdr = false);
+
+			Source(Source &&other);
+			Source &operator=(Source &&other);
+			~Source();
+
+			/**
+			 * Check whether the source could be created
+			 * @return Whether the source is usable
+			 */
+			bool is_valid() const;
+
+			/**
+			 * Get the current size of the source image (after set_size)
+			 * @return Width or height (px)
+			 */
+			int width() const;
+			int height() const;
+
+			/**
+			 * Resize the angular extent of the source
+			 * @param factor Size relative to the original image
+			 */
+			void set_size(double factor);
+
+			struct impl;
+
+		private:
+			explicit Source(impl *d_);
+
+			std::unique_ptr<impl> d;
+			friend class Renderer;
+			friend struct access;
+	};
+
+	/**
+	 * @brief Headless renderer of a lens and a source placed on a canvas
+	 */
+	class Renderer
+	{
+		public:
+			/**
+			 * Constructor (lens and source have to outlive the renderer; both are centered on the canvas)
+			 *
+			 * @param lens Lens to render with
+			 * @param source Source to be lensed
+			 * @param canvas_width Width of the rendered image (px)
+			 * @param canvas_height Height of the rendered image (px)
+			 */
+			Renderer(Lens &lens, Source &source, int canvas_width, int canvas_height);
+
+			Renderer(Renderer &&other);
+			Renderer &operator=(Renderer &&other);
+			~Renderer();
+
+			/**
+			 * Place the lens center on the canvas
+			 * @param x, y Canvas position (px)
+			 */
+			void set_lens_position(int x, int y);
+
+			/**
+			 * Place the source center on the canvas
+			 * @param x, y Canvas position (px)
+			 */
+			void set_source_position(int x, int y);
+
+			/**
+			 * Set the weight factor applied to the convergence
+			 * @param weight Weight
+			 */
+			void set_weight(double weight);
+
+			/**
+			 * Get the size of the canvas
+			 * @return Width or height (px)
+			 */
+			int canvas_width() const;
+			int canvas_height() const;
+
+			/**
+			 * Render the lensed image (or a band of its rows) into a caller-provided buffer
+			 *
+			 * @param out Buffer for rows x canvas_width pixels, 8-bit BGR
+			 * @param row_stride Bytes between the starts of two rows (0: 3 * canvas_width)
+			 * @param first_row First canvas row to render
+			 * @param rows Number of rows to render (< 0: up to the last row)
+			 * @return Whether the image was rendered
+			 */
+			bool render(unsigned char *out, size_t row_stride = 0, int first_row = 0, int rows = -1);
+
+			struct impl;
+
+		private:
+			std::unique_ptr<impl> d;
+	};
+}
+
+#endif
@@ -0,0 +1,438 @@
+#include <string>
+#include <cstring> // std::memcpy
+#include <climits> // INT_MAX
+#include <exception>
+#include <opencv2/core/core.hpp>
+
+#include "quicklens_c.h"
+#include "quicklens.h"
+#include "quicklens_impl.h"
+#include "lens.h"
+
+using cv::Mat;
+using namespace quicklens;
+
+// The handles of the C interface are the objects of the C++ API
+struct ql_lens
+{
+	Lens lens;
+};
+
+struct ql_source
+{
+	Source source;
+};
+
+struct ql_renderer
+{
+	Renderer renderer;
+};
+
+// Last error of each thread (see ql_last_error)
+static thread_local std::string last_error;
+
+/**
+ * Record an error of the calling thread
+ * @param msg Error message
+ * @return Status -1
+ */
+static int set_error(const std::string &msg)
+{
+	last_error = msg;
+	return -1;
+}
+
+// Size of the elements and the corresponding OpenCV depth of each ql_dtype
+static const size_t dtype_size[] = {1, 2, 2, 2, 4, 8};
+static const int dtype_depth[] = {CV_8U, CV_16U, CV_16S, CV_16U, CV_32F, CV_64F};
+static const char *dtype_names[] = {"uint8", "uint16", "int16", "float16", "float32", "float64"};
+
+/**
+ * Check the dimensions of a strided buffer and whether its element type is accepted
+ *
+ * @param buf Buffer
+ * @param name Name of the buffer for error messages
+ * @param channels Required number of channels (1: 2D buffer or 3D with one channel)
+ * @param dtypes Accepted element types (bit mask of 1 << ql_dtype)
+ * @return Whether the buffer can be used
+ */
+static bool check_buffer(const ql_buffer *buf, const char *name, int channels, int dtypes)
+{
+	std::string prefix = std::string(name) + ": ";
+	if (!buf or !buf->data)
+	{
+		set_error(prefix + "no data");
+		return false;
+	}
+	if (buf->ndim != 2 and buf->ndim != 3)
+	{
+		set_error(prefix + "has to be 2- or 3-dimensional");
+		return false;
+	}
+	if (buf->dtype < QL_UINT8 or buf->dtype > QL_FLOAT64)
+	{
+		set_error(prefix + "unknown element type " + std::to_string(buf->dtype));
+		return false;
+	}
+	if (!(dtypes & (1 << buf->dtype)))
+	{
+		set_error(prefix + "unsupported element type " + dtype_names[buf->dtype]);
+		return false;
+	}
+	int buf_channels = (buf->ndim == 3) ? buf->shape[2] : 1;
+	if (buf_channels != channels)
+	{
+		set_error(prefix + "has to have " + std::to_string(channels) + " channel(s)");
+		return false;
+	}
+	if (buf->shape[0] <= 0 or buf->shape[1] <= 0 or buf->shape[0] > INT_MAX or buf->shape[1] > INT_MAX)
+	{
+		set_error(prefix + "invalid shape");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Read a strided buffer into a Mat of its element type (row by row if the pixels are contiguous,
+ * element by element otherwise)
+ * @param[in] buf Buffer (checked with check_buffer)
+ * @param[out] result Matrix of shape[0] rows and shape[1] columns
+ */
+static void gather(const ql_buffer *buf, Mat &result)
+{
+	int channels = (buf->ndim == 3) ? buf->shape[2] : 1;
+	size_t esz = dtype_size[buf->dtype];
+	int64_t col_stride = buf->strides[1];
+	int64_t channel_stride = (buf->ndim == 3) ? buf->strides[2] : esz;
+	bool contiguous = (channel_stride == (int64_t) esz and col_stride == (int64_t) (esz * channels));
+
+	result.create(buf->shape[0], buf->shape[1], CV_MAKETYPE(dtype_depth[buf->dtype], channels));
+	for (int i = 0; i < result.rows; ++i)
+	{
+		const char *src = static_cast<const char*>(buf->data) + i * buf->strides[0];
+		unsigned char *dst = result.ptr(i);
+		if (contiguous)
+		{
+			std::memcpy(dst, src, result.cols * esz * channels);
+			continue;
+		}
+		for (int j = 0; j < result.cols; ++j)
+			for (int c = 0; c < channels; ++c, dst += esz)
+				std::memcpy(dst, src + j * col_stride + c * channel_stride, esz);
+	}
+}
+
+/**
+ * Write a Mat into a strided buffer of the same element type and size (counterpart of gather)
+ * @param[in] mat Single channel matrix
+ * @param[in] buf Buffer (checked with check_buffer)
+ */
+static void scatter(const Mat &mat, const ql_buffer *buf)
+{
+	size_t esz = mat.elemSize();
+	for (int i = 0; i < mat.rows; ++i)
+	{
+		char *dst = static_cast<char*>(buf->data) + i * buf->strides[0];
+		const unsigned char *src = mat.ptr(i);
+		for (int j = 0; j < mat.cols; ++j, src += esz)
+			std::memcpy(dst + j * buf->strides[1], src, esz);
+	}
+}
+
+/**
+ * Describe a matrix as a (read-only) strided buffer
+ * @param[in] mat Single channel matrix
+ * @param[in] dtype Element type
+ * @param[out] view Buffer referring to the matrix data
+ */
+static void make_view(const Mat &mat, int dtype, ql_buffer *view)
+{
+	view->data = const_cast<unsigned char*>(mat.data);
+	view->ndim = 2;
+	view->dtype = dtype;
+	view->shape[0] = mat.rows;
+	view->shape[1] = mat.cols;
+	view->shape[2] = 1;
+	view->strides[0] = mat.step[0];
+	view->strides[1] = mat.elemSize();
+	view->strides[2] = mat.elemSize();
+}
+
+int ql_api_version(void)
+{
+	return api_version;
+}
+
+const char *ql_last_error(void)
+{
+	return last_error.c_str();
+}
+
+void ql_initialize(int n_threads)
+{
+	initialize(n_threads);
+}
+
+// Create a lens from a convergence map in memory
+ql_lens *ql_lens_create(const ql_buffer *kappa, int lean, int format)
+{
+	if (!check_buffer(kappa, "kappa", 1, (1 << QL_UINT8) | (1 << QL_FLOAT32) | (1 << QL_FLOAT64)))
+		return nullptr;
+	if (format < QL_DEFLECTION_F64 or format > QL_DEFLECTION_I16)
+	{
+		set_error("Unknown deflection format " + std::to_string(format));
+		return nullptr;
+	}
+	try
+	{
+		// The lens derives its products from (and modifies) its own copy of the map
+		std::unique_ptr<Lens::impl> d(new Lens::impl);
+		gather(kappa, d->kappa);
+		if (d->kappa.depth() == CV_32F)
+			d->kappa.convertTo(d->kappa, CV_64F);
+		d->lens.reset(make_lens(d->kappa, lean, static_cast<DeflectionFormat>(format)));
+		if (!d->lens)
+		{
+			set_error("kappa: empty convergence map");
+			return nullptr;
+		}
+		return new ql_lens{access::adopt(d.release())};
+	}
+	catch (std::exception &e)
+	{
+		set_error(std::string("Error creating lens: ") + e.what());
+		return nullptr;
+	}
+}
+
+// Load the convergence map from a file
+ql_lens *ql_lens_load(const char *filename, int lean, int format)
+{
+	if (!filename)
+	{
+		set_error("No filename");
+		return nullptr;
+	}
+	if (format < QL_DEFLECTION_F64 or format > QL_DEFLECTION_I16)
+	{
+		set_error("Unknown deflection format " + std::to_string(format));
+		return nullptr;
+	}
+	try
+	{
+		ql_lens *handle = new ql_lens{Lens(std::string(filename), lean, static_cast<DeflectionFormat>(format))};
+		if (handle->lens.is_valid())
+			return handle;
+		delete handle;
+		set_error(std::string("Error opening ") + filename);
+		return nullptr;
+	}
+	catch (std::exception &e)
+	{
+		set_error(std::string("Error loading lens: ") + e.what());
+		return nullptr;
+	}
+}
+
+void ql_lens_destroy(ql_lens *lens)
+{
+	delete lens;
+}
+
+int ql_lens_size(const ql_lens *lens, int *width, int *height)
+{
+	if (!lens or !width or !height)
+		return set_error("Invalid arguments");
+	*width = lens->lens.width();
+	*height = lens->lens.height();
+	return 0;
+}
+
+// Expose the convergence map of the lens without copying
+int ql_lens_kappa(ql_lens *lens, ql_buffer *view)
+{
+	if (!lens or !view)
+		return set_error("Invalid arguments");
+	if (!lens->lens.is_valid())
+		return set_error("Invalid lens");
+	Mat &kappa = access::get(lens->lens)->lens->get_kappa();
+	make_view(kappa, (kappa.depth() == CV_32F) ? QL_FLOAT32 : QL_FLOAT64, view);
+	return 0;
+}
+
+// Expose a deflection field component without copying, in its storage format
+int ql_lens_deflection(ql_lens *lens, int component, ql_buffer *view)
+{
+	if (!lens or !view or (component != 1 and component != 2))
+		return set_error("Invalid arguments");
+	if (!lens->lens.is_valid())
+		return set_error("Invalid lens");
+	lensT &internal = *access::get(lens->lens)->lens;
+	int dtype;
+	switch (internal.get_deflection_format())
+	{
+		case DEFLECTION_F64 : dtype = QL_FLOAT64; break;
+		case DEFLECTION_F32 : dtype = QL_FLOAT32; break;
+		case DEFLECTION_F16 : dtype = QL_FLOAT16; break;
+		default : return set_error("The int16 deflection format has to be decoded with ql_lens_copy_deflection");
+	}
+	make_view(internal.get_deflection_storage(component), dtype, view);
+	return 0;
+}
+
+// Decode a deflection field component into a caller buffer
+int ql_lens_copy_deflection(ql_lens *lens, int component, const ql_buffer *out)
+{
+	if (!lens or (component != 1 and component != 2))
+		return set_error("Invalid arguments");
+	if (!lens->lens.is_valid())
+		return set_error("Invalid lens");
+	if (!check_buffer(out, "out", 1, (1 << QL_FLOAT32) | (1 << QL_FLOAT64)))
+		return -1;
+	if (out->shape[0] != lens->lens.height() or out->shape[1] != lens->lens.width())
+		return set_error("out: has to have the size of the lens");
+	try
+	{
+		Mat field;
+		access::get(lens->lens)->lens->get_deflection_field(component, field);
+		if (out->dtype == QL_FLOAT32)
+			field.convertTo(field, CV_32F);
+		scatter(field, out);
+		return 0;
+	}
+	catch (std::exception &e)
+	{
+		return set_error(std::string("Error decoding deflection: ") + e.what());
+	}
+}
+
+// Create a source from an image in memory
+ql_source *ql_source_create(const ql_buffer *image)
+{
+	if (!check_buffer(image, "image", 3, (1 << QL_UINT8) | (1 << QL_UINT16) | (1 << QL_FLOAT32)))
+		return nullptr;
+	try
+	{
+		std::unique_ptr<Source::impl> d(new Source::impl);
+		gather(image, d->image);
+		d->source.reset(make_source(d->image));
+		if (!d->source)
+		{
+			set_error("image: empty source image");
+			return nullptr;
+		}
+		return new ql_source{access::adopt(d.release())};
+	}
+	catch (std::exception &e)
+	{
+		set_error(std::string("Error creating source: ") + e.what());
+		return nullptr;
+	}
+}
+
+// Load the source image from a file
+ql_source *ql_source_load(const char *filename, int hdr)
+{
+	if (!filename)
+	{
+		set_error("No filename");
+		return nullptr;
+	}
+	try
+	{
+		ql_source *handle = new ql_source{Source(std::string(filename), hdr)};
+		if (handle->source.is_valid())
+			return handle;
+		delete handle;
+		set_error(std::string("Error opening ") + filename);
+		return nullptr;
+	}
+	catch (std::exception &e)
+	{
+		set_error(std::string("Error loading source: ") + e.what());
+		return nullptr;
+	}
+}
+
+void ql_source_destroy(ql_source *source)
+{
+	delete source;
+}
+
+int ql_source_size(const ql_source *source, int *width, int *height)
+{
+	if (!source or !width or !height)
+		return set_error("Invalid arguments");
+	*width = source->source.width();
+	*height = source->source.height();
+	return 0;
+}
+
+int ql_source_set_size(ql_source *source, double factor)
+{
+	if (!source or factor <= 0.)
+		return set_error("Invalid arguments");
+	source->source.set_size(factor);
+	return 0;
+}
+
+// Create a renderer
+ql_renderer *ql_renderer_create(ql_lens *lens, ql_source *source, int canvas_width, int canvas_height)
+{
+	if (!lens or !source or canvas_width <= 0 or canvas_height <= 0)
+	{
+		set_error("Invalid arguments");
+		return nullptr;
+	}
+	return new ql_renderer{Renderer(lens->lens, source->source, canvas_width, canvas_height)};
+}
+
+void ql_renderer_destroy(ql_renderer *renderer)
+{
+	delete renderer;
+}
+
+void ql_renderer_set_lens_position(ql_renderer *renderer, int x, int y)
+{
+	if (renderer)
+		renderer->renderer.set_lens_position(x, y);
+}
+
+void ql_renderer_set_source_position(ql_renderer *renderer, int x, int y)
+{
+	if (renderer)
+		renderer->renderer.set_source_position(x, y);
+}
+
+void ql_renderer_set_weight(ql_renderer *renderer, double weight)
+{
+	if (renderer)
+		renderer->renderer.set_weight(weight);
+}
+
+// Render the lensed image (or a band of its rows) directly into a caller buffer
+int ql_render(ql_renderer *renderer, const ql_buffer *out, int first_row)
+{
+	if (!renderer)
+		return set_error("Invalid arguments");
+	if (!check_buffer(out, "out", 3, 1 << QL_UINT8))
+		return -1;
+	int width = renderer->renderer.canvas_width();
+	if (out->shape[1] != width)
+		return set_error("out: has to have the width of the canvas");
+	if (out->strides[2] != 1 or out->strides[1] != 3 or out->strides[0] < 3 * width)
+		return set_error("out: pixels have to be contiguous within rows (strides (>= 3*width, 3, 1))");
+	if (first_row < 0 or first_row + out->shape[0] > renderer->renderer.canvas_height())
+		return set_error("out: rows exceed the canvas");
+	try
+	{
+		if (!renderer->renderer.render(static_cast<unsigned char*>(out->data), out->strides[0], first_row, out->shape[0]))
+			return set_error("Render failed (invalid lens or source)");
+		return 0;
+	}
+	catch (std::exception &e)
+	{
+		return set_error(std::string("Error rendering: ") + e.what());
+	}
+}
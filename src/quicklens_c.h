@@ -0,0 +1,219 @@
+#ifndef QUICKLENS_C_H
+#define QUICKLENS_C_H
+
+#include <stdint.h>
+
+/**
+ * @brief C interface of libquicklens for foreign function interfaces (ctypes, cffi, ...).
+ *
+ * @details Arrays are passed as strided buffers in the layout of NumPy arrays, so bindings can hand
+ * over the memory of their arrays without copies:
+ * - inputs (convergence maps, source images) are read in place through their strides, in any
+ *   memory order, and converted once into the storage of the lens or source,
+ * - deflection fields and the convergence map of a lens can be exposed as views of its storage,
+ * - frames are rendered directly into the caller's buffer.
+ *
+ * Functions returning int report success with 0 and failure with -1; functions returning a handle
+ * return NULL on failure. In both cases ql_last_error describes the problem. Rendering runs on the
+ * internal thread pool and does not call back into the caller, so bindings may release their
+ * interpreter lock during all calls (ctypes.CDLL does). A lens or source must not be used by two
+ * renders at the same time.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Version of the C interface (equal to quicklens::api_version)
+#define QL_API_VERSION 1
+
+// Element types of strided buffers
+enum ql_dtype { QL_UINT8, QL_UINT16, QL_INT16, QL_FLOAT16, QL_FLOAT32, QL_FLOAT64 };
+
+// Storage formats of the deflection field (see the --deflection option of the lens binary)
+enum ql_deflection_format { QL_DEFLECTION_F64, QL_DEFLECTION_F32, QL_DEFLECTION_F16, QL_DEFLECTION_I16 };
+
+/**
+ * @brief Strided array of up to 3 dimensions (rows, columns, channels): element (i, j, c) is
+ * located at data + i*strides[0] + j*strides[1] + c*strides[2] (strides in bytes, may be negative)
+ */
+typedef struct
+{
+	void *data;
+	int ndim;		// 2 (single channel) or 3
+	int dtype;		// Element type (enum ql_dtype)
+	int64_t shape[3];
+	int64_t strides[3];
+} ql_buffer;
+
+typedef struct ql_lens ql_lens;
+typedef struct ql_source ql_source;
+typedef struct ql_renderer ql_renderer;
+
+/**
+ * Get the version of the C interface of the loaded library (compare to QL_API_VERSION)
+ * @return Version
+ */
+int ql_api_version(void);
+
+/**
+ * Get the description of the last error of the calling thread
+ * @return Error message (empty if there was no error)
+ */
+const char *ql_last_error(void);
+
+/**
+ * Set up the library for this process (see quicklens::initialize)
+ * @param n_threads Number of threads (<= 0: all)
+ */
+void ql_initialize(int n_threads);
+
+/**
+ * Create a lens from a convergence map in memory (the buffer is not retained)
+ *
+ * @param kappa Convergence map (2D; float64, float32, or uint8 scaled to [0,2] as for images)
+ * @param lean Keep only the products needed for rendering
+ * @param format Storage format of the deflection field (enum ql_deflection_format)
+ * @return Lens handle
+ */
+ql_lens *ql_lens_create(const ql_buffer *kappa, int lean, int format);
+
+/**
+ * Load the convergence map from a file (FITS or image as for the lens binary)
+ *
+ * @param filename Filename of the convergence map
+ * @param lean Keep only the products needed for rendering
+ * @param format Storage format of the deflection field (enum ql_deflection_format)
+ * @return Lens handle
+ */
+ql_lens *ql_lens_load(const char *filename, int lean, int format);
+
+/**
+ * Destroy a lens (views of it become invalid)
+ * @param lens Lens handle (may be NULL)
+ */
+void ql_lens_destroy(ql_lens *lens);
+
+/**
+ * Get the size of the convergence map
+ * @param lens Lens handle
+ * @param[out] width, height Size (px)
+ * @return Status
+ */
+int ql_lens_size(const ql_lens *lens, int *width, int *height);
+
+/**
+ * Expose the convergence map of the lens without copying (float64, float32 in lean mode; valid
+ * until the lens is destroyed, must not be written)
+ *
+ * @param lens Lens handle
+ * @param[out] view View of the convergence map
+ * @return Status
+ */
+int ql_lens_kappa(ql_lens *lens, ql_buffer *view);
+
+/**
+ * Expose an (unweighted) deflection field component without copying, in its storage format
+ * (float64, float32 or float16; valid until the lens is destroyed, must not be written). The int16
+ * format needs the tile scales and can only be copied with ql_lens_copy_deflection.
+ *
+ * @param lens Lens handle
+ * @param component 1: x direction, 2: y direction
+ * @param[out] view View of the deflection field
+ * @return Status
+ */
+int ql_lens_deflection(ql_lens *lens, int component, ql_buffer *view);
+
+/**
+ * Decode an (unweighted) deflection field component into a caller buffer
+ *
+ * @param lens Lens handle
+ * @param component 1: x direction, 2: y direction
+ * @param out Destination (2D float64 or float32 of the size of the lens, any strides)
+ * @return Status
+ */
+int ql_lens_copy_deflection(ql_lens *lens, int component, const ql_buffer *out);
+
+/**
+ * Create a source from an image in memory (the buffer is not retained)
+ * @param image BGR image (3 channels; uint8, or uint16/float32 linear light for high dynamic range)
+ * @return Source handle
+ */
+ql_source *ql_source_create(const ql_buffer *image);
+
+/**
+ * Load the source image from a file
+ * @param filename Filename of the source image
+ * @param hdr Keep high dynamic range images in linear light (tone mapped when rendering)
+ * @return Source handle
+ */
+ql_source *ql_source_load(const char *filename, int hdr);
+
+/**
+ * Destroy a source
+ * @param source Source handle (may be NULL)
+ */
+void ql_source_destroy(ql_source *source);
+
+/**
+ * Get the current size of the source image
+ * @param source Source handle
+ * @param[out] width, height Size (px)
+ * @return Status
+ */
+int ql_source_size(const ql_source *source, int *width, int *height);
+
+/**
+ * Resize the angular extent of the source
+ * @param source Source handle
+ * @param factor Size relative to the original image
+ * @return Status
+ */
+int ql_source_set_size(ql_source *source, double factor);
+
+/**
+ * Create a renderer (lens and source have to outlive the renderer; both are centered on the canvas)
+ *
+ * @param lens Lens to render with
+ * @param source Source to be lensed
+ * @param canvas_width, canvas_height Size of the rendered image (px)
+ * @return Renderer handle
+ */
+ql_renderer *ql_renderer_create(ql_lens *lens, ql_source *source, int canvas_width, int canvas_height);
+
+/**
+ * Destroy a renderer
+ * @param renderer Renderer handle (may be NULL)
+ */
+void ql_renderer_destroy(ql_renderer *renderer);
+
+/**
+ * Place the lens or the source center on the canvas
+ * @param renderer Renderer handle
+ * @param x, y Canvas position (px)
+ */
+void ql_renderer_set_lens_position(ql_renderer *renderer, int x, int y);
+void ql_renderer_set_source_position(ql_renderer *renderer, int x, int y);
+
+/**
+ * Set the weight factor applied to the convergence
+ * @param renderer Renderer handle
+ * @param weight Weight
+ */
+void ql_renderer_set_weight(ql_renderer *renderer, double weight);
+
+/**
+ * Render the lensed image (or a band of its rows) directly into a caller buffer
+ *
+ * @param renderer Renderer handle
+ * @param out Destination: uint8 of shape (rows, canvas_width, 3), BGR, with contiguous pixels
+ * (strides (s, 3, 1) with s >= 3*canvas_width)
+ * @param first_row First canvas row to render (the band has out->shape[0] rows)
+ * @return Status
+ */
+int ql_render(ql_renderer *renderer, const ql_buffer *out, int first_row);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
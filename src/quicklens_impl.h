@@ -0,0 +1,62 @@
+#ifndef QUICKLENS_IMPL_H
+#define QUICKLENS_IMPL_H
+
+#include <memory>
+#include <opencv2/core/core.hpp>
+
+#include "quicklens.h"
+#include "lens.h"
+
+/**
+ * Implementation of the API objects, shared by the C++ API (quicklens.cpp) and the C interface
+ * (quicklens_c.cpp). Internal header, not part of the public API.
+ */
+namespace quicklens
+{
+	struct Lens::impl
+	{
+		cv::Mat kappa;
+		std::unique_ptr<lensT> lens;
+	};
+
+	struct Source::impl
+	{
+		cv::Mat image;
+		std::unique_ptr<sourceT> source;
+	};
+
+	/**
+	 * Create the internal lens from a convergence map (reports an empty map and returns nullptr)
+	 * @param kappa Convergence map (CV_64FC1 or CV_8UC1, modified by the lens)
+	 * @param lean Keep only the products needed for rendering
+	 * @param format Storage format of the deflection field
+	 * @return The lens
+	 */
+	lensT *make_lens(cv::Mat &kappa, bool lean, DeflectionFormat format);
+
+	/**
+	 * Create the internal source from an image (nullptr for an empty image)
+	 * @param image Source image (8-bit, or 16-bit/float for high dynamic range, 3 channels BGR)
+	 * @return The source
+	 */
+	sourceT *make_source(cv::Mat &image);
+
+	/**
+	 * @brief Access to the implementation of the API objects
+	 */
+	struct access
+	{
+		static Lens::impl *get(Lens &lens) { return lens.d.get(); }
+		static Source::impl *get(Source &source) { return source.d.get(); }
+
+		/**
+		 * Wrap an implementation into an API object (which takes ownership)
+		 * @param d Implementation
+		 * @return API object
+		 */
+		static Lens adopt(Lens::impl *d) { return Lens(d); }
+		static Source adopt(Source::impl *d) { return Source(d); }
+	};
+}
+
+#endif
@@ -1,145 +1,198 @@
+#include <cmath> // floor, ceil, fabs
+#include <algorithm> // std::min, std::max
 #include <opencv2/core/core.hpp>
 
 #include "math.h"
+#include "colormap.h"
 #include "lens.h"
-#include "screen_io.h"
 #include "renderer.h"
+#include "cpu_dispatch.h"
 
 using cv::Mat;
 using cv::Vec3b;
 
 
 /**
- * Parallel_renderer Constructor
- * @param std_screen Screen object referred to
- * @param mode Drawing mode: Re-draw whole image? (rather than re-drawing only the overlays)
+ * Parallel_sweep_renderer Constructor
+ * @param[in] lens_ Lens object to use for rendering
+ * @param[in] sources_ Source object for each parameter set
+ * @param[in] params_ Parameter sets to render
+ * @param[out] frames_ Output image per parameter set (CV_8UC3, scaled screen size)
+ * @param[in] origins_ Lens origin of each frame in output pixels
+ * @param[in] scale_ Output resolution relative to the screen
+ * @param[in] level_ Level of detail of the deflection field
  */
-Parallel_renderer::Parallel_renderer(screenT *std_screen, bool mode) : screen(std_screen), recompute_lensed(mode) {}
+Parallel_sweep_renderer::Parallel_sweep_renderer(lensT *lens_, std::vector<sourceT*> &sources_, 
+		const std::vector<sweep_paramT> &params_, std::vector<Mat> &frames_, 
+		const std::vector<cv::Point> &origins_, double scale_, int level_)
+	: lens(lens_), sources(sources_), params(params_), frames(frames_), origins(origins_), 
+	  scale(scale_), level(level_)
+{
+	out_w = frames[0].cols;
+	out_h = frames[0].rows;
+
+	// Frame k covers the lens-relative columns [-origins[k].x, out_w - origins[k].x)
+	by_column.resize(params.size());
+	for (size_t k = 0; k < params.size(); ++k)
+		by_column[k] = static_cast<int>(k);
+	std::stable_sort(by_column.begin(), by_column.end(), 
+			[this](int a, int b) { return origins[a].x > origins[b].x; });
+}
 
-void Parallel_renderer::operator()(const cv::Range &range) const
+void Parallel_sweep_renderer::operator()(const cv::Range &range) const
+{
+	// Select the deflection decoder once rather than per pixel
+	switch (lens->get_deflection_format(level))
+	{
+		case DEFLECTION_F64 : render_rows<DEFLECTION_F64>(range); break;
+		case DEFLECTION_F32 : render_rows<DEFLECTION_F32>(range); break;
+		case DEFLECTION_F16 : render_rows<DEFLECTION_F16>(range); break;
+		case DEFLECTION_I16 : render_rows<DEFLECTION_I16>(range); break;
+	}
+}
+
+template <deflection_formatT format>
+void Parallel_sweep_renderer::render_rows(const cv::Range &range) const
 {
 	// Useful abbreviations
-	lensT &lens = screen->lens;
-	sourceT &src = screen->src;
-	Mat &lensedRGB = screen->lensedRGB;
-	Mat &finalRGB = screen->finalRGB;
-	const int h = lens.get_height();
-	const int w = lens.get_width();
+	const int h = lens->get_height();
+	const int w = lens->get_width();
 	const double hd = static_cast<double>(h);
 	const double wd = static_cast<double>(w);
 	const double h2 = hd*0.5;
 	const double w2 = wd*0.5;
 	const double hm1 = hd-1.;
 	const double wm1 = wd-1.;
+	const double inv_scale = 1./scale;
 
-	// Evaluate user-defined overlay mode parameters
-	bool show_cc = (screen->overlay_mode > 1 and screen->overlay_mode <= 4);
-	bool show_lens = (screen->overlay_mode == 1 or screen->overlay_mode == 4);
-	bool show_overlays = (screen->overlay_mode > 0);
-
-	// Parallel processing of loop over image pixels (j,i)
-	for (int i = range.start; i < range.end; ++i)
+	// Loop over the lens-relative grid (r_j, r_i) in output pixels
+	std::vector<int> active;
+	active.reserve(params.size());
+	for (int r_i = range.start; r_i < range.end; ++r_i)
 	{
+		// Frames whose screen covers this row (in the order of their first column)
+		active.clear();
+		for (int k : by_column)
+		{
+			int i = r_i + origins[k].y;
+			if (i >= 0 and i < out_h)
+				active.push_back(k);
+		}
+		if (active.empty())
+			continue;
+
+		// Lens pixel at the center of the output pixel
+		int rel_i = static_cast<int>(floor((r_i + 0.5) * inv_scale));
+		int safe_i;
+		double fi = relocate_and_compute_exp_falloff(rel_i, h, h2, hm1, safe_i);
+
 		/**
-		 * Define a relative y-coordinate with respect to the lens origin and
-		 * specify the fall-off of alpha outside the defined lens area in y-dir.
+		 * All screens are out_w columns wide, so the frames covering a column are the run 
+		 * active[first, last): frames enter at their first column and leave in the same order
 		 */
-		int rel_i = i - lens.get_origin()[1];
-		int safe_i = 0; // Use dummy values until "recompute_lensed" is checked
-		double fi = 1.;
-		if (recompute_lensed)
-			fi = relocate_and_compute_exp_falloff(rel_i, h, h2, hm1, safe_i);
-
-		for (int j = 0; j < screen->max_w; ++j)
+		size_t first = 0, last = 0;
+		int r_j = 0;
+		while (first < active.size())
 		{
-			// Define relative x-coordinate as well
-			int rel_j = j - lens.get_origin()[0];
+			// Skip columns no frame covers
+			if (first == last)
+				r_j = -origins[active[first]].x;
+			while (last < active.size() and -origins[active[last]].x <= r_j)
+				++last;
 
-			// First consider the overlays (if these sum to 255, can skip raytracing)
-			unsigned overlay_sum = 0;
-			bool is_caustic_pixel = false;
-			if (show_overlays and lens.contains(j, i))
-			{
-				// Check if pixel coincides with a CC of the lens
-				unsigned cc_px_value = show_cc ? lens.get_cc().at<uchar>(rel_i, rel_j) : 0;
-				if (show_cc and cc_px_value > 0)
-				{	
-					/**
-					 * If CC val is 255 and if only the overlays shall be
-					 * redrawn, we can set pixel directly to 255 
-					 * and skip to next one, since CC is always on top.
-					 */
-					if (cc_px_value == 255 and !recompute_lensed)
-					{
-						finalRGB.at<Vec3b>(i,j) = Vec3b(255,255,255);
-						continue;
-					}
-
-					/**
-					 * Add contribution of the CC contour image. Gray 
-					 * values can occur since contours are anti-aliased.
-					 */	
-					overlay_sum += cc_px_value;
-				}
-
-				// Check if pixel lies on a caustic (comes second after CC)
-				if (lens.get_caustics().at<uchar>(rel_i, rel_j) > 0)
-					is_caustic_pixel = show_cc;
-
-				if (is_caustic_pixel)
-				{
-					finalRGB.at<Vec3b>(i,j) = Vec3b(0,0,255);
-					if (!recompute_lensed)
-						continue;
-				}
-
-				// Add lens convergence to overlays
-				if (show_lens)
-				{
-					unsigned kappa8u = lens.get_kappa8u().at<uchar>(rel_i, rel_j);
-					overlay_sum += kappa8u;
-				}
-			}
+			// Read the deflection once and apply the fall-off outside the lens area
+			int rel_j = static_cast<int>(floor((r_j + 0.5) * inv_scale));
+			int safe_j;
+			double fj = relocate_and_compute_exp_falloff(rel_j, w, w2, wm1, safe_j);
+			double a1, a2;
+			lens->get_deflection_as<format>(level, safe_j, safe_i, a1, a2);
+			a1 *= fi*fj;
+			a2 *= fi*fj;
 
-			// Perform the raytracing to compute the lensed image in the background
-			if (recompute_lensed)
+			// Solve the lens equation for the frames covering this lens pixel
+			for (size_t n = first; n < last; ++n)
 			{
-				/**
-				 * Place rel_j within bounds (result -> safe_j) and specify 
-				 * the fall-off of alpha outside the defined lens area in 
-				 * y-direction
-				 */
-				int safe_j;
-				double fj = relocate_and_compute_exp_falloff(rel_j, w, w2, wm1, safe_j);
-				double beta1, beta2;
-				
-				/**
-				 * Compute lens eq. at pixel (j,i) to get target source pos.
-				 * Then, get linearly interpolated source RGB value at target 
-				 * (beta1, beta2). Since the latter will in general lie
-				 * between different source pixels, the interpolation is used
-				 * to obtain the contributions at the particular coord.
-				 * The function returns zero if beta is outside the area 
-				 * covered  by the source.
-				 */
-				lens.raytrace_pixel(j, i, safe_j, safe_i, fi*fj, beta1, beta2);
-				lensedRGB.at<Vec3b>(i,j) = src.get_linear_interpolated_pixel(beta1, beta2);
+				int k = active[n];
+				int j = r_j + origins[k].x;
+				int i = r_i + origins[k].y;
+
+				// Screen coordinates of the output pixel center
+				double x1 = (j + 0.5) * inv_scale - 0.5;
+				double x2 = (i + 0.5) * inv_scale - 0.5;
+				double beta1 = x1 - a1 * params[k].weight;
+				double beta2 = x2 - a2 * params[k].weight;
+				frames[k].at<Vec3b>(i,j) = sources[k]->get_linear_interpolated_pixel(beta1, beta2);
 			}
 
-			/**
-			 * Get final image pixel as the sum of lensed image + overlay (unless the 
-			 * pixel belongs to a caustic, in which case it has already been set)
-			 */
-			if (!is_caustic_pixel)
-				for (size_t c = 0; c < 3; ++c)
-				{
-					unsigned final_val = lensedRGB.at<Vec3b>(i,j)[c] + overlay_sum;
-					if (final_val > 255)
-						finalRGB.at<Vec3b>(i,j)[c] = 255;
-					else
-						finalRGB.at<Vec3b>(i,j)[c] = final_val;
-				}
-		
+			++r_j;
+			while (first < last and r_j >= out_w - origins[active[first]].x)
+				++first;
+		}
+	}
+}
+
+/**
+ * Parallel_band_renderer Constructor
+ * @param[in] lens_ Lens object to use for rendering (at its current position and weight)
+ * @param[in] src_ Source object (placed on the canvas)
+ * @param[out] band_ Output band (CV_8UC3, canvas width x band height)
+ * @param[in] first_row_ Canvas row of the first band row
+ */
+Parallel_band_renderer::Parallel_band_renderer(lensT *lens_, sourceT *src_, Mat &band_, int first_row_)
+	: lens(lens_), src(src_), band(band_), first_row(first_row_) {}
+
+void Parallel_band_renderer::operator()(const cv::Range &range) const
+{
+	// Select the deflection decoder once rather than per pixel
+	switch (lens->get_deflection_format())
+	{
+		case DEFLECTION_F64 : render_rows<DEFLECTION_F64>(range); break;
+		case DEFLECTION_F32 : render_rows<DEFLECTION_F32>(range); break;
+		case DEFLECTION_F16 : render_rows<DEFLECTION_F16>(range); break;
+		case DEFLECTION_I16 : render_rows<DEFLECTION_I16>(range); break;
+	}
+}
+
+template <deflection_formatT format>
+void Parallel_band_renderer::render_rows(const cv::Range &range) const
+{
+	// Useful abbreviations
+	const int h = lens->get_height();
+	const int w = lens->get_width();
+	const double hd = static_cast<double>(h);
+	const double wd = static_cast<double>(w);
+	const double h2 = hd*0.5;
+	const double w2 = wd*0.5;
+	const double hm1 = hd-1.;
+	const double wm1 = wd-1.;
+
+	// Canvas columns lensed light can reach (source area grown by the largest deflection)
+	const int *src_origin = src->get_origin();
+	double reach1 = lens->get_max_deflection(1) * std::fabs(lens->weight) + 1.;
+	double reach2 = lens->get_max_deflection(2) * std::fabs(lens->weight) + 1.;
+	int lit_min1 = std::max(0, static_cast<int>(floor(src_origin[0] - reach1)));
+	int lit_max1 = std::min(band.cols, static_cast<int>(ceil(src_origin[0] + src->get_width() + reach1)) + 1);
+
+	for (int i = range.start; i < range.end; ++i)
+	{
+		int x2 = first_row + i;
+		band.row(i).setTo(cv::Scalar::all(0));
+		if (x2 < src_origin[1] - reach2 or x2 > src_origin[1] + src->get_height() + reach2)
+			continue;
+
+		int rel_i = x2 - lens->get_origin()[1];
+		int safe_i;
+		double fi = relocate_and_compute_exp_falloff(rel_i, h, h2, hm1, safe_i);
+		for (int x1 = lit_min1; x1 < lit_max1; ++x1)
+		{
+			int rel_j = x1 - lens->get_origin()[0];
+			int safe_j;
+			double fj = relocate_and_compute_exp_falloff(rel_j, w, w2, wm1, safe_j);
+			double a1, a2;
+			lens->get_deflection_as<format>(0, safe_j, safe_i, a1, a2);
+			double beta1 = x1 - a1 * fi*fj * lens->weight;
+			double beta2 = x2 - a2 * fi*fj * lens->weight;
+			band.at<Vec3b>(i, x1) = src->get_linear_interpolated_pixel(beta1, beta2);
 		}
 	}
 }
@@ -152,13 +205,54 @@ void Parallel_renderer::operator()(const cv::Range &range) const
  */
 binary_img_from_sign::binary_img_from_sign(Mat &input, Mat &output) : in(input), out(output) {}
 
+// Sign test of one row (compiled once per instruction set, see cpu_dispatch.h)
+static KERNEL_INLINE void sign_to_binary_row(const double *in, uchar *out, int n)
+{
+	for (int d = 0; d < n; ++d)
+		out[d] = in[d] <= 0;
+}
+MULTIVERSION_KERNEL(void, sign_to_binary_row, (const double *in, uchar *out, int n), (in, out, n))
+
 void binary_img_from_sign::operator()(const cv::Range &range) const
 {
 	int width = in.cols;
 
+	for (int c = range.start; c < range.end; ++c)
+		sign_to_binary_row_dispatch(in.ptr<double>(c), out.ptr<uchar>(c), width);
+}
+
+/**
+ * magnification_img_from_detJ Constructor
+ * @param[in] input Jacobian determinant map (needs to be of type CV_64F, i.e. double)
+ * @param[out] output Colormap index map (returns CV_8U, i.e. uchar, see magnification_index)
+ */
+magnification_img_from_detJ::magnification_img_from_detJ(Mat &input, Mat &output) : in(input), out(output) {}
+
+void magnification_img_from_detJ::operator()(const cv::Range &range) const
+{
+	int width = in.cols;
+
+	for (int c = range.start; c < range.end; ++c)
+		for (int d = 0; d < width; ++d)
+			out.at<uchar>(c,d) = magnification_index(in.at<double>(c,d));
+}
+
+
+/**
+ * colorize_layer Constructor
+ * @param[in] input Grayscale map (CV_8U, i.e. uchar)
+ * @param[in] lut_ Premultiplied colormap with 256 entries (see build_colormap_lut)
+ * @param[out] output BGRA layer (CV_8UC4, needs to be allocated with the size of input)
+ */
+colorize_layer::colorize_layer(const Mat &input, const cv::Vec4b *lut_, Mat &output) : in(input), lut(lut_), out(output) {}
+
+void colorize_layer::operator()(const cv::Range &range) const
+{
+	int width = in.cols;
+
 	for (int c = range.start; c < range.end; ++c)
 		for (int d = 0; d < width; ++d)
-			out.at<uchar>(c,d) = in.at<double>(c,d) <= 0;
+			out.at<cv::Vec4b>(c,d) = lut[in.at<uchar>(c,d)];
 }
 
 
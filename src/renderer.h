@@ -4,27 +4,95 @@
 #include <opencv2/core/core.hpp>
 #include "math.h"
 #include "lens.h"
-#include "screen_io.h"
+#include "batch.h"
 
 using cv::Mat;
 using cv::Vec3b;
 
 /**
- * @brief Class for OpenCV parallelization: Render the image produced by the lens on the given screen for the given source
+ * @brief Class for OpenCV parallelization: Render a batch of parameter sets (lens position, weight, 
+ * source size) at once. The loop runs over rows of the lens-relative coordinate grid, such that each 
+ * deflection value is read once and re-used for all frames of the batch while it is cache-hot. Each 
+ * lens-relative pixel only visits the frames covering it, so the work grows with the frame area 
+ * rather than with the spread of the lens positions.
+ * @details Frames can be rendered at a reduced resolution (scale < 1), in which case the lens 
+ * positions are snapped to the output pixel grid and the deflection is read from the given level 
+ * of detail.
  */
-class Parallel_renderer : public cv::ParallelLoopBody
+class Parallel_sweep_renderer : public cv::ParallelLoopBody
 {
 	private:
-		screenT *screen;
-		bool recompute_lensed;
+		lensT *lens;
+		std::vector<sourceT*> &sources;
+		const std::vector<sweep_paramT> &params;
+		std::vector<Mat> &frames;
+		const std::vector<cv::Point> &origins;
+		double scale;
+		int level;
+		int out_w, out_h;
+		std::vector<int> by_column; // Frame indices ordered by their first lens-relative column
+
+		/**
+		 * Render lens-relative rows, decoding the deflection from the given storage format
+		 * @param range Range of rows relative to the lens origin (output pixels)
+		 */
+		template <deflection_formatT format>
+		void render_rows(const cv::Range &range) const;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] lens_ Lens object to use for rendering
+		 * @param[in] sources_ Source object for each parameter set
+		 * @param[in] params_ Parameter sets to render
+		 * @param[out] frames_ Output image per parameter set (CV_8UC3, scaled screen size)
+		 * @param[in] origins_ Lens origin of each frame in output pixels
+		 * @param[in] scale_ Output resolution relative to the screen
+		 * @param[in] level_ Level of detail of the deflection field
+		 */
+		Parallel_sweep_renderer(lensT *lens_, std::vector<sourceT*> &sources_, 
+				const std::vector<sweep_paramT> &params_, std::vector<Mat> &frames_, 
+				const std::vector<cv::Point> &origins_, double scale_, int level_);
+
+		/**
+		 * Render the given range of lens-relative rows
+		 * @param range Range of rows relative to the lens origin (output pixels)
+		 */
+		virtual void operator()(const cv::Range &range) const;
+};
+
+
+/**
+ * @brief Class for OpenCV parallelization: Render a horizontal band of the canvas at full resolution 
+ * (lensed image only), e.g. for poster-sized images that do not fit into memory as a whole
+ */
+class Parallel_band_renderer : public cv::ParallelLoopBody
+{
+	private:
+		lensT *lens;
+		sourceT *src;
+		Mat &band;
+		int first_row;
+
+		/**
+		 * Render band rows, decoding the deflection from the given storage format
+		 * @param range Range of rows relative to the band
+		 */
+		template <deflection_formatT format>
+		void render_rows(const cv::Range &range) const;
 	public:
 		/**
 		 * Constructor
-		 * @param std_screen Screen object referred to
-		 * @param mode Drawing mode: Re-draw whole image? (rather than re-drawing only the overlays)
+		 * @param[in] lens_ Lens object to use for rendering (at its current position and weight)
+		 * @param[in] src_ Source object (placed on the canvas)
+		 * @param[out] band_ Output band (CV_8UC3, canvas width x band height)
+		 * @param[in] first_row_ Canvas row of the first band row
 		 */
-		Parallel_renderer(screenT *std_screen, bool mode);
+		Parallel_band_renderer(lensT *lens_, sourceT *src_, Mat &band_, int first_row_);
 
+		/**
+		 * Render the given range of band rows
+		 * @param range Range of rows relative to the band
+		 */
 		virtual void operator()(const cv::Range &range) const;
 };
 
@@ -48,6 +116,46 @@ class binary_img_from_sign : public cv::ParallelLoopBody
 		virtual void operator()(const cv::Range &range) const;
 };
 
+/**
+ * @brief Class for OpenCV parallelization: Encode a Jacobian determinant map as magnification colormap indices
+ */
+class magnification_img_from_detJ : public cv::ParallelLoopBody
+{
+	private:
+		Mat &in;
+		Mat &out;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] input Jacobian determinant map (needs to be of type CV_64F, i.e. double)
+		 * @param[out] output Colormap index map (returns CV_8U, i.e. uchar, see magnification_index)
+		 */
+		magnification_img_from_detJ(Mat &input, Mat &output);
+
+		virtual void operator()(const cv::Range &range) const;
+};
+
+/**
+ * @brief Class for OpenCV parallelization: Translate a grayscale map into a premultiplied BGRA layer
+ */
+class colorize_layer : public cv::ParallelLoopBody
+{
+	private:
+		const Mat &in;
+		const cv::Vec4b *lut;
+		Mat &out;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] input Grayscale map (CV_8U, i.e. uchar)
+		 * @param[in] lut_ Premultiplied colormap with 256 entries (see build_colormap_lut)
+		 * @param[out] output BGRA layer (CV_8UC4, needs to be allocated with the size of input)
+		 */
+		colorize_layer(const Mat &input, const cv::Vec4b *lut_, Mat &output);
+
+		virtual void operator()(const cv::Range &range) const;
+};
+
 /**
  * @brief Class for OpenCV parallelization: Invert the critical curve map of a lens to derive its caustics
  */
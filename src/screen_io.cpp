@@ -1,62 +1,339 @@
 #ifndef SCREEN_IO_CPP
 #define SCREEN_IO_CPP
 
+#include <iostream> // std::cout
 #include <valarray>
 #include <chrono>
+#include <algorithm> // std::min, std::max
+#include <cmath> // floor, ceil, log2, fabs
+#include <sstream>
 
 // OpenCV core modules + high-level gui
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
-// Libraries needed for handling the FITS file format
-#if HAS_CCFITS == TRUE
-#include <CCfits/CCfits>
-#include <valarray>
-#endif
-
 // Custom resources
 #include "lens.h"
 #include "screen_io.h"
 #include "renderer.h"
+#include "screen_renderer.h"
+#include "autotune.h"
+#include "image_io.h"
+#include "colormap.h"
+#include "batch.h"
 
 using cv::Mat;
 using cv::Vec3b;
 using namespace std::chrono;
 
 // Create window with screen and trackbars
-screenT::screenT(const char* title, int w, int h, int resize_w, int resize_h, lensT &l, sourceT &s) 
+screenT::screenT(const char* title, int w, int h, int resize_w, int resize_h, lensT &l, sourceT &s, 
+		int view_max_w, int view_max_h) 
 	: max_w(w), max_h(h), win(title), lens(l), src(s)
 {
+	/**
+	 * The view covers the whole canvas at zoom 1. Canvases larger than the max. view size are 
+	 * scaled down to fit, using a coarser level of detail of the lens.
+	 */
+	fit_scale = std::min(1., std::min(static_cast<double>(view_max_w) / w, static_cast<double>(view_max_h) / h));
+	view_w = std::max(1, static_cast<int>(w * fit_scale + 0.5));
+	view_h = std::max(1, static_cast<int>(h * fit_scale + 0.5));
+	lens.build_pyramid(1 + static_cast<int>(floor(log2(1. / fit_scale))));
+	lod_level = lens.lod_for_footprint(1. / fit_scale);
+
 	// Initialize channels for lensed image and final image (i.e. lensed + overlays)
-	lensedRGB = Mat::zeros(h, w, CV_8UC3);
-	finalRGB = Mat::zeros(h, w, CV_8UC3);
+	render_w = view_w;
+	render_h = view_h;
+	lensedRGB = Mat::zeros(view_h, view_w, CV_8UC3);
+	finalRGB = Mat::zeros(view_h, view_w, CV_8UC3);
+	build_parity_lut(mag_lut);
+	set_kappa_colormap(kappa_cmap, kappa_opacity);
+	clock_start = steady_clock::now();
+	last_frame = clock_start;
+
+	// Headless screens (e.g. for benchmarks) render with the current weight of the lens
+	if (!win)
+		return;
 
 	// Create OpenCV window with trackbars and mouse callback
+	source_win = std::string(win) + "source_plane";
 	cv::namedWindow(win, cv::WINDOW_NORMAL);
 	cv::resizeWindow(win, resize_w, resize_h);
-	cv::createTrackbar("Overlays", win, &overlay_mode, 4, update_overlays, this);
+	cv::createTrackbar("Overlays", win, &overlay_mode, 5, update_overlays, this);
 	cv::createTrackbar("Kappa weight", win, &weight_int, 200, reapply_weight, this);
 	cv::createTrackbar("Source size", win, &source_size, 400, resize_source, this);
 	cv::setMouseCallback(win, handle_mouse_input, this);
 
 	// Update the lens
 	reapply_weight(0, this);
-	clock_start = steady_clock::now();
 }
 
 // Compute and render the image; write the image data to result
 void screenT::render_lensed_image(bool redraw_overlay_only)
 {
 	// Parallel computation/rendering of the image (defined in renderer.cpp)
-	cv::parallel_for_(cv::Range(0, max_h), Parallel_renderer(this, !redraw_overlay_only));
+	// (The rows of the source plane view, if shown, are appended to the ones of the image plane)
+	int n_rows = show_source_plane ? 2*render_h : render_h;
+	if (overlay_mode == 1 or overlay_mode == 4)
+		update_kappa_layer();
+
+	/**
+	 * Tiled sources: decode the source area the view can sample (the view grown by the largest 
+	 * deflection), and prefetch its surroundings for panning or dragging
+	 */
+	if (!redraw_overlay_only)
+	{
+		double reach1 = lens.get_max_deflection(1) * std::fabs(lens.weight) + 1.;
+		double reach2 = lens.get_max_deflection(2) * std::fabs(lens.weight) + 1.;
+		double corner1[2], corner2[2];
+		view_to_canvas(0, 0, corner1[0], corner1[1]);
+		view_to_canvas(view_w - 1, view_h - 1, corner2[0], corner2[1]);
+		src.prepare_area(corner1[0] - reach1, corner1[1] - reach2, corner2[0] + reach1, corner2[1] + reach2);
+		double margin[2] = {0.5 * (corner2[0] - corner1[0]), 0.5 * (corner2[1] - corner1[1])};
+		src.prepare_area(corner1[0] - reach1 - margin[0], corner1[1] - reach2 - margin[1], 
+				corner2[0] + reach1 + margin[0], corner2[1] + reach2 + margin[1], true);
+	}
+	cv::parallel_for_(cv::Range(0, n_rows), Parallel_renderer(this, !redraw_overlay_only), render_stripes(n_rows));
 
 	// Mark source center by a dot if wished
-	bool mark_source = overlay_mode >= 2;
-	int pos1 = src.get_pos()[0];
-	int pos2 = src.get_pos()[1];
+	bool mark_source = overlay_mode >= 2 and overlay_mode <= 4;
 	if (mark_source)
-		cv::circle(finalRGB, {pos1, pos2}, 7, cv::Scalar::all(210), -1);
+		cv::circle(finalRGB, canvas_to_render(src.get_pos()[0], src.get_pos()[1]), 
+				std::max(1, static_cast<int>(7 * render_factor)), cv::Scalar::all(210), -1);
+
+	// Outline of the area covered by the lens and its center in the source plane view
+	if (show_source_plane)
+	{
+		const int *origin = lens.get_origin();
+		cv::Point c = canvas_to_render(origin[0] + lens.get_width()/2, origin[1] + lens.get_height()/2);
+		int arm = std::max(1, static_cast<int>(7 * render_factor));
+		cv::Scalar yellow(0, 255, 255);
+		cv::rectangle(sourceRGB, canvas_to_render(origin[0], origin[1]), 
+				canvas_to_render(origin[0] + lens.get_width(), origin[1] + lens.get_height()), yellow, 1, 16);
+		cv::line(sourceRGB, c - cv::Point(arm, 0), c + cv::Point(arm, 0), yellow, 1, 16);
+		cv::line(sourceRGB, c - cv::Point(0, arm), c + cv::Point(0, arm), yellow, 1, 16);
+	}
+}
+
+// Toggle the source plane view window
+void screenT::toggle_source_plane()
+{
+	show_source_plane = !show_source_plane;
+	if (!show_source_plane)
+	{
+		cv::destroyWindow(source_win);
+		sourceRGB.release();
+		source_displayRGB.release();
+		return;
+	}
+
+	// Open a second window of the same size and make sure the caustics are available
+	sourceRGB = Mat::zeros(render_h, render_w, CV_8UC3);
+	cv::namedWindow(source_win, cv::WINDOW_NORMAL);
+	cv::resizeWindow(source_win, view_w, view_h);
+	if (redraw_cc_on_next_action)
+	{
+		lens.update_cc_and_caustics(cc_radial);
+		redraw_cc_on_next_action = false;
+	}
+}
+
+// Notice a source plane window closed by the user (rather than via toggle_source_plane)
+void screenT::check_source_plane_window()
+{
+	if (!show_source_plane or cv::getWindowProperty(source_win, cv::WND_PROP_VISIBLE) >= 1.)
+		return;
+	show_source_plane = false;
+	sourceRGB.release();
+	source_displayRGB.release();
+}
+
+// Check whether the source plane view window is open
+bool screenT::source_plane_shown()
+{
+	return show_source_plane;
+}
+
+// Check whether critical curves and caustics are needed for the current display settings
+bool screenT::needs_cc()
+{
+	return (overlay_mode > 1 and overlay_mode <= 4) or show_source_plane;
+}
+
+// Convert view pixel coordinates into (fractional) canvas coordinates
+void screenT::view_to_canvas(double j, double i, double &x, double &y)
+{
+	double scale = fit_scale * zoom;
+	x = pan[0] + (j + 0.5) / scale - 0.5;
+	y = pan[1] + (i + 0.5) / scale - 0.5;
+}
+
+// Convert canvas coordinates into view pixel coordinates
+void screenT::canvas_to_view(double x, double y, double &j, double &i)
+{
+	double scale = fit_scale * zoom;
+	j = (x - pan[0] + 0.5) * scale - 0.5;
+	i = (y - pan[1] + 0.5) * scale - 0.5;
+}
+
+// Convert canvas coordinates into pixel coordinates of the render buffers
+cv::Point screenT::canvas_to_render(double x, double y)
+{
+	double j, i;
+	canvas_to_view(x, y, j, i);
+	return cv::Point(static_cast<int>((j + 0.5) * render_factor - 0.5), static_cast<int>((i + 0.5) * render_factor - 0.5));
+}
+
+// Set the render resolution
+bool screenT::set_render_factor(double factor)
+{
+	int w = std::max(1, static_cast<int>(view_w * factor + 0.5));
+	int h = std::max(1, static_cast<int>(view_h * factor + 0.5));
+	if (w == render_w and h == render_h)
+		return false;
+
+	render_w = w;
+	render_h = h;
+	render_factor = static_cast<double>(render_w) / view_w;
+	lensedRGB = Mat::zeros(render_h, render_w, CV_8UC3);
+	finalRGB = Mat::zeros(render_h, render_w, CV_8UC3);
+	if (show_source_plane)
+		sourceRGB = Mat::zeros(render_h, render_w, CV_8UC3);
+	lod_level = lens.lod_for_footprint(1. / (fit_scale * zoom * render_factor));
+	return true;
+}
+
+// Set the quality governor used for interactive frames
+void screenT::set_governor(const governorT &g)
+{
+	governor = g;
+
+	// Reduced render resolutions need coarser levels of detail
+	double min_scale = fit_scale * governor.get_min_render_factor();
+	lens.build_pyramid(1 + static_cast<int>(floor(log2(1. / std::min(1., min_scale)))));
+
+	// Size the per-level kappa layers for the new levels and re-pick the level of the current view
+	kappa_layer.resize(lens.get_lod_levels());
+	lod_level = lens.lod_for_footprint(1. / (fit_scale * zoom * render_factor));
+	if (governor.enabled())
+		std::cout << "-> Quality when idle: " << governor.describe() << std::endl;
+}
+
+// Change the zoom factor, keeping the canvas position under the given view pixel fixed
+void screenT::zoom_at(double factor, double j, double i)
+{
+	double x, y;
+	view_to_canvas(j, i, x, y);
+	zoom = std::min(64., std::max(1., zoom * factor));
+
+	// Move the viewport such that (x, y) appears at (j, i) again
+	double scale = fit_scale * zoom;
+	pan[0] = x + 0.5 - (j + 0.5) / scale;
+	pan[1] = y + 0.5 - (i + 0.5) / scale;
+	pan_by(0., 0.);
+	lod_level = lens.lod_for_footprint(1. / (scale * render_factor));
+}
+
+// Shift the viewport, keeping it within the canvas
+void screenT::pan_by(double dx, double dy)
+{
+	double scale = fit_scale * zoom;
+	pan[0] = std::min(std::max(pan[0] + dx, 0.), std::max(0., max_w - view_w / scale));
+	pan[1] = std::min(std::max(pan[1] + dy, 0.), std::max(0., max_h - view_h / scale));
+}
+
+// Select the overlays without the trackbar (for headless screens)
+void screenT::set_overlay_mode(int mode)
+{
+	overlay_mode = std::min(std::max(mode, 0), 5);
+	cc_radial = (overlay_mode == 3 or overlay_mode == 4);
+	if (needs_cc())
+	{
+		lens.update_cc_and_caustics(cc_radial);
+		redraw_cc_on_next_action = false;
+	}
+	if (overlay_mode == 5)
+		lens.update_magnification_map();
+}
+
+// Select the colormap and opacity of the kappa overlay
+void screenT::set_kappa_colormap(colormapT cmap, double opacity)
+{
+	kappa_cmap = cmap;
+	kappa_opacity = opacity;
+	build_colormap_lut(kappa_cmap, kappa_opacity, kappa_lut);
+	kappa_layer.clear();
+}
+
+// Build the kappa overlay layer for the current level of detail if not available yet
+void screenT::update_kappa_layer()
+{
+	if (kappa_layer.size() <= static_cast<size_t>(lod_level))
+		kappa_layer.resize(lod_level + 1);
+	if (!kappa_layer[lod_level].empty())
+		return;
+
+	Mat &kappa8u = lens.get_kappa8u(lod_level);
+	kappa_layer[lod_level].create(kappa8u.rows, kappa8u.cols, CV_8UC4);
+	cv::parallel_for_(cv::Range(0, kappa8u.rows), colorize_layer(kappa8u, kappa_lut, kappa_layer[lod_level]));
+}
+
+// Handle key press events (viewport, overlays, source plane view)
+bool screenT::handle_key(int key)
+{
+	switch (key)
+	{
+		case '+' :
+		case '=' : zoom_at(1.25, 0.5*view_w, 0.5*view_h); break;
+		case '-' : zoom_at(0.8, 0.5*view_w, 0.5*view_h); break;
+		case '0' : zoom_at(1. / zoom, 0.5*view_w, 0.5*view_h); break;
+		case 's' : toggle_source_plane(); break;
+		case 'f' :
+		#if HAS_CCFITS == TRUE
+			if (redraw_cc_on_next_action)
+			{
+				lens.update_cc_and_caustics(cc_radial);
+				redraw_cc_on_next_action = false;
+			}
+			if (writemaps("quicklens_maps.fits", lens))
+				current_text = "Exported lens products to quicklens_maps.fits";
+			else
+				current_text = "FITS export failed (see console)";
+		#else
+			current_text = "FITS export requires CCfits";
+		#endif
+			clock_start = steady_clock::now();
+			break;
+		case 'v' :
+			if (redraw_cc_on_next_action)
+			{
+				lens.update_cc_and_caustics(cc_radial);
+				redraw_cc_on_next_action = false;
+			}
+		{
+			int n_failed = 0;
+			for (int format = 0; format < N_CURVE_FORMATS; ++format)
+				if (!write_curves(std::string("quicklens_curves.") + curve_format_names[format], 
+						static_cast<curve_formatT>(format), lens))
+					++n_failed;
+			if (n_failed == 0)
+				current_text = "Exported critical curves and caustics to quicklens_curves.*";
+			else
+				current_text = "Curve export failed for " + std::to_string(n_failed) + " of " 
+						+ std::to_string(N_CURVE_FORMATS) + " formats (see console)";
+			clock_start = steady_clock::now();
+			break;
+		}
+		case 'c' : 
+			set_kappa_colormap(static_cast<colormapT>((kappa_cmap + 1) % N_CMAPS), kappa_opacity);
+			current_text = std::string("Kappa colormap: ") + colormap_names[kappa_cmap];
+			clock_start = steady_clock::now();
+			break;
+		default : return false;
+	}
+	request_frame();
+	return true;
 }
 
 
@@ -66,43 +343,99 @@ void screenT::refresh(bool redraw_overlay_only)
 	// Compute image, merge channels and mark the source position by a dot if wished
 	render_lensed_image(redraw_overlay_only);
 
-	if (current_text == "")
-		cv::imshow(win, finalRGB);
+	// Bring the images to the view resolution (averaging supersampled pixels)
+	int interpolation = (render_factor > 1.) ? cv::INTER_AREA : cv::INTER_LINEAR;
+	if (render_w == view_w and render_h == view_h)
+		displayRGB = finalRGB;
+	else
+		cv::resize(finalRGB, displayRGB, cv::Size(view_w, view_h), 0, 0, interpolation);
+	if (show_source_plane and render_w == view_w and render_h == view_h)
+		source_displayRGB = sourceRGB;
+	else if (show_source_plane)
+		cv::resize(sourceRGB, source_displayRGB, cv::Size(view_w, view_h), 0, 0, interpolation);
+	show();
+}
+
+// Show the rendered images with message text and quality HUD
+void screenT::show()
+{
+	bool show_hud = governor.enabled();
+	if (current_text == "" and !show_hud)
+		cv::imshow(win, displayRGB);
 	else
 	{
-		Mat tmpRGB = finalRGB.clone();
+		Mat tmpRGB = displayRGB.clone();
 		int linestyle = 16;
-		int sum = max_w + max_h;
+		int sum = view_w + view_h;
 		double sum_red = sum/(1920.+1080.);
 		int text_pos1 = static_cast<int>(0.01*sum);
 		int text_pos2 = static_cast<int>(0.02*sum);
 		cv::Point pos(text_pos1, text_pos2);
 		int font = cv::FONT_HERSHEY_SIMPLEX;
-		cv::putText(tmpRGB, current_text, pos, font, sum_red, cv::Scalar::all(255), 2, linestyle);
+		if (current_text != "")
+			cv::putText(tmpRGB, current_text, pos, font, sum_red, cv::Scalar::all(255), 2, linestyle);
+
+		// Quality HUD in the bottom left corner (settings and time of the last frame)
+		if (show_hud)
+		{
+			std::ostringstream hud;
+			hud << governor.describe() << ", " << static_cast<int>(frame_time * 1000. + 0.5) << " ms";
+			cv::Point hud_pos(text_pos1, view_h - text_pos1);
+			cv::putText(tmpRGB, hud.str(), hud_pos, font, 0.6*sum_red, cv::Scalar::all(255), 1, linestyle);
+		}
 		cv::imshow(win, tmpRGB);
 
 	}
 
+	if (show_source_plane)
+		cv::imshow(source_win, source_displayRGB);
+
 }
 
-// Handle incoming mouse events (e.g. move source)
-void screenT::handle_mouse_input(int sig, int target_x, int target_y, int, void *std_scr)
+// Handle incoming mouse events (e.g. move lens, pan or zoom the view)
+void screenT::handle_mouse_input(int sig, int target_x, int target_y, int flags, void *std_scr)
 {
 	screenT *scr = static_cast<screenT*>(std_scr);
-	if (scr->mouse_lbutton_down and sig == cv::EVENT_MOUSEMOVE)
+	double x, y;
+	scr->view_to_canvas(target_x, target_y, x, y);
+	int pos_x = static_cast<int>(floor(x + 0.5));
+	int pos_y = static_cast<int>(floor(y + 0.5));
+
+	if (sig == cv::EVENT_MOUSEWHEEL)
 	{
-		scr->lens.move(target_x, target_y);
-		scr->refresh();
+		scr->zoom_at(cv::getMouseWheelDelta(flags) > 0 ? 1.25 : 0.8, target_x, target_y);
+		scr->request_frame();
 	}
-	else if (sig == cv::EVENT_LBUTTONUP)
+	else if (scr->mouse_pan_down and sig == cv::EVENT_MOUSEMOVE)
+	{
+		// Drag the canvas along with the cursor
+		double scale = scr->fit_scale * scr->zoom;
+		scr->pan_by((scr->mouse_last[0] - target_x) / scale, (scr->mouse_last[1] - target_y) / scale);
+		scr->mouse_last[0] = target_x;
+		scr->mouse_last[1] = target_y;
+		scr->request_frame();
+	}
+	else if (scr->mouse_lbutton_down and sig == cv::EVENT_MOUSEMOVE)
+	{
+		scr->lens.move(pos_x, pos_y);
+		scr->request_frame();
+	}
+	else if (sig == cv::EVENT_LBUTTONUP or sig == cv::EVENT_RBUTTONUP)
 	{
 		scr->mouse_lbutton_down = false;
+		scr->mouse_pan_down = false;
+	}
+	else if (sig == cv::EVENT_RBUTTONDOWN or (sig == cv::EVENT_LBUTTONDOWN and (flags & cv::EVENT_FLAG_CTRLKEY)))
+	{
+		scr->mouse_pan_down = true;
+		scr->mouse_last[0] = target_x;
+		scr->mouse_last[1] = target_y;
 	}
 	else if (sig == cv::EVENT_LBUTTONDOWN)
 	{
 		scr->mouse_lbutton_down = true;
-		scr->lens.move(target_x, target_y);
-		scr->refresh();
+		scr->lens.move(pos_x, pos_y);
+		scr->request_frame();
 	}
 }
 
@@ -112,40 +445,164 @@ void screenT::handle_mouse_input(int sig, int target_x, int target_y, int, void
  */
 void screenT::reapply_weight(int, void *std_scr)
 {
+	// Applied when the frame is prepared (coalescing the trackbar steps of a drag)
 	screenT *scr = static_cast<screenT*>(std_scr);
-	scr->lens.weight = static_cast<double>(scr->weight_int) / 20.;
-	bool show_cc = (scr->overlay_mode > 1 and scr->overlay_mode <= 4);
-	bool show_radial = (scr->overlay_mode == 3 or scr->overlay_mode == 4);
-	if (show_cc)
+	scr->weight_pending = true;
+	scr->request_frame();
+}
+
+// Apply the current weight trackbar value to the lens
+void screenT::apply_weight()
+{
+	weight_pending = false;
+	lens.weight = static_cast<double>(weight_int) / 20.;
+	bool show_radial = (overlay_mode == 3 or overlay_mode == 4);
+	if (!needs_cc())
+		redraw_cc_on_next_action = true;
+	if (!needs_cc() and overlay_mode != 5)
+		return;
+
+	// The governor may skip the overlay update on intermediate frames (restored when idle)
+	if (++frames_since_overlay < governor.get_overlay_interval())
 	{
-		scr->lens.update_cc_and_caustics(show_radial);
-		scr->redraw_cc_on_next_action = false;	
+		redraw_cc_on_next_action = true;
+		overlays_stale = true;
+		overlay_time = 0.;
+		return;
 	}
-	else
-		scr->redraw_cc_on_next_action = true;
-	scr->refresh();
+
+	steady_clock::time_point start = steady_clock::now();
+	if (needs_cc())
+	{
+		lens.update_cc_and_caustics(show_radial);
+		redraw_cc_on_next_action = false;	
+	}
+	if (overlay_mode == 5)
+		lens.update_magnification_map();
+	frames_since_overlay = 0;
+	overlays_stale = false;
+	overlay_time = duration<double>(steady_clock::now() - start).count();
 }
 
-// Refresh the overlays for critical curves, caustics or kappa. Don't re-render the lensed image.
-void screenT::update_overlays(int, void *std_scr)
+// Update the critical curves and caustics or the magnification map for the selected overlays
+void screenT::apply_overlays()
 {
-	screenT *scr = static_cast<screenT*>(std_scr);
-	bool show_cc = (scr->overlay_mode > 1 and scr->overlay_mode <= 4);
-	if (show_cc)
+	overlays_pending = false;
+	if (needs_cc() and redraw_cc_on_next_action)
 	{
-		bool show_radial = (scr->overlay_mode == 3 or scr->overlay_mode == 4);
-		if (scr->cc_radial != show_radial)
-		{
-			scr->redraw_cc_on_next_action = true;
-			scr->cc_radial = show_radial;
-		}
+		lens.update_cc_and_caustics(cc_radial);
+		redraw_cc_on_next_action = false;
+	}
+
+	// The magnification map is cached per weight, so this only recomputes after weight changes
+	if (overlay_mode == 5)
+		lens.update_magnification_map();
+}
+
+// Request a new frame, coalescing the changes of queued GUI events
+void screenT::request_frame(bool redraw_overlay_only)
+{
+	frame_pending = true;
+	frame_full = frame_full or !redraw_overlay_only;
+	if (in_frame)
+		return;
+
+	in_frame = true;
+	while (frame_pending)
+	{
+		// Deliver queued events first; their callbacks only record changes (keep a pressed key)
+		int key = cv::waitKey(1);
+		if (key != -1)
+			queued_key = key;
+
+		bool full = frame_full;
+		frame_pending = false;
+		frame_full = false;
+
+		// Interactive frames use the quality chosen by the governor (restoring frames the idle quality)
+		if (!restoring_quality)
+			governor.begin_frame();
+		if (set_render_factor(governor.get_render_factor()))
+			full = true;
 
-		if (scr->redraw_cc_on_next_action)
+		overlay_time = -1.;
+		if (weight_pending)
+			apply_weight();
+		if (overlays_pending)
+			apply_overlays();
+		if (source_size_pending)
 		{
-			scr->lens.update_cc_and_caustics(show_radial);
-			scr->redraw_cc_on_next_action = false;
+			source_size_pending = false;
+			src.resize_area(static_cast<double>(source_size)/100.);
 		}
+		steady_clock::time_point start = steady_clock::now();
+		refresh(!full);
+		last_frame = steady_clock::now();
+		frame_time = duration<double>(last_frame - start).count();
+
+		// Overlay-only frames skip the raytracing, so only full frames tell the render cost
+		if (full and !restoring_quality and governor.frame_done(frame_time, overlay_time, render_factor))
+			std::cout << "-> Quality: " << governor.describe() << " (" << frame_time * 1000. << " ms/frame)" << std::endl;
 	}
+	in_frame = false;
+}
+
+// Get the time until the full quality has to be restored after interaction
+int screenT::quality_timeout()
+{
+	if (!governor.enabled() or governor.is_idle())
+		return -1;
+	duration<double> remaining = last_frame + milliseconds(300) - steady_clock::now();
+	return std::max(0, static_cast<int>(ceil(remaining.count() * 1000.)));
+}
+
+// Restore the full quality once the interaction stopped for long enough
+void screenT::restore_quality()
+{
+	if (quality_timeout() != 0)
+		return;
+
+	bool changed = governor.set_idle();
+	if (!changed and !overlays_stale)
+		return;
+	std::cout << "-> Quality: " << governor.describe() << " (idle)" << std::endl;
+
+	// Skipped overlay updates are made up for with the weight update of this frame
+	weight_pending = weight_pending or overlays_stale;
+	restoring_quality = true;
+	request_frame();
+	restoring_quality = false;
+}
+
+// Get a key pressed while GUI events were delivered during a frame
+int screenT::take_queued_key()
+{
+	int key = queued_key;
+	queued_key = -1;
+	return key;
+}
+
+// Get the time until the message text has to be hidden
+int screenT::msg_timeout()
+{
+	if (current_text.empty())
+		return -1;
+	duration<double> remaining = clock_start + seconds(1) - steady_clock::now();
+	return std::max(0, static_cast<int>(ceil(remaining.count() * 1000.)));
+}
+
+// Refresh the overlays for critical curves, caustics or kappa. Don't re-render the lensed image.
+void screenT::update_overlays(int, void *std_scr)
+{
+	// The curves or the magnification map are updated when the frame is prepared
+	screenT *scr = static_cast<screenT*>(std_scr);
+	bool show_radial = (scr->overlay_mode == 3 or scr->overlay_mode == 4);
+	if (scr->cc_radial != show_radial)
+	{
+		scr->redraw_cc_on_next_action = true;
+		scr->cc_radial = show_radial;
+	}
+	scr->overlays_pending = true;
 
 	switch (scr->overlay_mode)
 	{
@@ -153,10 +610,11 @@ void screenT::update_overlays(int, void *std_scr)
 		case 2 : scr->current_text = "Add critical curves (t) + source center (dot)"; break;
 		case 3 : scr->current_text = "Add critical curves (t+r) + source center (dot)"; break;
 		case 4 : scr->current_text = "Add lens + critical curves + source center (dot)"; break;
+		case 5 : scr->current_text = "Magnification map (log |mu|, red: positive, blue: negative parity)"; break;
 		default : scr->current_text = "";
 	}
-	scr->refresh(1);
 	scr->clock_start = steady_clock::now();
+	scr->request_frame(true);
 }
 
 // Resize the angular extent of the source displayed on the screen and update image on screen
@@ -164,10 +622,9 @@ void screenT::resize_source(int, void *std_screen)
 {
 	screenT *screen = static_cast<screenT*>(std_screen);
 
-	// Apply the changed source_size paramter controlled by the trackbar
-	double factor = static_cast<double>(screen->source_size)/100.;
-	screen->src.resize_area(factor);
-	screen->refresh();
+	// The changed source_size parameter is applied when the frame is prepared
+	screen->source_size_pending = true;
+	screen->request_frame();
 }
 
 // Clear the message display on the screen if sufficient time has passed.
@@ -176,42 +633,12 @@ int screenT::clear_msg_display()
 	if (current_text.empty())
 		return 1;
 
-	time_point<steady_clock> clock_end = steady_clock::now();
-	duration<double> timespan = duration_cast<duration<double> >(clock_end - clock_start);
-	
-	if (timespan.count() < 1)
+	if (msg_timeout() > 0)
 		return 1;
 
 	current_text = "";
-	cv::imshow(win, finalRGB);
+	show();
 	return 1;
 }
 
-#if HAS_CCFITS == TRUE
-// Function for importing *.FITS image data into a Mat array
-void readmap(string filename, Mat &cv_image)
-{
-	// Open FITS file and load primary HDU data into valarray
-	CCfits::FITS infile(filename, CCfits::Read, true);
-	CCfits::PHDU &img = infile.pHDU();
-	std::valarray<double> contents;
-	img.read(contents);
-	size_t w(img.axis(0));
-	size_t h(img.axis(1));
-
-	// Read the contents into Mat image
-	cv_image = Mat::zeros(h, w, CV_64FC1);
-	for (size_t i = 0; i < h; i++)
-		for(size_t j = 0; j < w; j++)
-		{
-			double val = contents[i*w + j];
-			if (std::isnan(val))
-				cv_image.at<double>(h-1-i, j) = 0.;
-			else
-				cv_image.at<double>(h-1-i, j) = val;
-
-		}	
-}
-#endif
-
 #endif
@@ -2,8 +2,11 @@
 #define SCREEN_IO_H
 
 #include <chrono>
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include "lens.h"
+#include "colormap.h"
+#include "governor.h"
 
 using cv::Mat;
 
@@ -13,21 +16,54 @@ using cv::Mat;
 class screenT
 {
 	private:
-		// Window parameters
+		// Window parameters (canvas size and size of the rendered view)
 		int max_w = 0, max_h = 0;
+		int view_w = 0, view_h = 0;
 		const char* win;
 
+		/**
+		 * Render resolution: the images are rendered at render_factor times the view resolution 
+		 * (chosen by the governor) and resized to the view for display
+		 */
+		int render_w = 0, render_h = 0;
+		double render_factor = 1.;
+
+		/**
+		 * Viewport: the view shows the canvas at fit_scale * zoom view pixels per canvas pixel, 
+		 * starting at canvas position "pan" (top left). Level of detail used for the current zoom.
+		 */
+		double fit_scale = 1.;
+		double zoom = 1.;
+		double pan[2] = {0., 0.};
+		int lod_level = 0;
+
 		// Objects to display
 		lensT &lens;
 		sourceT &src;
 		Mat lensedRGB; // Lensed image
 		Mat finalRGB; // Final image (lensed + overlays)
+		Mat displayRGB; // Final image at view resolution
+
+		// Source plane view (unlensed source + caustics + lens outline) shown in a second window
+		bool show_source_plane = false;
+		std::string source_win;
+		Mat sourceRGB;
+		Mat source_displayRGB;
 
 		// Drawing mode + trackbar params
 		bool mouse_lbutton_down = false;
+		bool mouse_pan_down = false;
+		int mouse_last[2] = {0, 0};
 		int weight_int = 100;
 		int source_size = 100;
 		int overlay_mode = 1;
+		cv::Vec3b mag_lut[256]; // Colormap of the magnification overlay
+
+		// Kappa overlay: premultiplied BGRA layer per level of detail (built on first use)
+		colormapT kappa_cmap = CMAP_VIRIDIS;
+		double kappa_opacity = 0.6;
+		cv::Vec4b kappa_lut[256];
+		std::vector<Mat> kappa_layer;
 
 		// Internal settings and status variables
 		bool redraw_cc_on_next_action = true;
@@ -35,6 +71,63 @@ class screenT
 		std::chrono::time_point<std::chrono::steady_clock> clock_start;
 		std::string current_text = "";
 
+		/**
+		 * Frame scheduling: GUI callbacks only record their changes and request a frame. Changes 
+		 * arriving while a frame is prepared are coalesced into the next one.
+		 */
+		bool frame_pending = false;
+		bool frame_full = false;
+		bool in_frame = false;
+		bool weight_pending = false;
+		bool source_size_pending = false;
+		bool overlays_pending = false;
+		int queued_key = -1;
+
+		/**
+		 * Quality governor: times of the last frame, frames since the last overlay update and whether 
+		 * the overlays are outdated because updates were skipped
+		 */
+		governorT governor;
+		bool restoring_quality = false;
+		bool overlays_stale = false;
+		int frames_since_overlay = 0;
+		double overlay_time = -1.;
+		double frame_time = 0.;
+		std::chrono::time_point<std::chrono::steady_clock> last_frame;
+
+		/**
+		 * Apply the current weight trackbar value to the lens (and update its critical curves if shown, 
+		 * unless the governor skips the update in this frame)
+		 */
+		void apply_weight();
+
+		/**
+		 * Update the critical curves and caustics or the magnification map for the overlays selected 
+		 * with the trackbar (if outdated)
+		 */
+		void apply_overlays();
+
+		/**
+		 * Set the render resolution (reallocating the render buffers if it changed)
+		 * @param factor Render resolution relative to the view
+		 * @return Whether the resolution changed
+		 */
+		bool set_render_factor(double factor);
+
+		/**
+		 * Convert canvas coordinates into pixel coordinates of the render buffers
+		 *
+		 * @param[in] x Canvas x-coordinate
+		 * @param[in] y Canvas y-coordinate
+		 * @return Render buffer position
+		 */
+		cv::Point canvas_to_render(double x, double y);
+
+		/**
+		 * Show the rendered images, resized to the view, with message text and quality HUD
+		 */
+		void show();
+
 		friend class Parallel_renderer;
 
 	public:
@@ -42,15 +135,93 @@ class screenT
 		/**
 		 * Constructor: Create window with screen and trackbars
 		 *
-		 * @param title Window name for OpenCV
-		 * @param w Screen width
-		 * @param h Screen height
+		 * @param title Window name for OpenCV (nullptr: headless screen without window and trackbars, 
+		 *              rendered with render_lensed_image at the current weight of the lens)
+		 * @param w Screen (canvas) width
+		 * @param h Screen (canvas) height
 		 * @param resize_w Resize window to a fix value independent of screen width
 		 * @param resize_h Resize window to a fix value independent of screen height
 		 * @param l Lens object to use for rendering
 		 * @param s Source object to be displayed
+		 * @param view_max_w Max. width of the rendered view (larger canvases are scaled down to fit)
+		 * @param view_max_h Max. height of the rendered view
+		 */
+		screenT(const char* title, int w, int h, int resize_w, int resize_h, lensT &l, sourceT &s, 
+				int view_max_w = 1920, int view_max_h = 1080);
+
+		/**
+		 * Convert view pixel coordinates into (fractional) canvas coordinates
+		 *
+		 * @param[in] j View x-coordinate
+		 * @param[in] i View y-coordinate
+		 * @param[out] x Canvas x-coordinate
+		 * @param[out] y Canvas y-coordinate
+		 */
+		void view_to_canvas(double j, double i, double &x, double &y);
+
+		/**
+		 * Convert canvas coordinates into view pixel coordinates
+		 *
+		 * @param[in] x Canvas x-coordinate
+		 * @param[in] y Canvas y-coordinate
+		 * @param[out] j View x-coordinate
+		 * @param[out] i View y-coordinate
+		 */
+		void canvas_to_view(double x, double y, double &j, double &i);
+
+		/**
+		 * Change the zoom factor, keeping the canvas position under the given view pixel fixed
+		 *
+		 * @param factor Factor to multiply the zoom with (the zoom is kept within [1, 64])
+		 * @param j View x-coordinate of the fixed point
+		 * @param i View y-coordinate of the fixed point
+		 */
+		void zoom_at(double factor, double j, double i);
+
+		/**
+		 * Shift the viewport, keeping it within the canvas
+		 *
+		 * @param dx Shift in canvas x-direction
+		 * @param dy Shift in canvas y-direction
+		 */
+		void pan_by(double dx, double dy);
+
+		/**
+		 * Select the overlays as with the "Overlays" trackbar and update the critical curves or the 
+		 * magnification map they need (for headless screens)
+		 *
+		 * @param mode 0: none, 1: kappa, 2: critical curves (t), 3: critical curves (t+r), 
+		 *             4: kappa + critical curves (t+r), 5: magnification map
 		 */
-		screenT(const char* title, int w, int h, int resize_w, int resize_h, lensT &l, sourceT &s);
+		void set_overlay_mode(int mode);
+
+		/**
+		 * Select the colormap and opacity of the kappa overlay (the layer is rebuilt on next use)
+		 *
+		 * @param cmap Colormap
+		 * @param opacity Opacity at the highest kappa display value (0..1)
+		 */
+		void set_kappa_colormap(colormapT cmap, double opacity);
+
+		/**
+		 * Build the kappa overlay layer for the current level of detail if not available yet
+		 */
+		void update_kappa_layer();
+
+		/**
+		 * Set the quality governor used for interactive frames
+		 * @param g Governor (with the target frame rate and quality limits)
+		 */
+		void set_governor(const governorT &g);
+
+		/**
+		 * Handle key press events ("+"/"-": zoom in/out, "0": reset zoom, "s": toggle source plane view, 
+		 * "c": cycle kappa colormaps, "f": export lens products to FITS, "v": export curves)
+		 *
+		 * @param key Key code returned by cv::waitKey
+		 * @return Whether the key was handled
+		 */
+		bool handle_key(int key);
 
 		/**
 		 * Compute and render lensed image
@@ -64,15 +235,74 @@ class screenT
 		 */
 		void refresh(bool redraw_overlay_only=false);
 
+		/**
+		 * Request a new frame: renders right away, after delivering the GUI events queued in the 
+		 * meantime, so that their changes end up in a single frame. If called while a frame is 
+		 * being prepared (i.e. from a callback), it only marks the frame as pending.
+		 *
+		 * @param redraw_overlay_only Re-draw only overlays? (I.e. re-use previous lensed image)
+		 */
+		void request_frame(bool redraw_overlay_only = false);
+
+		/**
+		 * Get a key pressed while GUI events were delivered during a frame (see request_frame)
+		 * @return Key code (-1 if none)
+		 */
+		int take_queued_key();
+
+		/**
+		 * Get the time until the message text has to be hidden
+		 * @return Time in ms (-1 if no message is shown)
+		 */
+		int msg_timeout();
+
+		/**
+		 * Get the time until the full quality has to be restored after interaction
+		 * @return Time in ms (-1 if the full quality is in use)
+		 */
+		int quality_timeout();
+
+		/**
+		 * Restore the full quality (and outdated overlays) once the interaction stopped for long 
+		 * enough (see quality_timeout)
+		 */
+		void restore_quality();
+
+		/**
+		 * Toggle the source plane view window (unlensed source with caustics and lens outline)
+		 */
+		void toggle_source_plane();
+
+		/**
+		 * Reset the source plane view if the user closed its window
+		 */
+		void check_source_plane_window();
+
+		/**
+		 * Check whether the source plane view window is open
+		 * @return Whether it is open
+		 */
+		bool source_plane_shown();
+
+		/**
+		 * Check whether critical curves and caustics are needed for the current display settings
+		 * @return Whether they are needed
+		 */
+		bool needs_cc();
+
 		/**
 		 * Signal handler for mouse events
 		 *
+		 * @details Left drag moves the lens, right drag (or ctrl + left drag) pans the view and the
+		 * mouse wheel zooms in or out at the cursor position.
+		 *
 		 * @param sig Type of event (OpenCV)
 		 * @param target_x X position of mouse click
 		 * @param target_y Y position of mouse click
+		 * @param flags Event flags (OpenCV)
 		 * @param std_scr Specific screen object
 		 */
-		static void handle_mouse_input(int sig, int target_x, int target_y, int, void *std_scr);
+		static void handle_mouse_input(int sig, int target_x, int target_y, int flags, void *std_scr);
 
 		/**
 		 * Re-apply lens weight, recompute and re-draw the resulting critical curves.
@@ -95,19 +325,9 @@ class screenT
 		static void resize_source(int, void *std_screen);
 
 		/**
-		 * Clear the message display on the screen if sufficient time has passed.
+		 * Clear the message display on the screen if sufficient time has passed (see msg_timeout).
 		 */
 		int clear_msg_display();
 };
 
-#if HAS_CCFITS == TRUE
-/**
- * @brief Function for importing *.FITS image data into a Mat array
- * @param[in] filename Filename of FITS-image to import
- * @param[out] cv_image Mat object for storing FITS image (can be empty, returns type CV64FC1)
- **/
-void readmap(std::string filename, Mat &cv_image);
-#endif
-
-
 #endif
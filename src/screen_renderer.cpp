@@ -0,0 +1,324 @@
+#include <cmath> // floor, ceil, fabs
+#include <algorithm> // std::min, std::max, std::fill, std::copy
+#include <opencv2/core/core.hpp>
+
+#include "math.h"
+#include "colormap.h"
+#include "lens.h"
+#include "screen_io.h"
+#include "screen_renderer.h"
+#include "cpu_dispatch.h"
+
+using cv::Mat;
+using cv::Vec3b;
+
+
+/**
+ * Parallel_renderer Constructor
+ * @param std_screen Screen object referred to
+ * @param mode Drawing mode: Re-draw whole image? (rather than re-drawing only the overlays)
+ */
+Parallel_renderer::Parallel_renderer(screenT *std_screen, bool mode) : screen(std_screen), recompute_lensed(mode) {}
+
+/**
+ * Get the canvas column (or row) nearest to the center of a render pixel
+ * @param j Render pixel column
+ * @param pan Canvas position of the view (top left)
+ * @param inv_scale Canvas pixels per render pixel
+ * @return Canvas column
+ */
+static inline int nearest_canvas_px(int j, double pan, double inv_scale)
+{
+	return static_cast<int>(floor(pan + (j + 0.5) * inv_scale - 0.5 + 0.5));
+}
+
+/**
+ * Get the first render pixel whose nearest canvas pixel is at least x (for clipping the loops)
+ * @param x Canvas column (or row)
+ * @param pan Canvas position of the view (top left)
+ * @param inv_scale Canvas pixels per render pixel
+ * @param n Number of render pixels
+ * @return First render pixel within [0, n] (n if there is none)
+ */
+static int first_render_px(int x, double pan, double inv_scale, int n)
+{
+	double estimate = ceil((x - 0.5 - pan + 0.5) / inv_scale - 0.5);
+	int j = static_cast<int>(std::min(std::max(estimate, 0.), static_cast<double>(n)));
+
+	// Correct rounding errors of the estimate against the per-pixel mapping
+	while (j > 0 and nearest_canvas_px(j-1, pan, inv_scale) >= x)
+		--j;
+	while (j < n and nearest_canvas_px(j, pan, inv_scale) < x)
+		++j;
+	return j;
+}
+
+// Render rows of the image plane, decoding the deflection from the given storage format
+template <deflection_formatT format>
+KERNEL_INLINE void Parallel_renderer::render_rows_as(int first, int last) const
+{
+	// Useful abbreviations
+	lensT &lens = screen->lens;
+	sourceT &src = screen->src;
+	Mat &lensedRGB = screen->lensedRGB;
+	Mat &finalRGB = screen->finalRGB;
+	const int h = lens.get_height();
+	const int w = lens.get_width();
+	const double hd = static_cast<double>(h);
+	const double wd = static_cast<double>(w);
+	const double h2 = hd*0.5;
+	const double w2 = wd*0.5;
+	const double hm1 = hd-1.;
+	const double wm1 = wd-1.;
+	const int render_w = screen->render_w;
+	const Vec3b black(0,0,0);
+
+	// Viewport: canvas position of render pixel (j,i) and level of detail matching the render pixel size
+	const double inv_scale = 1. / (screen->fit_scale * screen->zoom * screen->render_factor);
+	const double pan1 = screen->pan[0];
+	const double pan2 = screen->pan[1];
+	const int level = screen->lod_level;
+
+	// Magnified views interpolate the deflection between lens pixels instead of showing them as blocks
+	const bool magnified = inv_scale < 1.;
+
+	// Evaluate user-defined overlay mode parameters
+	bool show_cc = (screen->overlay_mode > 1 and screen->overlay_mode <= 4);
+	bool show_lens = (screen->overlay_mode == 1 or screen->overlay_mode == 4);
+	bool show_mag = (screen->overlay_mode == 5);
+	bool show_overlays = (screen->overlay_mode > 0);
+	const Mat *cc = show_cc ? &lens.get_cc(level) : nullptr;
+	const Mat *caustics = show_cc ? &lens.get_caustics(level) : nullptr;
+
+	/**
+	 * Lensed light can only appear within the source area grown by the largest deflection (the 
+	 * fall-off only reduces it). The raytracing loops are clipped to this canvas region (widened 
+	 * to whole pixels); the render pixels outside stay black.
+	 */
+	const int *src_origin = src.get_origin();
+	double reach1 = lens.get_max_deflection(1) * std::fabs(lens.weight) + 1.;
+	double reach2 = lens.get_max_deflection(2) * std::fabs(lens.weight) + 1.;
+	double lit_min2 = src_origin[1] - reach2;
+	double lit_max2 = src_origin[1] + src.get_height() + reach2;
+	int lit_first_j = first_render_px(static_cast<int>(floor(src_origin[0] - reach1)), pan1, inv_scale, render_w);
+	int lit_last_j = first_render_px(static_cast<int>(ceil(src_origin[0] + src.get_width() + reach1)) + 1, 
+			pan1, inv_scale, render_w);
+
+	// Render columns showing lens pixels (the only ones with overlays)
+	const int *lens_origin = lens.get_origin();
+	int lens_first_j = first_render_px(lens_origin[0], pan1, inv_scale, render_w);
+	int lens_last_j = first_render_px(lens_origin[0] + w, pan1, inv_scale, render_w);
+
+	// Parallel processing of loop over image pixels (j,i)
+	for (int i = first; i < last; ++i)
+	{
+		/**
+		 * Define a relative y-coordinate with respect to the lens origin (nearest lens pixel
+		 * to the canvas position of the view pixel)
+		 */
+		double x2 = pan2 + (i + 0.5) * inv_scale - 0.5;
+		int rel_i = nearest_canvas_px(i, pan2, inv_scale) - lens_origin[1];
+		Vec3b *lensed_row = lensedRGB.ptr<Vec3b>(i);
+		Vec3b *final_row = finalRGB.ptr<Vec3b>(i);
+
+		// Perform the raytracing within the lit columns to compute the lensed image in the background
+		bool row_lit = lit_min2 <= x2 and x2 <= lit_max2 and lit_first_j < lit_last_j;
+		if (recompute_lensed and !row_lit)
+			std::fill(lensed_row, lensed_row + render_w, black);
+		else if (recompute_lensed)
+		{
+			std::fill(lensed_row, lensed_row + lit_first_j, black);
+			std::fill(lensed_row + lit_last_j, lensed_row + render_w, black);
+
+			/**
+			 * Place the row within bounds (result -> safe_i) and specify the fall-off of alpha 
+			 * outside the defined lens area in y-direction. Magnified views need the two 
+			 * nearest lens rows and the weight of the second one.
+			 */
+			int safe_i, safe_i1 = 0;
+			double fi, fi1 = 0., wi = 0.;
+			if (magnified)
+			{
+				double rel2 = x2 - lens_origin[1];
+				int i0 = static_cast<int>(floor(rel2));
+				wi = rel2 - i0;
+				fi = relocate_and_compute_exp_falloff(i0, h, h2, hm1, safe_i);
+				fi1 = relocate_and_compute_exp_falloff(i0 + 1, h, h2, hm1, safe_i1);
+			}
+			else
+				fi = relocate_and_compute_exp_falloff(rel_i, h, h2, hm1, safe_i);
+
+			for (int j = lit_first_j; j < lit_last_j; ++j)
+			{
+				double x1 = pan1 + (j + 0.5) * inv_scale - 0.5;
+				double a1, a2;
+				if (magnified)
+				{
+					// Bilinear interpolation of the deflection (including the fall-off)
+					double rel1 = x1 - lens_origin[0];
+					int j0 = static_cast<int>(floor(rel1));
+					double wj = rel1 - j0;
+					int safe_j, safe_j1;
+					double fj = relocate_and_compute_exp_falloff(j0, w, w2, wm1, safe_j);
+					double fj1 = relocate_and_compute_exp_falloff(j0 + 1, w, w2, wm1, safe_j1);
+					double a00[2], a01[2], a10[2], a11[2];
+					lens.get_deflection_as<format>(0, safe_j, safe_i, a00[0], a00[1]);
+					lens.get_deflection_as<format>(0, safe_j1, safe_i, a01[0], a01[1]);
+					lens.get_deflection_as<format>(0, safe_j, safe_i1, a10[0], a10[1]);
+					lens.get_deflection_as<format>(0, safe_j1, safe_i1, a11[0], a11[1]);
+					double w00 = (1. - wi) * (1. - wj) * fi * fj;
+					double w01 = (1. - wi) * wj * fi * fj1;
+					double w10 = wi * (1. - wj) * fi1 * fj;
+					double w11 = wi * wj * fi1 * fj1;
+					a1 = w00 * a00[0] + w01 * a01[0] + w10 * a10[0] + w11 * a11[0];
+					a2 = w00 * a00[1] + w01 * a01[1] + w10 * a10[1] + w11 * a11[1];
+				}
+				else
+				{
+					/**
+					 * Place the lens column within bounds (result -> safe_j) and specify 
+					 * the fall-off of alpha outside the defined lens area in x-direction
+					 */
+					int rel_j = nearest_canvas_px(j, pan1, inv_scale) - lens_origin[0];
+					int safe_j;
+					double fj = relocate_and_compute_exp_falloff(rel_j, w, w2, wm1, safe_j);
+					lens.get_deflection_as<format>(level, safe_j, safe_i, a1, a2);
+					a1 = a1 * fi*fj;
+					a2 = a2 * fi*fj;
+				}
+
+				/**
+				 * Compute lens eq. at canvas pos. (x1,x2) to get target source pos.
+				 * Then, get linearly interpolated source RGB value at target 
+				 * (beta1, beta2). Since the latter will in general lie
+				 * between different source pixels, the interpolation is used
+				 * to obtain the contributions at the particular coord.
+				 * The function returns zero if beta is outside the area 
+				 * covered  by the source.
+				 */
+				double beta1 = x1 - a1 * lens.weight;
+				double beta2 = x2 - a2 * lens.weight;
+				lensed_row[j] = src.get_linear_interpolated_pixel(beta1, beta2);
+			}
+		}
+
+		// Without overlays on this row, the final image is the lensed image
+		bool row_in_lens = 0 <= rel_i and rel_i < h;
+		if (!show_overlays or !row_in_lens or lens_first_j >= lens_last_j)
+		{
+			std::copy(lensed_row, lensed_row + render_w, final_row);
+			continue;
+		}
+		std::copy(lensed_row, lensed_row + lens_first_j, final_row);
+		std::copy(lensed_row + lens_last_j, lensed_row + render_w, final_row + lens_last_j);
+
+		/**
+		 * Get final image pixel as the lensed image blended with the kappa layer plus overlays 
+		 * (at the current level of detail)
+		 */
+		int lod_i = rel_i >> level;
+		for (int j = lens_first_j; j < lens_last_j; ++j)
+		{
+			int lod_j = (nearest_canvas_px(j, pan1, inv_scale) - lens_origin[0]) >> level;
+			const Vec3b &lensed = lensed_row[j];
+
+			/**
+			 * Add contribution of the CC contour image. Gray values can occur since contours 
+			 * are anti-aliased. Caustics are drawn on top.
+			 */
+			unsigned overlay_sum = 0;
+			if (show_cc)
+			{
+				if (caustics->at<uchar>(lod_i, lod_j) > 0)
+				{
+					final_row[j] = Vec3b(0,0,255);
+					continue;
+				}
+				overlay_sum = cc->at<uchar>(lod_i, lod_j);
+			}
+
+			// Look up the magnification color (blended half and half with the lensed image)
+			if (show_mag)
+			{
+				const Vec3b &mag_color = screen->mag_lut[lens.get_magnification(level).at<uchar>(lod_i, lod_j)];
+				for (size_t c = 0; c < 3; ++c)
+					final_row[j][c] = (lensed[c] + mag_color[c] + 1) >> 1;
+				continue;
+			}
+
+			// Look up the pre-colored lens convergence (alpha blended with the lensed image)
+			const cv::Vec4b *kappa_color = show_lens ? &screen->kappa_layer[level].at<cv::Vec4b>(lod_i, lod_j) : nullptr;
+			for (size_t c = 0; c < 3; ++c)
+			{
+				unsigned final_val = lensed[c];
+				if (kappa_color)
+					final_val = (final_val * (255 - (*kappa_color)[3]) + 127) / 255 + (*kappa_color)[c];
+				final_val += overlay_sum;
+				final_row[j][c] = (final_val > 255) ? 255 : final_val;
+			}
+		}
+	}
+}
+
+// Render rows of the image plane (inlined into one version per instruction set below)
+KERNEL_INLINE void Parallel_renderer::render_rows(int first, int last) const
+{
+	switch (screen->lens.get_deflection_format(screen->lod_level))
+	{
+		case DEFLECTION_F64 : render_rows_as<DEFLECTION_F64>(first, last); break;
+		case DEFLECTION_F32 : render_rows_as<DEFLECTION_F32>(first, last); break;
+		case DEFLECTION_F16 : render_rows_as<DEFLECTION_F16>(first, last); break;
+		case DEFLECTION_I16 : render_rows_as<DEFLECTION_I16>(first, last); break;
+	}
+}
+
+TARGET_SSE42 void Parallel_renderer::render_rows_sse42(int first, int last) const { render_rows(first, last); }
+TARGET_AVX2 void Parallel_renderer::render_rows_avx2(int first, int last) const { render_rows(first, last); }
+TARGET_AVX512 void Parallel_renderer::render_rows_avx512(int first, int last) const { render_rows(first, last); }
+
+void Parallel_renderer::operator()(const cv::Range &range) const
+{
+	// Rows beyond the render height belong to the source plane view
+	for (int i = std::max(range.start, screen->render_h); i < range.end; ++i)
+		render_source_plane_row(i - screen->render_h);
+
+	// Rows of the image plane, using the version compiled for the selected instruction set
+	int first = range.start;
+	int last = std::min(range.end, screen->render_h);
+	switch (active_isa())
+	{
+		case ISA_AVX512 : render_rows_avx512(first, last); break;
+		case ISA_AVX2 : render_rows_avx2(first, last); break;
+		case ISA_SSE42 : render_rows_sse42(first, last); break;
+		default : render_rows(first, last);
+	}
+}
+
+void Parallel_renderer::render_source_plane_row(int i) const
+{
+	// Useful abbreviations
+	lensT &lens = screen->lens;
+	sourceT &src = screen->src;
+	Mat &sourceRGB = screen->sourceRGB;
+	const int h = lens.get_height();
+	const int w = lens.get_width();
+	const double inv_scale = 1. / (screen->fit_scale * screen->zoom * screen->render_factor);
+	const int level = screen->lod_level;
+	Mat &caustics = lens.get_caustics(level);
+
+	// Source plane position of the view pixels (the source plane shares the canvas coordinates)
+	double x2 = screen->pan[1] + (i + 0.5) * inv_scale - 0.5;
+	int rel_i = static_cast<int>(floor(x2 + 0.5)) - lens.get_origin()[1];
+	for (int j = 0; j < screen->render_w; ++j)
+	{
+		double x1 = screen->pan[0] + (j + 0.5) * inv_scale - 0.5;
+		int rel_j = static_cast<int>(floor(x1 + 0.5)) - lens.get_origin()[0];
+
+		// Caustics are stored relative to the lens origin
+		bool in_lens = 0 <= rel_j and rel_j < w and 0 <= rel_i and rel_i < h;
+		if (in_lens and !caustics.empty() and caustics.at<uchar>(rel_i >> level, rel_j >> level) > 0)
+			sourceRGB.at<Vec3b>(i,j) = Vec3b(0,0,255);
+		else
+			sourceRGB.at<Vec3b>(i,j) = src.get_linear_interpolated_pixel(x1, x2);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef SCREEN_RENDERER_H
+#define SCREEN_RENDERER_H
+
+#include <opencv2/core/core.hpp>
+#include "lens.h"
+#include "screen_io.h"
+
+using cv::Mat;
+using cv::Vec3b;
+
+/**
+ * @brief Class for OpenCV parallelization: Render the image produced by the lens on the given screen for the given source
+ * (and the source plane view, if shown, within the same loop)
+ */
+class Parallel_renderer : public cv::ParallelLoopBody
+{
+	private:
+		screenT *screen;
+		bool recompute_lensed;
+
+		/**
+		 * Render rows of the image plane. The row loop is compiled once per instruction set 
+		 * (render_rows_sse42 etc., see cpu_dispatch.h) and per deflection storage format 
+		 * (render_rows_as), which is selected once per call.
+		 * @param first First row
+		 * @param last Last row (exclusive)
+		 */
+		void render_rows(int first, int last) const;
+		template <deflection_formatT format>
+		void render_rows_as(int first, int last) const;
+		void render_rows_sse42(int first, int last) const;
+		void render_rows_avx2(int first, int last) const;
+		void render_rows_avx512(int first, int last) const;
+	public:
+		/**
+		 * Constructor
+		 * @param std_screen Screen object referred to
+		 * @param mode Drawing mode: Re-draw whole image? (rather than re-drawing only the overlays)
+		 */
+		Parallel_renderer(screenT *std_screen, bool mode);
+
+		/**
+		 * Render the given range of rows. Rows beyond the render height belong to the source plane view.
+		 * @param range Range of rows
+		 */
+		virtual void operator()(const cv::Range &range) const;
+
+		/**
+		 * Render a row of the source plane view (unlensed source + caustics)
+		 * @param i Row of the render buffer
+		 */
+		void render_source_plane_row(int i) const;
+};
+
+
+#endif
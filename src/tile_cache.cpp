@@ -0,0 +1,379 @@
+#include <iostream> // std::cout
+#include <fstream> // std::ifstream
+#include <cmath> // floor
+#include <algorithm> // std::min, std::max
+#include <opencv2/core/core.hpp>
+
+#include "tile_cache.h"
+
+using std::vector;
+
+
+// ---- tile_cacheT class members: ----
+
+// Read the header of the PPM file
+tile_cacheT::tile_cacheT(const std::string &filename_, size_t max_bytes_) : filename(filename_), max_bytes(max_bytes_)
+{
+	std::ifstream infile(filename, std::ios::binary);
+	std::string magic;
+	int maxval = 0;
+	infile >> magic;
+
+	// Width, height and max. value, each possibly preceded by comment lines
+	int *fields[] = {&cols, &rows, &maxval};
+	for (int n = 0; n < 3 and infile.good(); ++n)
+	{
+		infile >> std::ws;
+		while (infile.peek() == '#')
+		{
+			std::string comment;
+			std::getline(infile, comment);
+			infile >> std::ws;
+		}
+		infile >> *fields[n];
+	}
+	infile.get(); // Single whitespace character before the pixel data
+	data_offset = static_cast<long>(infile.tellg());
+
+	ok = infile.good() and magic == "P6" and cols > 0 and rows > 0 and maxval == 255;
+	if (!ok)
+	{
+		std::cout << "Error: " << filename << " is not a binary 8 bit PPM file" << std::endl;
+		return;
+	}
+
+	// Levels of detail down to the first one that fits into a single tile
+	int tile = 1 << tile_shift;
+	level_offset.push_back(0);
+	do
+	{
+		int l = n_levels++;
+		level_cols.push_back((cols + (1 << l) - 1) >> l);
+		level_rows.push_back((rows + (1 << l) - 1) >> l);
+		level_tiles_x.push_back((level_cols[l] + tile - 1) / tile);
+		level_offset.push_back(level_offset[l] + level_tiles_x[l] * ((level_rows[l] + tile - 1) / tile));
+	}
+	while (level_cols.back() > tile or level_rows.back() > tile);
+	table.resize(level_offset.back());
+	lru_pos.resize(table.size(), lru.end());
+	std::cout << "-> Opened " << cols << "x" << rows << " source as " << level_offset[1] << " tiles (" 
+		<< n_levels << " levels of detail), cache limit " << max_bytes / (1024.*1024.) << " MB" << std::endl;
+}
+
+// Stop the background thread
+tile_cacheT::~tile_cacheT()
+{
+	{
+		std::lock_guard<std::mutex> lock(staging_mutex);
+		prefetch_stop = true;
+	}
+	prefetch_cond.notify_all();
+	if (prefetcher.joinable())
+		prefetcher.join();
+}
+
+bool tile_cacheT::is_open()
+{
+	return ok;
+}
+
+int tile_cacheT::get_width(int level)
+{
+	return level_cols.empty() ? cols : level_cols[level];
+}
+
+int tile_cacheT::get_height(int level)
+{
+	return level_rows.empty() ? rows : level_rows[level];
+}
+
+int tile_cacheT::get_levels()
+{
+	return n_levels;
+}
+
+// Get the level of detail and the geometry of a tile
+int tile_cacheT::tile_geometry(int id, int &x0, int &y0, int &tw, int &th)
+{
+	int level = 0;
+	while (id >= level_offset[level+1])
+		++level;
+	int local = id - level_offset[level];
+	int tile_size = 1 << tile_shift;
+	x0 = (local % level_tiles_x[level]) * tile_size;
+	y0 = (local / level_tiles_x[level]) * tile_size;
+	tw = std::min(tile_size, level_cols[level] - x0);
+	th = std::min(tile_size, level_rows[level] - y0);
+	return level;
+}
+
+// Decode a single tile from the file
+bool tile_cacheT::decode(int id, Mat &tile)
+{
+	int x0, y0, tw, th;
+	int level = tile_geometry(id, x0, y0, tw, th);
+	int f = 1 << level;
+
+	// Each call opens its own stream, so tiles can be decoded concurrently
+	std::ifstream infile(filename, std::ios::binary);
+	tile.create(th, tw, CV_8UC3);
+	if (level == 0)
+		for (int i = 0; i < th; ++i)
+		{
+			infile.seekg(data_offset + 3 * (static_cast<long>(y0 + i) * cols + x0));
+			infile.read(tile.ptr<char>(i), 3 * tw);
+		}
+	else
+	{
+		// Average blocks of f x f full resolution pixels (fewer at the right and bottom edges of the image)
+		int full_x0 = x0 * f;
+		int full_w = std::min(tw * f, cols - full_x0);
+		vector<unsigned char> line(3 * full_w);
+		vector<size_t> sum(3 * tw);
+		for (int i = 0; i < th; ++i)
+		{
+			int full_y0 = (y0 + i) * f;
+			int n_lines = std::min(f, rows - full_y0);
+			std::fill(sum.begin(), sum.end(), 0);
+			for (int y = full_y0; y < full_y0 + n_lines; ++y)
+			{
+				infile.seekg(data_offset + 3 * (static_cast<long>(y) * cols + full_x0));
+				infile.read(reinterpret_cast<char*>(line.data()), line.size());
+				for (int x = 0; x < full_w; ++x)
+					for (int c = 0; c < 3; ++c)
+						sum[3 * (x >> level) + c] += line[3 * x + c];
+			}
+			unsigned char *out = tile.ptr<unsigned char>(i);
+			for (int j = 0; j < tw; ++j)
+			{
+				size_t n = static_cast<size_t>(n_lines) * std::min(f, full_w - j * f);
+				for (int c = 0; c < 3; ++c)
+					out[3 * j + c] = (sum[3 * j + c] + n / 2) / n;
+			}
+		}
+	}
+
+	// PPM stores RGB, OpenCV uses BGR
+	for (int i = 0; i < th; ++i)
+		for (int j = 0; j < tw; ++j)
+			std::swap(tile.at<cv::Vec3b>(i,j)[0], tile.at<cv::Vec3b>(i,j)[2]);
+	return infile.good();
+}
+
+// Collect the ids of all tiles of a level overlapping a rectangle of source pixels
+void tile_cacheT::tiles_in(int level, double x_min, double y_min, double x_max, double y_max, vector<int> &ids)
+{
+	ids.clear();
+
+	// Include the neighbors needed for interpolating within the level (pixels of 2^level px)
+	double margin = 1 << level;
+	x_min -= margin;
+	y_min -= margin;
+	x_max += margin;
+	y_max += margin;
+	int shift = tile_shift + level;
+	int n_y = (level_offset[level+1] - level_offset[level]) / level_tiles_x[level];
+	int t_min[2] = {std::max(0, static_cast<int>(floor(x_min)) >> shift), 
+		std::max(0, static_cast<int>(floor(y_min)) >> shift)};
+	int t_max[2] = {std::min(level_tiles_x[level] - 1, static_cast<int>(floor(x_max)) >> shift), 
+		std::min(n_y - 1, static_cast<int>(floor(y_max)) >> shift)};
+	for (int ti = t_min[1]; ti <= t_max[1]; ++ti)
+		for (int tj = t_min[0]; tj <= t_max[0]; ++tj)
+			ids.push_back(level_offset[level] + ti * level_tiles_x[level] + tj);
+}
+
+// Insert a decoded tile into the table and mark it as most recently used
+void tile_cacheT::insert(int id, const Mat &tile)
+{
+	if (table[id].empty())
+	{
+		table[id] = tile;
+		used_bytes += tile.total() * tile.elemSize();
+	}
+	if (lru_pos[id] != lru.end())
+		lru.erase(lru_pos[id]);
+	lru.push_front(id);
+	lru_pos[id] = lru.begin();
+}
+
+// Make all tiles within a rectangle of source pixels available for the next frame and pin them
+int tile_cacheT::prepare(const void *owner, int level, double x_min, double y_min, double x_max, double y_max)
+{
+	pinned.erase(owner);
+	level = std::max(0, std::min(level, n_levels - 1));
+	if (!ok or x_max < 0 or y_max < 0 or x_min >= cols or y_min >= rows)
+		return level;
+
+	// Take over the prefetched tiles
+	{
+		std::lock_guard<std::mutex> lock(staging_mutex);
+		for (auto &entry : staging)
+			insert(entry.first, entry.second);
+		staging.clear();
+		staged_bytes = 0;
+	}
+
+	// Memory of the tiles pinned by the other owners
+	vector<unsigned char> is_pinned(table.size(), 0);
+	size_t pinned_bytes = 0;
+	for (auto &entry : pinned)
+		for (int id : entry.second)
+			if (!is_pinned[id])
+			{
+				is_pinned[id] = 1;
+				pinned_bytes += table[id].total() * table[id].elemSize();
+			}
+
+	// Use coarser levels until the tiles of this frame fit into the memory cap along with the pinned ones
+	vector<int> ids;
+	size_t frame_bytes;
+	while (true)
+	{
+		tiles_in(level, x_min, y_min, x_max, y_max, ids);
+		frame_bytes = 0;
+		for (int id : ids)
+		{
+			int x0, y0, tw, th;
+			tile_geometry(id, x0, y0, tw, th);
+			if (!is_pinned[id])
+				frame_bytes += 3 * static_cast<size_t>(tw) * th;
+		}
+		if (pinned_bytes + frame_bytes <= max_bytes or level + 1 >= n_levels)
+			break;
+		++level;
+	}
+	if (pinned_bytes + frame_bytes > max_bytes and !cap_exceeded)
+		std::cout << "Warning: the source tiles needed for a frame exceed the cache limit of " 
+			<< max_bytes / (1024.*1024.) << " MB" << std::endl;
+	cap_exceeded = pinned_bytes + frame_bytes > max_bytes;
+
+	// Decode the missing tiles of this frame in parallel, then mark all of them as recently used
+	vector<int> missing;
+	for (int id : ids)
+		if (table[id].empty())
+			missing.push_back(id);
+	vector<Mat> tiles(missing.size());
+	vector<unsigned char> decoded(missing.size(), 0);
+	cv::parallel_for_(cv::Range(0, static_cast<int>(missing.size())), 
+			Parallel_tile_decoder(this, missing, tiles, decoded));
+	int n_failed = 0;
+	for (size_t n = 0; n < missing.size(); ++n)
+		if (decoded[n])
+			insert(missing[n], tiles[n]);
+		else
+			++n_failed;
+	if (n_failed > 0)
+		std::cout << "Error reading " << n_failed << " tiles of " << filename << " (shown black)" << std::endl;
+	for (int id : ids)
+		if (!table[id].empty())
+			insert(id, table[id]);
+	pinned[owner] = ids;
+	for (int id : ids)
+		is_pinned[id] = 1;
+
+	// Evict the least recently used tiles beyond the memory cap (but none of the pinned ones)
+	auto it = lru.end();
+	while (used_bytes > max_bytes and it != lru.begin())
+	{
+		int id = *(--it);
+		if (is_pinned[id])
+			continue;
+		it = lru.erase(it);
+		lru_pos[id] = lru.end();
+		used_bytes -= table[id].total() * table[id].elemSize();
+		table[id].release();
+	}
+	return level;
+}
+
+// Unpin the tiles of an owner
+void tile_cacheT::release(const void *owner)
+{
+	pinned.erase(owner);
+}
+
+// Decode the tiles within a rectangle on the background thread
+void tile_cacheT::prefetch(int level, double x_min, double y_min, double x_max, double y_max)
+{
+	if (!ok)
+		return;
+	level = std::max(0, std::min(level, n_levels - 1));
+
+	// The table is only modified by prepare(), which runs on this thread
+	vector<int> ids, missing;
+	tiles_in(level, x_min, y_min, x_max, y_max, ids);
+	for (int id : ids)
+		if (table[id].empty())
+			missing.push_back(id);
+	if (missing.empty())
+		return;
+
+	// Replace a request that has not been started yet (the running one is not interrupted)
+	{
+		std::lock_guard<std::mutex> lock(staging_mutex);
+		prefetch_request.swap(missing);
+		if (!prefetcher.joinable())
+			prefetcher = std::thread(&tile_cacheT::prefetch_loop, this);
+	}
+	prefetch_cond.notify_one();
+}
+
+// Decode the latest prefetch request until the cache is destroyed
+void tile_cacheT::prefetch_loop()
+{
+	while (true)
+	{
+		vector<int> ids;
+		{
+			std::unique_lock<std::mutex> lock(staging_mutex);
+			prefetch_cond.wait(lock, [this]{ return prefetch_stop or !prefetch_request.empty(); });
+			if (prefetch_stop)
+				return;
+			ids.swap(prefetch_request);
+		}
+
+		// Stage at most as many tiles as the cache may hold (failed tiles are retried by prepare)
+		for (int id : ids)
+		{
+			{
+				std::lock_guard<std::mutex> lock(staging_mutex);
+				if (prefetch_stop or staged_bytes >= max_bytes)
+					break;
+				if (staging.count(id))
+					continue;
+			}
+			Mat tile;
+			if (!decode(id, tile))
+				continue;
+			std::lock_guard<std::mutex> lock(staging_mutex);
+			staged_bytes += tile.total() * tile.elemSize();
+			staging[id] = tile;
+		}
+	}
+}
+
+// Get a pixel (black if its tile was not prepared)
+cv::Vec3b tile_cacheT::pixel(int level, int x, int y) const
+{
+	const Mat &tile = table[level_offset[level] + (y >> tile_shift) * level_tiles_x[level] + (x >> tile_shift)];
+	const int mask = (1 << tile_shift) - 1;
+	return tile.empty() ? cv::Vec3b(0, 0, 0) : tile.at<cv::Vec3b>(y & mask, x & mask);
+}
+
+
+/**
+ * Parallel_tile_decoder Constructor
+ * @param[in] cache_ Tile cache whose file is read
+ * @param[in] ids_ Ids of the tiles to decode
+ * @param[out] tiles_ Decoded tiles (needs to have the size of ids_)
+ * @param[out] decoded_ Whether each tile could be read (needs to have the size of ids_)
+ */
+Parallel_tile_decoder::Parallel_tile_decoder(tile_cacheT *cache_, const vector<int> &ids_, vector<Mat> &tiles_,
+		vector<unsigned char> &decoded_)
+	: cache(cache_), ids(ids_), tiles(tiles_), decoded(decoded_) {}
+
+void Parallel_tile_decoder::operator()(const cv::Range &range) const
+{
+	for (int n = range.start; n < range.end; ++n)
+		decoded[n] = cache->decode(ids[n], tiles[n]);
+}
@@ -0,0 +1,207 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <opencv2/core/core.hpp>
+
+using cv::Mat;
+
+/**
+ * @brief Source image backed by a binary PPM file (P6, 8 bit), decoded in square tiles on demand
+ *
+ * @details The image is available at several levels of detail: level l is the image downsampled by
+ * 2^l (box filter), so that sources shown at a reduced size are sampled without aliasing and with
+ * proportionally fewer tiles. Before each frame, prepare() loads all tiles within the area the frame
+ * can sample (in parallel), pins them for the caller and evicts the least recently used unpinned
+ * tiles beyond the memory cap. During the frame, the tile table is only read, so the renderers can
+ * access it without locking. prefetch() hands the tiles of an expected later footprint to a
+ * background thread; they are taken over by the next prepare().
+ */
+class tile_cacheT
+{
+	private:
+		// File layout
+		std::string filename;
+		long data_offset = 0;
+		int cols = 0, rows = 0;
+		bool ok = false;
+
+		/**
+		 * Tiles of 2^tile_shift x 2^tile_shift px (CV_8UC3, BGR) of all levels of detail in one
+		 * table: the tiles of level l are indexed row-major, starting at level_offset[l]
+		 */
+		static const int tile_shift = 8;
+		int n_levels = 0;
+		std::vector<int> level_offset;
+		std::vector<int> level_cols, level_rows, level_tiles_x;
+		std::vector<Mat> table;
+		size_t max_bytes;
+		size_t used_bytes = 0;
+
+		// Least recently used order of the loaded tiles (front: most recent)
+		std::list<int> lru;
+		std::vector<std::list<int>::iterator> lru_pos;
+
+		// Tiles each owner needs for its current frame (never evicted, see prepare and release)
+		std::map<const void*, std::vector<int>> pinned;
+		bool cap_exceeded = false;
+
+		/**
+		 * Background decoding: the prefetch thread takes the latest request (a newer request
+		 * replaces one that has not been started yet) and stages the decoded tiles until they
+		 * are taken over
+		 */
+		std::thread prefetcher;
+		std::mutex staging_mutex;
+		std::condition_variable prefetch_cond;
+		std::vector<int> prefetch_request;
+		bool prefetch_stop = false;
+		std::map<int, Mat> staging;
+		size_t staged_bytes = 0;
+
+		/**
+		 * Collect the ids of all tiles of a level overlapping a rectangle of source pixels
+		 * @param[in] level Level of detail
+		 * @param[in] x_min, y_min, x_max, y_max Bounds in pixels of the full resolution image
+		 * (inclusive, clipped to the image)
+		 * @param[out] ids Tile ids
+		 */
+		void tiles_in(int level, double x_min, double y_min, double x_max, double y_max, std::vector<int> &ids);
+
+		/**
+		 * Get the level of detail and the geometry of a tile
+		 * @param[in] id Tile id
+		 * @param[out] x0, y0 Position of the tile within its level (px)
+		 * @param[out] tw, th Size of the tile (px, smaller at the right and bottom edges)
+		 * @return Level of detail
+		 */
+		int tile_geometry(int id, int &x0, int &y0, int &tw, int &th);
+
+		/**
+		 * Insert a decoded tile into the table and mark it as most recently used
+		 * @param id Tile id
+		 * @param tile Decoded tile
+		 */
+		void insert(int id, const Mat &tile);
+
+		/**
+		 * Decode the latest prefetch request until the cache is destroyed (background thread)
+		 */
+		void prefetch_loop();
+
+	public:
+		/**
+		 * Constructor: Read the header of the PPM file (the pixel data is read on demand)
+		 * @param filename_ Name of the binary PPM file
+		 * @param max_bytes_ Memory cap of the decoded tiles
+		 */
+		tile_cacheT(const std::string &filename_, size_t max_bytes_);
+
+		/**
+		 * Destructor: Stop the background thread
+		 */
+		~tile_cacheT();
+
+		/**
+		 * Check whether the file header could be read
+		 * @return Whether the file is usable
+		 */
+		bool is_open();
+
+		/**
+		 * Get width of the image at a level of detail
+		 * @param level Level of detail (0: full resolution)
+		 * @return Width in px
+		 */
+		int get_width(int level = 0);
+
+		/**
+		 * Get height of the image at a level of detail
+		 * @param level Level of detail (0: full resolution)
+		 * @return Height in px
+		 */
+		int get_height(int level = 0);
+
+		/**
+		 * Get the number of levels of detail (the coarsest one fits into a single tile)
+		 * @return Number of levels
+		 */
+		int get_levels();
+
+		/**
+		 * Decode a single tile from the file (tiles of coarser levels are averaged over 2^l x 2^l
+		 * pixels while reading)
+		 * @param[in] id Tile id
+		 * @param[out] tile Tile image (CV_8UC3, BGR; smaller at the right and bottom edges)
+		 * @return Whether the tile could be read
+		 */
+		bool decode(int id, Mat &tile);
+
+		/**
+		 * Make all tiles within a rectangle of source pixels available for the next frame and pin
+		 * them for the given owner (replacing the tiles it pinned before). If these tiles and the
+		 * ones pinned by other owners do not fit into the memory cap, a coarser level is used.
+		 * @param owner Owner of the pins (e.g. the source object)
+		 * @param level Preferred level of detail
+		 * @param x_min, y_min, x_max, y_max Bounds in pixels of the full resolution image
+		 * (inclusive, clipped to the image)
+		 * @return Level of detail that was made available
+		 */
+		int prepare(const void *owner, int level, double x_min, double y_min, double x_max, double y_max);
+
+		/**
+		 * Unpin the tiles of an owner (they stay cached until they are evicted)
+		 * @param owner Owner of the pins
+		 */
+		void release(const void *owner);
+
+		/**
+		 * Decode the tiles within a rectangle on the background thread (tiles already loaded are
+		 * skipped). Does not wait for a running prefetch.
+		 * @param level Level of detail
+		 * @param x_min, y_min, x_max, y_max Bounds in pixels of the full resolution image
+		 * (inclusive, clipped to the image)
+		 */
+		void prefetch(int level, double x_min, double y_min, double x_max, double y_max);
+
+		/**
+		 * Get a pixel (has to lie within the image; black if its tile was not prepared)
+		 * @param level Level of detail
+		 * @param x X-coordinate within the level
+		 * @param y Y-coordinate within the level
+		 * @return BGR value
+		 */
+		cv::Vec3b pixel(int level, int x, int y) const;
+};
+
+/**
+ * @brief Class for OpenCV parallelization: Decode tiles of a tile cache from its file
+ */
+class Parallel_tile_decoder : public cv::ParallelLoopBody
+{
+	private:
+		tile_cacheT *cache;
+		const std::vector<int> &ids;
+		std::vector<Mat> &tiles;
+		std::vector<unsigned char> &decoded;
+	public:
+		/**
+		 * Constructor
+		 * @param[in] cache_ Tile cache whose file is read
+		 * @param[in] ids_ Ids of the tiles to decode
+		 * @param[out] tiles_ Decoded tiles (needs to have the size of ids_)
+		 * @param[out] decoded_ Whether each tile could be read (needs to have the size of ids_)
+		 */
+		Parallel_tile_decoder(tile_cacheT *cache_, const std::vector<int> &ids_, std::vector<Mat> &tiles_,
+				std::vector<unsigned char> &decoded_);
+
+		virtual void operator()(const cv::Range &range) const;
+};
+
+#endif
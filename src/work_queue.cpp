@@ -0,0 +1,229 @@
+#include <iostream> // std::cout
+#include <fstream> // std::ofstream, std::ifstream
+#include <algorithm> // std::max
+#include <chrono>
+#include <cerrno>
+#include <ctime> // time, difftime
+#include <fcntl.h> // open
+#include <unistd.h> // close, unlink, link, gethostname, getpid
+#include <utime.h> // utime
+#include <sys/stat.h> // stat, mkdir
+
+#include "work_queue.h"
+
+/**
+ * Read the owner written into a lock file
+ * @param filename Name of the lock file
+ * @return Owner (empty if the file cannot be read)
+ */
+static std::string read_owner(const std::string &filename)
+{
+	std::ifstream infile(filename);
+	std::string owner;
+	std::getline(infile, owner);
+	return owner;
+}
+
+/**
+ * Read the owner and the time of the last heartbeat of a lock file
+ * @param[in] filename Name of the lock file
+ * @param[out] owner Owner written into the lock
+ * @param[out] heartbeat Modification time of the lock
+ * @return Whether the lock exists (errno is set otherwise)
+ */
+static bool read_lock(const std::string &filename, std::string &owner, time_t &heartbeat)
+{
+	struct stat info;
+	if (stat(filename.c_str(), &info) != 0)
+		return false;
+	heartbeat = info.st_mtime;
+	owner = read_owner(filename);
+	return true;
+}
+
+/**
+ * Constructor: Create the queue directory if needed and start the heartbeat thread
+ * @param dir_ Queue directory (on a filesystem shared by all workers)
+ * @param stale_timeout_ Seconds after which the lock of an unresponsive worker is taken over
+ */
+work_queueT::work_queueT(const std::string &dir_, double stale_timeout_)
+	: dir(dir_), stale_timeout(std::max(stale_timeout_, 1.))
+{
+	mkdir(dir.c_str(), 0777);
+
+	char host[256] = "";
+	gethostname(host, sizeof(host) - 1);
+	owner = std::string(host) + ":" + std::to_string(getpid());
+
+	// Refresh the lock of the held task several times per stale timeout
+	heartbeat = std::thread([this]
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		auto interval = std::chrono::duration<double>(stale_timeout / 4.);
+		while (!wake.wait_for(lock, interval, [this]{ return stop; }))
+		{
+			// (A lock that has been taken over belongs to the other worker now and is left alone)
+			std::string lock_fn = held.empty() ? "" : path(held, ".lock");
+			if (!held.empty() and read_owner(lock_fn) == owner)
+				utime(lock_fn.c_str(), nullptr);
+		}
+	});
+}
+
+// Destructor: Stop the heartbeat thread
+work_queueT::~work_queueT()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	wake.notify_all();
+	heartbeat.join();
+}
+
+std::string work_queueT::path(const std::string &task, const char *suffix)
+{
+	return dir + "/" + task + suffix;
+}
+
+bool work_queueT::is_valid()
+{
+	struct stat info;
+	return stat(dir.c_str(), &info) == 0 and S_ISDIR(info.st_mode) and access(dir.c_str(), W_OK) == 0;
+}
+
+const std::string &work_queueT::get_owner()
+{
+	return owner;
+}
+
+bool work_queueT::is_done(const std::string &task)
+{
+	struct stat info;
+	return stat(path(task, ".done").c_str(), &info) == 0;
+}
+
+// Take over the lock of a task if it is stale
+bool work_queueT::remove_stale_lock(const std::string &task)
+{
+	// (Lock times are set by the file server and compared to the local clock, so the timeout has to
+	// exceed the clock skew between the nodes by far)
+	std::string lock_fn = path(task, ".lock");
+	std::string stale_owner;
+	time_t stale_heartbeat;
+	if (!read_lock(lock_fn, stale_owner, stale_heartbeat))
+		return errno == ENOENT;
+	double age = difftime(time(nullptr), stale_heartbeat);
+	if (age < stale_timeout)
+		return false;
+
+	// Only one worker can rename the lock away
+	std::string moved = lock_fn + ".stale." + owner;
+	if (rename(lock_fn.c_str(), moved.c_str()) != 0)
+		return false;
+
+	/**
+	 * If the lock has been refreshed or replaced since the check (inodes may be reused, so owner and 
+	 * heartbeat are compared), it belongs to a live worker: put it back
+	 */
+	std::string moved_owner;
+	time_t moved_heartbeat;
+	if (!read_lock(moved, moved_owner, moved_heartbeat) or moved_owner != stale_owner 
+			or moved_heartbeat != stale_heartbeat)
+	{
+		if (link(moved.c_str(), lock_fn.c_str()) != 0)
+			std::cout << "-> Could not restore the lock of task " << task << std::endl;
+		unlink(moved.c_str());
+		return false;
+	}
+
+	std::cout << "-> Taking over task " << task << " (lock of " << stale_owner << " not refreshed for ";
+	std::cout << age << " s)" << std::endl;
+	unlink(moved.c_str());
+	return true;
+}
+
+// Claim a task
+bool work_queueT::claim(const std::string &task)
+{
+	if (is_done(task))
+		return false;
+
+	std::string lock_fn = path(task, ".lock");
+	int fd = open(lock_fn.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (fd < 0 and errno == EEXIST and remove_stale_lock(task))
+		fd = open(lock_fn.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+	if (fd < 0)
+		return false;
+	std::string line = owner + "\n";
+	bool written = write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size());
+	close(fd);
+
+	// The task may have been completed by another worker between the check and the lock
+	if (!written or is_done(task))
+	{
+		if (read_owner(lock_fn) == owner)
+			unlink(lock_fn.c_str());
+		return false;
+	}
+
+	// A worker taking over a stale lock at the same time may have moved this one away
+	if (read_owner(lock_fn) != owner)
+		return false;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	held = task;
+	return true;
+}
+
+// Mark the held task as done and release its lock
+bool work_queueT::complete(const std::string &info)
+{
+	std::string task;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		task = held;
+	}
+	if (task.empty())
+		return false;
+
+	// A task that has been taken over (e.g. after this worker stalled) is completed by its new owner
+	std::string current_owner = read_owner(path(task, ".lock"));
+	if (current_owner != owner)
+	{
+		std::cout << "-> Task " << task << " has been taken over" << (current_owner.empty() ? "" : " by " + current_owner) 
+			<< std::endl;
+		release();
+		return false;
+	}
+
+	// Write the marker under a temporary name, so it only appears complete
+	std::string done_fn = path(task, ".done");
+	std::string tmp_fn = done_fn + ".tmp." + owner;
+	std::ofstream outfile(tmp_fn);
+	outfile << owner << " " << info << std::endl;
+	outfile.close();
+	bool ok = !outfile.fail() and rename(tmp_fn.c_str(), done_fn.c_str()) == 0;
+	if (!ok)
+	{
+		std::cout << "Error writing " << done_fn << std::endl;
+		unlink(tmp_fn.c_str());
+	}
+
+	release();
+	return ok;
+}
+
+// Release the held task without marking it as done
+void work_queueT::release()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (held.empty())
+		return;
+
+	// Leave the lock alone if it has been taken over in the meantime
+	std::string lock_fn = path(held, ".lock");
+	if (read_owner(lock_fn) == owner)
+		unlink(lock_fn.c_str());
+	held.clear();
+}
@@ -0,0 +1,104 @@
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <string>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+/**
+ * @brief Work queue of named tasks in a directory on a shared filesystem, pulled by any number of
+ * worker processes on any number of nodes (no service needed besides the filesystem)
+ *
+ * @details A worker claims a task by creating "<task>.lock" exclusively (O_CREAT|O_EXCL), and
+ * finishes it by renaming a completed "<task>.done" marker into place before removing the lock.
+ * While a task is held, a background thread refreshes the modification time of its lock; a lock
+ * that has not been refreshed for the stale timeout (e.g. of a crashed worker or node) is taken
+ * over by renaming it away, which only one worker can do (it is put back if its owner or heartbeat
+ * changed in the meantime). Workers check that they still own their lock before refreshing it and
+ * before marking the task as done, so a task is completed once even if a stalled worker resumes.
+ * Since a reclaimed task is run again from the start, tasks have to be idempotent (like rendering
+ * frames to fixed filenames).
+ */
+class work_queueT
+{
+	private:
+		std::string dir;
+		double stale_timeout;	// Seconds after which an unrefreshed lock is taken over
+		std::string owner;	// Identification of this worker (host:pid), written into the locks
+
+		// Task currently held by this worker and the thread refreshing its lock
+		std::string held;
+		std::thread heartbeat;
+		std::mutex mutex;
+		std::condition_variable wake;
+		bool stop = false;
+
+		/**
+		 * Get the path of a file of a task
+		 * @param task Task name
+		 * @param suffix File suffix (".lock" or ".done")
+		 * @return Path
+		 */
+		std::string path(const std::string &task, const char *suffix);
+
+		/**
+		 * Take over the lock of a task if it is stale
+		 * @param task Task name
+		 * @return Whether a stale lock was removed
+		 */
+		bool remove_stale_lock(const std::string &task);
+
+	public:
+		/**
+		 * Constructor: Create the queue directory if needed and start the heartbeat thread
+		 * @param dir_ Queue directory (on a filesystem shared by all workers)
+		 * @param stale_timeout_ Seconds after which the lock of an unresponsive worker is taken over
+		 */
+		work_queueT(const std::string &dir_, double stale_timeout_ = 600.);
+
+		/**
+		 * Destructor: Stop the heartbeat thread (a task still held stays locked until it is stale)
+		 */
+		~work_queueT();
+
+		/**
+		 * Check whether the queue directory is usable
+		 * @return Whether tasks can be claimed
+		 */
+		bool is_valid();
+
+		/**
+		 * Get the identification of this worker
+		 * @return host:pid
+		 */
+		const std::string &get_owner();
+
+		/**
+		 * Claim a task (one at a time per worker)
+		 * @param task Task name (used as filename)
+		 * @return Whether this worker now holds the task (false if it is done or held by another worker)
+		 */
+		bool claim(const std::string &task);
+
+		/**
+		 * Mark the held task as done and release its lock
+		 * @param info Line written into the done marker (e.g. a summary of the results)
+		 * @return Whether the done marker could be written (false if the task has been taken over)
+		 */
+		bool complete(const std::string &info);
+
+		/**
+		 * Release the held task without marking it as done (it can be claimed again right away)
+		 */
+		void release();
+
+		/**
+		 * Check whether a task is done
+		 * @param task Task name
+		 * @return Whether its done marker exists
+		 */
+		bool is_done(const std::string &task);
+};
+
+#endif
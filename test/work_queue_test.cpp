@@ -0,0 +1,235 @@
+/**
+ *
+ * quicklens - a fast gravitational lensing visualization tool
+ *
+ * work_queue_test.cpp: Crash test of the shared work queue. Several worker processes pull tasks from
+ * a temporary queue directory like the sweep workers pull shards; one of them is killed while it
+ * holds a task. Every task has to be completed exactly once, the task of the killed worker by
+ * another worker after its lock became stale.
+ *
+ **/
+
+#include <iostream>	// std::cout
+#include <fstream>	// std::ifstream
+#include <sstream>	// std::ostringstream
+#include <iomanip>	// std::setw
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <thread>
+#include <algorithm>	// std::max
+#include <cstdlib>	// std::strtol, std::strtod
+#include <csignal>	// kill, SIGKILL
+#include <fcntl.h>	// open
+#include <unistd.h>	// fork, pause, write, unlink, rmdir, _exit
+#include <dirent.h>	// opendir, readdir
+#include <sys/wait.h>	// waitpid
+
+#include "work_queue.h"
+
+/**
+ * @brief Settings of the test run
+ */
+struct testT
+{
+	int workers = 4;	// Number of worker processes
+	int tasks = 32;		// Number of tasks
+	int task_ms = 50;	// Duration of a task
+	double stale = 2.;	// Stale timeout of the locks (s)
+	std::string dir;	// Queue directory
+};
+
+/**
+ * Get the name of a task
+ * @param n Task index
+ * @return Name
+ */
+static std::string task_name(int n)
+{
+	std::ostringstream task;
+	task << "task_" << std::setw(5) << std::setfill('0') << n;
+	return task.str();
+}
+
+/**
+ * Append a line to a file of the queue directory (a single write, so lines of several processes do
+ * not interleave)
+ * @param test Settings
+ * @param filename Name of the file within the queue directory
+ * @param line Line to append
+ */
+static void append_line(const testT &test, const char *filename, const std::string &line)
+{
+	int fd = open((test.dir + "/" + filename).c_str(), O_CREAT | O_APPEND | O_WRONLY, 0644);
+	if (fd < 0)
+		return;
+	std::string text = line + "\n";
+	if (write(fd, text.data(), text.size()) != static_cast<ssize_t>(text.size()))
+		std::cout << "Error writing " << filename << std::endl;
+	close(fd);
+}
+
+/**
+ * Pull tasks until all are done (as run_sweep_worker). The victim announces its second task in
+ * "victim" and then stalls until it is killed.
+ * @param test Settings
+ * @param victim Whether this worker is the one to be killed
+ */
+static void run_worker(const testT &test, bool victim)
+{
+	work_queueT queue(test.dir, test.stale);
+	std::string me = std::to_string(getpid());
+	int n_claimed = 0;
+	while (true)
+	{
+		int n_open = 0;
+		bool claimed = false;
+		for (int n = 0; n < test.tasks; ++n)
+		{
+			std::string task = task_name(n);
+			if (queue.is_done(task))
+				continue;
+			++n_open;
+			if (!queue.claim(task))
+				continue;
+
+			claimed = true;
+			if (victim and ++n_claimed == 2)
+			{
+				append_line(test, "victim", task);
+				while (true)
+					pause();
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(test.task_ms));
+			if (queue.complete("test"))
+				append_line(test, "completed", task + " " + me);
+			else
+				queue.release();
+			--n_open;
+		}
+		if (n_open == 0)
+			break;
+		if (!claimed)
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+}
+
+/**
+ * Remove the queue directory and its files
+ * @param dir Directory
+ */
+static void remove_dir(const std::string &dir)
+{
+	DIR *d = opendir(dir.c_str());
+	if (!d)
+		return;
+	while (dirent *entry = readdir(d))
+	{
+		std::string name = entry->d_name;
+		if (name != "." and name != "..")
+			unlink((dir + "/" + name).c_str());
+	}
+	closedir(d);
+	rmdir(dir.c_str());
+}
+
+int main(int argc, char** argv)
+{
+	using std::cout;
+	using std::endl;
+
+	testT test;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string value = (eq == std::string::npos) ? "" : arg.substr(eq+1);
+		if (arg.compare(0, 10, "--workers=") == 0)
+			test.workers = std::max(2, static_cast<int>(std::strtol(value.c_str(), nullptr, 0)));
+		else if (arg.compare(0, 8, "--tasks=") == 0)
+			test.tasks = std::max(2, static_cast<int>(std::strtol(value.c_str(), nullptr, 0)));
+		else if (arg.compare(0, 10, "--task-ms=") == 0)
+			test.task_ms = std::max(0, static_cast<int>(std::strtol(value.c_str(), nullptr, 0)));
+		else if (arg.compare(0, 8, "--stale=") == 0)
+			test.stale = std::strtod(value.c_str(), nullptr);
+		else
+		{
+			cout << "Usage: work_queue_test [--workers=N] [--tasks=N] [--task-ms=MS] [--stale=SECONDS]" << endl;
+			return -1;
+		}
+	}
+
+	char dir_template[] = "/tmp/quicklens_queue_XXXXXX";
+	if (!mkdtemp(dir_template))
+	{
+		cout << "Error creating a temporary directory" << endl;
+		return -1;
+	}
+	test.dir = dir_template;
+	cout << test.workers << " workers, " << test.tasks << " tasks of " << test.task_ms << " ms, stale timeout ";
+	cout << test.stale << " s, queue " << test.dir << endl;
+
+	// Start the workers (the first one is the victim)
+	std::vector<pid_t> pids;
+	for (int k = 0; k < test.workers; ++k)
+	{
+		cout.flush();
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			run_worker(test, k == 0);
+			cout.flush();
+			_exit(0);
+		}
+		pids.push_back(pid);
+	}
+
+	// Kill the victim once it holds its second task
+	std::string victim_task;
+	for (int n = 0; n < 600 and victim_task.empty(); ++n)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		std::ifstream infile(test.dir + "/victim");
+		std::getline(infile, victim_task);
+	}
+	kill(pids[0], SIGKILL);
+	waitpid(pids[0], nullptr, 0);
+	cout << "-> Killed worker " << pids[0] << " while it held " << victim_task << endl;
+	for (size_t k = 1; k < pids.size(); ++k)
+		waitpid(pids[k], nullptr, 0);
+
+	// Check that every task was completed exactly once (and the victim's task by another worker)
+	std::vector<std::string> errors;
+	if (victim_task.empty())
+		errors.push_back("the victim did not claim a second task");
+	std::map<std::string, std::vector<std::string>> completed;
+	std::ifstream log(test.dir + "/completed");
+	std::string task, pid;
+	while (log >> task >> pid)
+		completed[task].push_back(pid);
+	for (int n = 0; n < test.tasks; ++n)
+	{
+		std::string name = task_name(n);
+		if (completed[name].size() != 1)
+			errors.push_back(name + " completed " + std::to_string(completed[name].size()) + " times");
+		if (std::ifstream(test.dir + "/" + name + ".done").fail())
+			errors.push_back(name + " has no done marker");
+		if (!std::ifstream(test.dir + "/" + name + ".lock").fail())
+			errors.push_back(name + " is still locked");
+	}
+	if (!victim_task.empty() and completed[victim_task].size() == 1 and completed[victim_task][0] == std::to_string(pids[0]))
+		errors.push_back(victim_task + " completed by the killed worker");
+
+	if (!errors.empty())
+	{
+		for (const std::string &error : errors)
+			cout << "Error: " << error << endl;
+		cout << "FAILED (queue kept in " << test.dir << ")" << endl;
+		return 1;
+	}
+	cout << "OK: all " << test.tasks << " tasks completed exactly once, " << victim_task;
+	cout << " taken over after the kill" << endl;
+	remove_dir(test.dir);
+	return 0;
+}